@@ -0,0 +1,101 @@
+/**
+ * @file scan_bench.c
+ *
+ * @brief Compares ScanLine() against memchr() framing on synthetic chat text.
+ *
+ * memchr() only finds line boundaries, while ScanLine() also validates the
+ * bytes it passes over, so the comparison shows what validation costs on top
+ * of plain framing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scan.h"
+
+#define kTrafficBytes (64 * 1024 * 1024)
+#define kRounds 5
+
+static const char *const kWords[] = {
+    "hello", "the",   "build", "is",     "green", "again", "lunch?", "ok",
+    "merge", "after", "review", "thanks", "lol",   "ship",  "it",     "now",
+};
+static const char *const kUnicodeWords[] = {"café", "naïve", "日本語", "👍"};
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Fills buf with newline-terminated chat lines of 5 to 200 bytes, about
+ *        one in ten of them containing non-ASCII text.
+ */
+static size_t GenerateTraffic(char *buf, size_t cap) {
+  size_t len = 0;
+
+  srand(42);
+  while (len + 256 < cap) {
+    size_t target = 5 + (size_t)rand() % 196;
+    size_t start = len;
+    int unicode = rand() % 10 == 0;
+
+    while (len - start < target) {
+      const char *word = unicode && rand() % 4 == 0
+                             ? kUnicodeWords[rand() % 4]
+                             : kWords[rand() % 16];
+      len += (size_t)sprintf(buf + len, "%s ", word);
+    }
+    buf[len - 1] = '\r';
+    buf[len++] = '\n';
+  }
+
+  return len;
+}
+
+int main(void) {
+  char *traffic = malloc(kTrafficBytes);
+  if (!traffic) {
+    fprintf(stderr, "scan_bench: out of memory\n");
+    return EXIT_FAILURE;
+  }
+  size_t len = GenerateTraffic(traffic, kTrafficBytes);
+  const uint8_t *bytes = (const uint8_t *)traffic;
+
+  printf("Traffic: %zu bytes, ScanLine implementation: %s\n", len,
+         ScanImplementation());
+
+  for (int round = 0; round < kRounds; round++) {
+    size_t lines = 0;
+    double start = Now();
+    for (size_t off = 0; off < len;) {
+      const char *end = memchr(traffic + off, '\n', len - off);
+      off = end ? (size_t)(end - traffic) + 1 : len;
+      lines++;
+    }
+    double memchr_time = Now() - start;
+
+    size_t scanned = 0;
+    size_t invalid = 0;
+    start = Now();
+    for (size_t off = 0; off < len;) {
+      scan_result_t result;
+      ScanLine(bytes + off, len - off, &result);
+      invalid += result.invalid_at != SIZE_MAX;
+      off += result.len + result.found;
+      scanned++;
+    }
+    double scan_time = Now() - start;
+
+    printf("round %d: memchr %.0f MB/s (%zu lines), ScanLine %.0f MB/s "
+           "(%zu lines, %zu invalid)\n",
+           round, (double)len / memchr_time / 1e6, lines,
+           (double)len / scan_time / 1e6, scanned, invalid);
+  }
+
+  free(traffic);
+  return EXIT_SUCCESS;
+}
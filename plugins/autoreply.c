@@ -0,0 +1,48 @@
+/**
+ * @file autoreply.c
+ *
+ * @brief Example plugin that welcomes clients and answers "!ping".
+ *
+ * A minimal plugin, and a starting point for others. Build it with
+ * "make plugins" and load it with "server -P plugins/autoreply.so".
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "plugin_api.h"
+
+static const char *const kBotName = "bot";
+
+static const plugin_host_t *chat = NULL;
+
+static void Welcome(void *state, const plugin_event_t *event) {
+  char reply[128];
+
+  (void)state;
+  snprintf(reply, sizeof(reply), "Welcome, %s! Say !ping to check on me.",
+           event->name);
+  chat->post_message(kBotName, reply, strlen(reply));
+}
+
+static void Answer(void *state, const plugin_event_t *event) {
+  char reply[128];
+
+  (void)state;
+  // The bot's own messages come back through this hook too
+  if (strcmp(event->name, kBotName) == 0 || strcmp(event->body, "!ping") != 0) {
+    return;
+  }
+  snprintf(reply, sizeof(reply), "pong, %s (message #%llu)", event->name,
+           (unsigned long long)event->seq);
+  chat->post_message(kBotName, reply, strlen(reply));
+}
+
+int chat_plugin_init(const plugin_host_t *host, plugin_t *plugin) {
+  chat = host;
+  plugin->abi_version = kPluginAbiVersion;
+  plugin->name = "autoreply";
+  plugin->on_join = &Welcome;
+  plugin->on_message = &Answer;
+  return 0;
+}
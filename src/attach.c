@@ -0,0 +1,440 @@
+/**
+ * @file attach.c
+ *
+ * @brief Content-addressed attachment store served with splice and sendfile.
+ */
+
+#define _GNU_SOURCE
+#include "attach.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "chatroom.h"
+#include "hash.h"
+
+#define kSpliceChunk (64 * 1024)
+
+static int store_fd = -1;  // Directory of the store, or -1 if not open
+static atomic_int transfers;  // Transfers in progress
+
+/**
+ * @brief Maps an attachment's content for reading.
+ *
+ * @param fd    File holding the content.
+ * @param size  Size of the content.
+ *
+ * @return Returns the mapping, an empty string for empty content, or NULL
+ *         if the file could not be mapped.
+ */
+static const uint8_t *MapAttachment(int fd, off_t size) {
+  if (size == 0) {
+    return (const uint8_t *)"";
+  }
+
+  void *data = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  madvise(data, (size_t)size, MADV_SEQUENTIAL);
+  return (const uint8_t *)data;
+}
+
+static void UnmapAttachment(const uint8_t *data, off_t size) {
+  if (size > 0) {
+    munmap((void *)data, (size_t)size);
+  }
+}
+
+/**
+ * @brief Tells whether the stored attachment with the given id has exactly
+ *        the given content.
+ *
+ * @param id    Id the content hashes to.
+ * @param data  Content.
+ * @param size  Size of the content.
+ *
+ * @return Returns 1 if it does, 0 if the id is taken by other content, or -1
+ *         if the stored attachment could not be read.
+ */
+static int SameAttachment(const char *id, const uint8_t *data, off_t size) {
+  struct stat st;
+  int same = -1;
+
+  int fd = openat(store_fd, id, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) == 0) {
+    if (st.st_size != size) {
+      same = 0;
+    } else {
+      const uint8_t *stored = MapAttachment(fd, size);
+      if (stored) {
+        same = memcmp(stored, data, (size_t)size) == 0;
+        UnmapAttachment(stored, size);
+      }
+    }
+  }
+  close(fd);
+
+  return same;
+}
+
+/**
+ * @brief Tells whether a string is a well-formed attachment id.
+ */
+static bool ValidAttachmentId(const char *id) {
+  for (int i = 0; i < kAttachmentIdLen; i++) {
+    if (!isxdigit((unsigned char)id[i]) || isupper((unsigned char)id[i])) {
+      return false;
+    }
+  }
+  return id[kAttachmentIdLen] == '\0';
+}
+
+/**
+ * @brief Sends a response without a body.
+ */
+static void SendStatus(int fd, const char *status) {
+  char reply[128];
+  int len = snprintf(reply, sizeof(reply),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Length: 0\r\n"
+                     "Connection: close\r\n\r\n",
+                     status);
+  send(fd, reply, (size_t)len, MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Receives a request head.
+ *
+ * @param fd    Connection to receive from.
+ * @param head  Buffer of kTransferHeadLimit + 1 bytes. Holds the
+ *              NUL-terminated head, then whatever was received after it.
+ * @param len   Where the number of bytes received is stored.
+ *
+ * @return Returns the length of the head including its blank line, or -1 if
+ *         the connection closed or the head is too large.
+ */
+static ssize_t ReceiveRequestHead(int fd, char *head, size_t *len) {
+  *len = 0;
+  while (*len < kTransferHeadLimit) {
+    ssize_t received = recv(fd, head + *len, kTransferHeadLimit - *len, 0);
+    if (received <= 0) {
+      return -1;
+    }
+    *len += (size_t)received;
+    head[*len] = '\0';
+
+    char *end = strstr(head, "\r\n\r\n");
+    if (end) {
+      end[2] = '\0';
+      return end + 4 - head;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Moves an upload body from the socket to a file through a pipe.
+ *
+ * @param fd         Connection to receive from.
+ * @param file       File to write to.
+ * @param remaining  Number of bytes to move.
+ *
+ * @return Returns 0 on success, or -1 if the connection closed early or
+ *         stalled, or writing failed.
+ */
+static int SpliceBody(int fd, int file, off_t remaining) {
+  int pipefd[2];
+  int status = 0;
+
+  if (pipe(pipefd) < 0) {
+    return -1;
+  }
+
+  while (remaining > 0 && status == 0) {
+    size_t want = remaining < kSpliceChunk ? (size_t)remaining : kSpliceChunk;
+    ssize_t in = splice(fd, NULL, pipefd[1], NULL, want,
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in <= 0) {
+      if (in < 0 && errno == EINTR) {
+        continue;
+      }
+      status = -1;
+      break;
+    }
+    remaining -= in;
+
+    while (in > 0) {
+      ssize_t out = splice(pipefd[0], NULL, file, NULL, (size_t)in,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (out <= 0) {
+        if (out < 0 && errno == EINTR) {
+          continue;
+        }
+        status = -1;
+        break;
+      }
+      in -= out;
+    }
+  }
+
+  close(pipefd[0]);
+  close(pipefd[1]);
+  return status;
+}
+
+/**
+ * @brief Stores an upload and answers with its id.
+ *
+ * The body goes into an unnamed file in the store, which is linked under
+ * its content hash once complete. If that name exists and holds the same
+ * content, the content is already stored and the new copy is dropped when
+ * the file is closed. Different content with the same hash is refused.
+ *
+ * @param fd        Connection to serve.
+ * @param head      NUL-terminated request head.
+ * @param body      Part of the body received with the head.
+ * @param body_len  Length of that part.
+ */
+static void StoreUpload(int fd, const char *head, const char *body,
+                        size_t body_len) {
+  char value[32];
+  char *end;
+
+  if (FindHttpHeader(head, "Content-Length", value, sizeof(value)) < 0) {
+    SendStatus(fd, "411 Length Required");
+    return;
+  }
+  errno = 0;
+  long long size = strtoll(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || size < 0 ||
+      (off_t)size < (off_t)body_len) {
+    SendStatus(fd, "400 Bad Request");
+    return;
+  }
+  if ((off_t)size > kAttachmentLimit) {
+    SendStatus(fd, "413 Content Too Large");
+    return;
+  }
+
+  int file = openat(store_fd, ".", O_TMPFILE | O_RDWR, 0644);
+  if (file < 0) {
+    PrintError("Failed to create attachment: %s\n", strerror(errno));
+    SendStatus(fd, "500 Internal Server Error");
+    return;
+  }
+
+  const uint8_t *data = NULL;
+  if (write(file, body, body_len) != (ssize_t)body_len ||
+      SpliceBody(fd, file, (off_t)size - (off_t)body_len) < 0) {
+    goto close_file;
+  }
+  if (!(data = MapAttachment(file, (off_t)size))) {
+    PrintError("Failed to hash attachment: %s\n", strerror(errno));
+    SendStatus(fd, "500 Internal Server Error");
+    goto close_file;
+  }
+
+  char id[kAttachmentIdLen + 1];
+  char path[32];
+  snprintf(id, sizeof(id), "%016" PRIx64, HashBytes(data, (size_t)size));
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", file);
+  if (linkat(AT_FDCWD, path, store_fd, id, AT_SYMLINK_FOLLOW) == 0) {
+    printf("Stored attachment %s (%lld bytes)\n", id, size);
+  } else if (errno != EEXIST) {
+    PrintError("Failed to store attachment: %s\n", strerror(errno));
+    SendStatus(fd, "500 Internal Server Error");
+    goto close_file;
+  } else {
+    int same = SameAttachment(id, data, (off_t)size);
+    if (same <= 0) {
+      PrintError("Attachment %s %s\n", id,
+                 same == 0 ? "collides with stored content"
+                           : "could not be compared");
+      SendStatus(fd, same == 0 ? "409 Conflict" : "500 Internal Server Error");
+      goto close_file;
+    }
+    printf("Attachment %s already stored (%lld bytes)\n", id, size);
+  }
+
+  char reply[128];
+  int len = snprintf(reply, sizeof(reply),
+                     "HTTP/1.1 201 Created\r\n"
+                     "Content-Length: %d\r\n"
+                     "Connection: close\r\n\r\n"
+                     "%s\n",
+                     kAttachmentIdLen + 1, id);
+  send(fd, reply, (size_t)len, MSG_NOSIGNAL);
+
+close_file:
+  if (data) {
+    UnmapAttachment(data, (off_t)size);
+  }
+  close(file);
+}
+
+/**
+ * @brief Sends an attachment with sendfile().
+ *
+ * @param fd  Connection to serve.
+ * @param id  Id of the attachment.
+ */
+static void SendAttachment(int fd, const char *id) {
+  struct stat st;
+  int file = -1;
+
+  if (!ValidAttachmentId(id) ||
+      (file = openat(store_fd, id, O_RDONLY | O_CLOEXEC)) < 0 ||
+      fstat(file, &st) < 0) {
+    SendStatus(fd, "404 Not Found");
+    goto close_file;
+  }
+
+  char header[160];
+  int len = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: application/octet-stream\r\n"
+                     "Content-Length: %jd\r\n"
+                     "Connection: close\r\n\r\n",
+                     (intmax_t)st.st_size);
+  if (send(fd, header, (size_t)len, MSG_NOSIGNAL | MSG_MORE) != len) {
+    goto close_file;
+  }
+
+  off_t offset = 0;
+  while (offset < st.st_size) {
+    ssize_t sent = sendfile(fd, file, &offset, (size_t)(st.st_size - offset));
+    if (sent <= 0 && !(sent < 0 && errno == EINTR)) {
+      break;
+    }
+  }
+
+close_file:
+  if (file >= 0) {
+    close(file);
+  }
+}
+
+/**
+ * @brief Serves one request on the file port.
+ *
+ * @param arg  Accepted connection.
+ *
+ * @return Returns NULL once the connection is closed.
+ */
+static void *ServeTransfer(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char head[kTransferHeadLimit + 1];
+  size_t len;
+
+  ssize_t head_len = ReceiveRequestHead(fd, head, &len);
+  if (head_len < 0) {
+    SendStatus(fd, "400 Bad Request");
+  } else if (strncmp(head, "PUT /", 5) == 0) {
+    StoreUpload(fd, head, head + head_len, len - (size_t)head_len);
+  } else if (strncmp(head, "GET /", 5) == 0) {
+    char id[kAttachmentIdLen + 1];
+    size_t id_len = strcspn(head + 5, " ");
+    if (id_len == kAttachmentIdLen) {
+      memcpy(id, head + 5, kAttachmentIdLen);
+      id[kAttachmentIdLen] = '\0';
+      SendAttachment(fd, id);
+    } else {
+      SendStatus(fd, "404 Not Found");
+    }
+  } else {
+    SendStatus(fd, "405 Method Not Allowed");
+  }
+
+  close(fd);
+  atomic_fetch_sub(&transfers, 1);
+  return NULL;
+}
+
+/**
+ * @brief Opens the attachment store, creating its directory if needed.
+ *
+ * @param dir  Directory of the store.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+int OpenAttachmentStore(const char *dir) {
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    return -1;
+  }
+  store_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return store_fd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Accepts a connection on the file port and serves it on a thread of
+ *        its own.
+ *
+ * Connections beyond kMaxTransfers are turned away, and transfers that
+ * stall for kTransferTimeoutMs are dropped.
+ *
+ * @param sockfd  Listening socket for file transfers.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+int AcceptTransfer(int sockfd) {
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  int fd = accept(sockfd, NULL, NULL);
+  if (fd < 0) {
+    PrintError("Failed to accept transfer: %s\n", strerror(errno));
+    return -1;
+  }
+  if (atomic_fetch_add(&transfers, 1) >= kMaxTransfers) {
+    SendStatus(fd, "503 Service Unavailable");
+    close(fd);
+    atomic_fetch_sub(&transfers, 1);
+    return -1;
+  }
+
+  struct timeval timeout = {.tv_sec = kTransferTimeoutMs / 1000,
+                            .tv_usec = (kTransferTimeoutMs % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int status = pthread_create(&tid, &attr, &ServeTransfer,
+                              (void *)(intptr_t)fd);
+  pthread_attr_destroy(&attr);
+  if (status != 0) {
+    PrintError("Failed to start transfer thread\n");
+    close(fd);
+    atomic_fetch_sub(&transfers, 1);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Looks an attachment up in the store.
+ *
+ * @param id    Attachment id.
+ * @param size  Where the attachment's size is stored.
+ *
+ * @return Returns 0 if the attachment is stored, or -1 otherwise.
+ */
+int FindAttachment(const char *id, off_t *size) {
+  struct stat st;
+
+  if (store_fd < 0 || !ValidAttachmentId(id) ||
+      fstatat(store_fd, id, &st, 0) < 0) {
+    return -1;
+  }
+  *size = st.st_size;
+  return 0;
+}
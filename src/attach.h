@@ -0,0 +1,38 @@
+#ifndef ATTACH_H_
+#define ATTACH_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Attachments. With -f FILE_PORT the server takes uploads and downloads of
+// files on a port of their own, so large transfers never share a connection
+// or a thread with chat traffic. The port speaks just enough HTTP/1.1 for
+// curl and browsers, one request per connection:
+//
+//   PUT /NAME  Stores the request body, Content-Length bytes, and answers
+//              201 Created with the attachment id as the body. NAME is
+//              optional and ignored.
+//   GET /ID    Answers 200 OK with the attachment, or 404 Not Found.
+//
+// Attachments live in a content-addressed store: a directory (-a DIR) with
+// one file per attachment, named after the HashBytes() hash of its content
+// written as kAttachmentIdLen hex digits, so a file uploaded twice is stored
+// once. A new upload whose hash names a stored file is compared with it
+// byte for byte, and refused if the two differ.
+// Uploads are spliced from the socket into an unnamed file through a pipe
+// and linked into place once complete; downloads are sent from the page
+// cache with sendfile(). File data is never copied through user space.
+
+#define kAttachmentIdLen 16
+#define kAttachmentLimit ((off_t)64 * 1024 * 1024)  // Largest upload
+#define kMaxTransfers 8  // Uploads and downloads in progress
+#define kTransferTimeoutMs 30000  // Longest a transfer may stall
+#define kTransferHeadLimit 4096   // Largest request head
+
+static const char *const kDefaultAttachmentDir = "attachments";
+
+int OpenAttachmentStore(const char *dir);
+int AcceptTransfer(int sockfd);
+int FindAttachment(const char *id, off_t *size);
+
+#endif  // ATTACH_H_
@@ -0,0 +1,213 @@
+/**
+ * @file automaton.c
+ *
+ * @brief Aho-Corasick multi-pattern matching.
+ */
+
+#include "automaton.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define kNoPattern UINT32_MAX
+
+struct automaton {
+  uint8_t classes[256];  // Column of each byte, 0 for bytes in no pattern
+  size_t nclasses;
+  size_t nstates;
+  uint32_t *next;     // nstates rows of nclasses transitions, state 0 is root
+  uint32_t *output;   // First pattern ending in each state, or kNoPattern
+  uint32_t *suffix;   // Nearest state on the failure path with an output
+  uint32_t *chain;    // Next pattern ending in the same state, per pattern
+  uint32_t *lengths;  // Length of each pattern
+};
+
+static bool IsWordByte(unsigned char c) {
+  return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+/**
+ * @brief Tells whether a match is a whole word of the text.
+ *
+ * @param text   Text scanned.
+ * @param len    Length of the text.
+ * @param start  Where the match starts.
+ * @param end    Where the match ends.
+ *
+ * @return Returns true unless the match is preceded or followed by a letter,
+ *         a digit, '_' or a non-ASCII byte.
+ */
+bool IsWholeWord(const char *text, size_t len, size_t start, size_t end) {
+  return !(start > 0 && IsWordByte((unsigned char)text[start - 1])) &&
+         !(end < len && IsWordByte((unsigned char)text[end]));
+}
+
+/**
+ * @brief Frees an automaton.
+ *
+ * @param automaton  Automaton to free, or NULL.
+ */
+void FreeAutomaton(automaton_t *automaton) {
+  if (!automaton) {
+    return;
+  }
+  free(automaton->next);
+  free(automaton->output);
+  free(automaton->suffix);
+  free(automaton->chain);
+  free(automaton->lengths);
+  free(automaton);
+}
+
+/**
+ * @brief Compiles patterns into an automaton.
+ *
+ * Builds the trie of the lowercased patterns, then walks it breadth first to
+ * compute each state's failure link, the state of the longest proper suffix
+ * of its path that is in the trie, and replaces every missing transition
+ * with the one the failure link takes. Scanning then never backtracks.
+ *
+ * @param patterns   NUL-terminated patterns, none of them empty.
+ * @param npatterns  Number of patterns.
+ *
+ * @return Returns the automaton, or NULL if allocation failed.
+ */
+automaton_t *BuildAutomaton(const char *const *patterns, size_t npatterns) {
+  uint32_t *fail = NULL;
+  uint32_t *queue = NULL;
+  automaton_t *automaton = calloc(1, sizeof(automaton_t));
+  if (!automaton) {
+    return NULL;
+  }
+
+  automaton->lengths = malloc((npatterns + 1) * sizeof(uint32_t));
+  if (!automaton->lengths) {
+    goto fail;
+  }
+
+  size_t max_states = 1;
+  automaton->nclasses = 1;
+  for (size_t i = 0; i < npatterns; i++) {
+    automaton->lengths[i] = (uint32_t)strlen(patterns[i]);
+    for (size_t j = 0; j < automaton->lengths[i]; j++) {
+      unsigned char c = (unsigned char)tolower((unsigned char)patterns[i][j]);
+      if (!automaton->classes[c]) {
+        automaton->classes[c] = (uint8_t)automaton->nclasses++;
+      }
+    }
+    max_states += automaton->lengths[i];
+  }
+  // Upper case letters take the column of their lower case
+  for (int c = 'A'; c <= 'Z'; c++) {
+    automaton->classes[c] = automaton->classes[tolower(c)];
+  }
+
+  size_t nclasses = automaton->nclasses;
+  automaton->next = calloc(max_states * nclasses, sizeof(uint32_t));
+  automaton->output = malloc(max_states * sizeof(uint32_t));
+  automaton->suffix = calloc(max_states, sizeof(uint32_t));
+  automaton->chain = malloc((npatterns + 1) * sizeof(uint32_t));
+  fail = calloc(max_states, sizeof(uint32_t));
+  queue = malloc(max_states * sizeof(uint32_t));
+  if (!automaton->next || !automaton->output || !automaton->suffix ||
+      !automaton->chain || !fail || !queue) {
+    goto fail;
+  }
+
+  for (size_t s = 0; s < max_states; s++) {
+    automaton->output[s] = kNoPattern;
+  }
+
+  // No state but the root has a transition to the root yet, so 0 marks a
+  // missing one
+  automaton->nstates = 1;
+  for (size_t i = 0; i < npatterns; i++) {
+    uint32_t state = 0;
+    for (size_t j = 0; j < automaton->lengths[i]; j++) {
+      uint8_t c = automaton->classes[(unsigned char)patterns[i][j]];
+      uint32_t *slot = &automaton->next[state * nclasses + c];
+      if (!*slot) {
+        *slot = (uint32_t)automaton->nstates++;
+      }
+      state = *slot;
+    }
+    automaton->chain[i] = automaton->output[state];
+    automaton->output[state] = (uint32_t)i;
+  }
+
+  // Breadth first, so the row of a state's failure link, which is shallower,
+  // is complete before the state's own row is filled in from it
+  size_t head = 0;
+  size_t tail = 0;
+  for (size_t c = 0; c < nclasses; c++) {
+    if (automaton->next[c]) {
+      queue[tail++] = automaton->next[c];
+    }
+  }
+  while (head < tail) {
+    uint32_t state = queue[head++];
+    uint32_t *row = &automaton->next[state * nclasses];
+    const uint32_t *fail_row = &automaton->next[fail[state] * nclasses];
+
+    for (size_t c = 0; c < nclasses; c++) {
+      uint32_t child = row[c];
+      if (!child) {
+        row[c] = fail_row[c];
+        continue;
+      }
+      fail[child] = fail_row[c];
+      automaton->suffix[child] =
+          automaton->output[fail[child]] != kNoPattern
+              ? fail[child]
+              : automaton->suffix[fail[child]];
+      queue[tail++] = child;
+    }
+  }
+
+  free(fail);
+  free(queue);
+  return automaton;
+
+fail:
+  free(fail);
+  free(queue);
+  FreeAutomaton(automaton);
+  return NULL;
+}
+
+/**
+ * @brief Finds every occurrence of the patterns in a text.
+ *
+ * Occurrences are reported in the order they end, and those ending at the
+ * same byte longest first.
+ *
+ * @param automaton  Automaton to scan with.
+ * @param text       Text to scan.
+ * @param len        Length of the text.
+ * @param match      Called for every occurrence.
+ * @param arg        Passed to match.
+ */
+void ScanAutomaton(const automaton_t *automaton, const char *text,
+                   size_t len, automaton_match_fn match, void *arg) {
+  uint32_t state = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = automaton->classes[(unsigned char)text[i]];
+    state = automaton->next[state * automaton->nclasses + c];
+
+    // Walk the states of the suffixes of the text read so far that end
+    // a pattern
+    uint32_t s = automaton->output[state] != kNoPattern
+                     ? state
+                     : automaton->suffix[state];
+    for (; s != 0; s = automaton->suffix[s]) {
+      for (uint32_t p = automaton->output[s]; p != kNoPattern;
+           p = automaton->chain[p]) {
+        if (!match(p, i + 1 - automaton->lengths[p], i + 1, arg)) {
+          return;
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef AUTOMATON_H_
+#define AUTOMATON_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Aho-Corasick automaton for finding many patterns in a text at once. The
+// patterns are compiled into a trie whose missing transitions are filled in
+// from the failure links, so scanning a text takes one table lookup per byte
+// however many patterns there are. Bytes that appear in no pattern share one
+// column of the transition table, which keeps it small. Matching ignores
+// ASCII case.
+//
+// An automaton is immutable once built and may be scanned by any number of
+// threads at the same time. Patterns are identified by their index in the
+// array the automaton was built from.
+
+typedef struct automaton automaton_t;
+
+// Called for every occurrence of a pattern, text[start, end); returns false
+// to stop the scan
+typedef bool (*automaton_match_fn)(size_t pattern, size_t start, size_t end,
+                                   void *arg);
+
+automaton_t *BuildAutomaton(const char *const *patterns, size_t npatterns);
+void FreeAutomaton(automaton_t *automaton);
+void ScanAutomaton(const automaton_t *automaton, const char *text,
+                   size_t len, automaton_match_fn match, void *arg);
+bool IsWholeWord(const char *text, size_t len, size_t start, size_t end);
+
+#endif  // AUTOMATON_H_
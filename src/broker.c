@@ -0,0 +1,355 @@
+/**
+ * @file broker.c
+ *
+ * @brief Pub/sub broker relaying room traffic between co-located servers.
+ */
+
+#include "broker.h"
+
+#include <fcntl.h>
+#include <sys/un.h>
+
+#include "chatroom.h"
+
+#define kBrokerInputCap (2 * (kFrameHeaderLen + kBrokerPayloadLimit))
+
+typedef struct {
+  int fd;
+  bool greeted;  // Whether kBackplaneMagic was received
+  uint8_t in[kBrokerInputCap];
+  size_t in_len;
+  uint8_t *out;  // Frames waiting for the socket to become writable
+  size_t out_len;
+  size_t out_cap;
+  size_t dropped;
+} broker_client_t;
+
+typedef struct {
+  char name[kNameCharLimit];
+  uint64_t subscribers;  // Bit i is set if clients[i] subscribed
+} topic_t;
+
+static broker_client_t *clients[kMaxBrokerClients];
+static topic_t topics[kBrokerTopics];
+
+/**
+ * @brief Finds a topic, optionally creating it.
+ *
+ * Topics are never removed, only left without subscribers, since a chat
+ * has few rooms and they tend to come back.
+ *
+ * @return Returns the topic, or NULL if it does not exist and could not be
+ *         created.
+ */
+static topic_t *FindTopic(const uint8_t *name, size_t len, bool create) {
+  uint32_t hash = 2166136261u;
+
+  if (len == 0 || len >= kNameCharLimit) {
+    return NULL;
+  }
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ name[i]) * 16777619u;
+  }
+
+  for (size_t n = 0; n < kBrokerTopics; n++) {
+    topic_t *topic = &topics[(hash + n) % kBrokerTopics];
+    if (topic->name[0] == '\0') {
+      if (!create) {
+        return NULL;
+      }
+      memcpy(topic->name, name, len);
+      topic->name[len] = '\0';
+      return topic;
+    }
+    if (strncmp(topic->name, (const char *)name, len) == 0 &&
+        topic->name[len] == '\0') {
+      return topic;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Queues bytes for a client, dropping them if its queue is full.
+ */
+static void QueueOutput(broker_client_t *client, const uint8_t *buf,
+                        size_t len) {
+  size_t need = client->out_len + len;
+
+  if (need > client->out_cap && need <= kBrokerQueueBytes) {
+    size_t cap = client->out_cap ? client->out_cap : 64 * 1024;
+    while (cap < need) {
+      cap *= 2;
+    }
+    uint8_t *out = realloc(client->out, cap);
+    if (out) {
+      client->out = out;
+      client->out_cap = cap;
+    }
+  }
+
+  if (need > client->out_cap) {
+    client->dropped++;
+    return;
+  }
+  memcpy(client->out + client->out_len, buf, len);
+  client->out_len = need;
+}
+
+/**
+ * @brief Sends as much queued output as the socket takes without blocking.
+ *
+ * @return Returns 0 on success, or -1 if the client should be dropped.
+ */
+static int FlushOutput(broker_client_t *client) {
+  size_t sent_total = 0;
+
+  while (sent_total < client->out_len) {
+    ssize_t sent = send(client->fd, client->out + sent_total,
+                        client->out_len - sent_total,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    sent_total += (size_t)sent;
+  }
+
+  memmove(client->out, client->out + sent_total,
+          client->out_len - sent_total);
+  client->out_len -= sent_total;
+  return 0;
+}
+
+/**
+ * @brief Handles one frame from a server.
+ *
+ * @param index  Index of the sender in clients.
+ * @param raw    Encoded frame, forwarded unchanged for PUBLISH.
+ * @param len    Size of the encoded frame.
+ * @param frame  Parsed frame.
+ *
+ * @return Returns 0 on success, or -1 if the frame is malformed.
+ */
+static int HandleBrokerFrame(size_t index, const uint8_t *raw, size_t len,
+                             const frame_t *frame) {
+  const uint8_t *name;
+  size_t name_len;
+  uint64_t bit = (uint64_t)1 << index;
+
+  if (ParseString(frame->payload, frame->len, &name, &name_len) < 0) {
+    return -1;
+  }
+
+  topic_t *topic = FindTopic(name, name_len, frame->type == kFrameSubscribe);
+  switch (frame->type) {
+    case kFrameSubscribe:
+      if (!topic) {
+        PrintError("Too many topics; ignoring subscription\n");
+        return 0;
+      }
+      topic->subscribers |= bit;
+      return 0;
+    case kFrameUnsubscribe:
+      if (topic) {
+        topic->subscribers &= ~bit;
+      }
+      return 0;
+    case kFramePublish:
+      if (!topic) {
+        return 0;
+      }
+      for (size_t i = 0; i < kMaxBrokerClients; i++) {
+        if (i != index && (topic->subscribers >> i & 1)) {
+          QueueOutput(clients[i], raw, len);
+        }
+      }
+      return 0;
+    default:
+      return 0;  // Ignore frame types from newer servers
+  }
+}
+
+/**
+ * @brief Reads from a server and handles every complete frame.
+ *
+ * @return Returns 0 on success, or -1 if the client should be dropped.
+ */
+static int ReadClient(size_t index) {
+  broker_client_t *client = clients[index];
+  frame_t frame;
+
+  ssize_t received = recv(client->fd, client->in + client->in_len,
+                          kBrokerInputCap - client->in_len, MSG_DONTWAIT);
+  if (received < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return 0;
+  }
+  if (received <= 0) {
+    return -1;
+  }
+  client->in_len += (size_t)received;
+
+  size_t off = 0;
+  if (!client->greeted) {
+    if (client->in_len < kBackplaneMagicLen) {
+      return 0;
+    }
+    if (memcmp(client->in, kBackplaneMagic, kBackplaneMagicLen) != 0) {
+      PrintError("Malformed backplane handshake\n");
+      return -1;
+    }
+    client->greeted = true;
+    off = kBackplaneMagicLen;
+  }
+
+  ssize_t frame_len;
+  while ((frame_len = ParseFrame(client->in + off, client->in_len - off,
+                                 kBrokerPayloadLimit, &frame)) > 0) {
+    if (HandleBrokerFrame(index, client->in + off, (size_t)frame_len,
+                          &frame) < 0) {
+      frame_len = -1;
+      break;
+    }
+    off += (size_t)frame_len;
+  }
+  if (frame_len < 0) {
+    PrintError("Malformed frame from server\n");
+    return -1;
+  }
+
+  memmove(client->in, client->in + off, client->in_len - off);
+  client->in_len -= off;
+  return 0;
+}
+
+/**
+ * @brief Disconnects a server and drops its subscriptions.
+ */
+static void DropClient(size_t index) {
+  broker_client_t *client = clients[index];
+  uint64_t bit = (uint64_t)1 << index;
+
+  for (size_t i = 0; i < kBrokerTopics; i++) {
+    topics[i].subscribers &= ~bit;
+  }
+  if (client->dropped > 0) {
+    PrintError("Dropped %zu frames queued for a server\n", client->dropped);
+  }
+
+  printf("Server disconnected from the broker\n");
+  close(client->fd);
+  free(client->out);
+  free(client);
+  clients[index] = NULL;
+}
+
+/**
+ * @brief Accepts a server connecting to the broker.
+ */
+static void AcceptClient(int sockfd) {
+  int fd = accept(sockfd, NULL, NULL);
+  if (fd < 0) {
+    PrintError("Failed to accept server: %s\n", strerror(errno));
+    return;
+  }
+
+  for (size_t i = 0; i < kMaxBrokerClients; i++) {
+    if (!clients[i]) {
+      clients[i] = calloc(1, sizeof(broker_client_t));
+      if (!clients[i]) {
+        break;
+      }
+      clients[i]->fd = fd;
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      printf("Server connected to the broker\n");
+      return;
+    }
+  }
+
+  PrintError("Too many servers; refusing connection\n");
+  close(fd);
+}
+
+/**
+ * @brief Runs the broker on a Unix socket until an error occurs.
+ *
+ * The broker is a single thread polling every server: it only routes frames,
+ * so there is no per-message work worth spreading across threads.
+ * Output to slow servers is buffered and sent as their sockets drain.
+ *
+ * @param path  Path of the Unix socket to listen on. An existing socket file
+ *              is replaced.
+ *
+ * @return Returns -1 on error.
+ */
+int RunBroker(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct pollfd fds[1 + kMaxBrokerClients];
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    PrintError("Broker socket path too long: %s\n", path);
+    return -1;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    PrintError("Failed to create broker socket: %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sockfd, kMaxBrokerClients) < 0) {
+    PrintError("Failed to listen on %s: %s\n", path, strerror(errno));
+    close(sockfd);
+    return -1;
+  }
+  printf("Broker listening on %s\n", path);
+
+  while (1) {
+    fds[0] = (struct pollfd){.fd = sockfd, .events = POLLIN};
+    for (size_t i = 0; i < kMaxBrokerClients; i++) {
+      broker_client_t *client = clients[i];
+      fds[i + 1].fd = client ? client->fd : -1;
+      fds[i + 1].events = client && client->out_len ? POLLIN | POLLOUT
+                                                    : POLLIN;
+      fds[i + 1].revents = 0;
+    }
+
+    if (poll(fds, 1 + kMaxBrokerClients, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PrintError("Failed to poll: %s\n", strerror(errno));
+      break;
+    }
+
+    for (size_t i = 0; i < kMaxBrokerClients; i++) {
+      if (clients[i] && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+          ReadClient(i) < 0) {
+        DropClient(i);
+      }
+    }
+
+    // Send what this round queued, leaving the rest for POLLOUT
+    for (size_t i = 0; i < kMaxBrokerClients; i++) {
+      if (clients[i] && clients[i]->out_len && FlushOutput(clients[i]) < 0) {
+        DropClient(i);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      AcceptClient(sockfd);
+    }
+  }
+
+  close(sockfd);
+  unlink(path);
+  return -1;
+}
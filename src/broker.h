@@ -0,0 +1,23 @@
+#ifndef BROKER_H_
+#define BROKER_H_
+
+// Local pub/sub broker, an alternative to linking servers to each other.
+// Servers on the same host connect to the broker's Unix socket, send
+// kBackplaneMagic, and then SUBSCRIBE to the topic of every room they have
+// members in. PUBLISH frames are forwarded unchanged to every other server
+// subscribed to their topic, so a server only receives traffic for its
+// rooms:
+//
+//   SUBSCRIBE, UNSUBSCRIBE  topic (length-prefixed)
+//   PUBLISH                 topic (length-prefixed) | RELAY payload
+
+#define kBackplaneMagic "\0CRB"
+#define kBackplaneMagicLen 4
+#define kMaxBrokerClients 64          // Subscribers are kept in a bitmask
+#define kBrokerTopics 1024            // Distinct topics the broker tracks
+#define kBrokerPayloadLimit (16 * 1024)
+#define kBrokerQueueBytes (1024 * 1024)  // Frames beyond this are dropped
+
+int RunBroker(const char *path);
+
+#endif  // BROKER_H_
@@ -2,52 +2,178 @@
 #define CHATROOM_H_
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "attach.h"
+#include "automaton.h"
+#include "broker.h"
+#include "epoch.h"
+#include "federation.h"
+#include "filter.h"
+#include "heartbeat.h"
+#include "history.h"
+#include "mention.h"
+#include "moderation.h"
+#include "msglog.h"
+#include "outbox.h"
+#include "plugin.h"
+#include "protocol.h"
+#include "scan.h"
+#include "search.h"
+#include "session.h"
+#include "shm.h"
+#include "websocket.h"
+
 #define kNameCharLimit 64
+#define kMessageCharLimit 4096
 #define kMaxClients 10
 
-const size_t kMessageCharLimit = 4096;
-const in_port_t kDefaultPort = 13000;
-const int kTimeout = 60000;  // milliseconds
-const size_t kMaxConnectionAttempts = 5;
-const char *kPromptString = "> ";
-const in_port_t kMaxPort = 65535;
-const char *kDefaultHostname = "localhost";
-const char *kExitCommand = "/exit";
+static const in_port_t kDefaultPort = 13000;
+static const int kTimeout = 60000;  // milliseconds
+static const size_t kMaxConnectionAttempts = 5;
+static const char *const kPromptString = "> ";
+static const in_port_t kMaxPort = 65535;
+static const char *const kDefaultHostname = "localhost";
+static const char *const kExitCommand = "/exit";
+static const char *const kDirectCommand = "/msg";
+static const char *const kAttachCommand = "/attach";
+static const char *const kSearchCommand = "/search";
+static const char *const kSinceCommand = "/since";
+static const char *const kWatchCommand = "/watch";
+static const char *const kUnwatchCommand = "/unwatch";
+static const char *const kFiltersCommand = "/filters";
+static const char *const kOpCommand = "/op";
+static const char *const kKickCommand = "/kick";
+static const char *const kMuteCommand = "/mute";
+static const char *const kUnmuteCommand = "/unmute";
+static const char *const kBanCommand = "/ban";
+static const char *const kUnbanCommand = "/unban";
+static const char *const kLongCommandNotice = "Command too long, not sent";
+static const char *const kDefaultRoom = "lobby";  // The only room so far
+// Joins and leaves in rooms larger than this are sent as periodic digests,
+// except to clients subscribed to presence (-d changes it, below kMaxClients)
+static const size_t kDigestRoomSize = 5;
+static const int kDigestIntervalMs = 1000;
+static const size_t kDefaultStreamLimitMb = 1;  // See -m
+static const int kStreamPaceMs = 10;
+static const int kStreamPaceLimitMs = 5000;
+static const size_t kRangeLimit = 1000;  // Messages sent per time range
 
-typedef struct {
+// Large enough for any event encoded in any protocol
+#define kEventBufferSize                                               \
+  (2 * kFrameHeaderLen + kWebSocketMaxHeaderLen + kNameCharLimit + \
+   kPatternLimit + kMessageCharLimit + 64)
+
+// Client handles pack the pool slot index in the low 32 bits and the slot
+// generation in the high 32 bits. Generations start at 1, so a handle of 0
+// never refers to a live client.
+typedef uint64_t client_handle_t;
+
+#define kInvalidHandle ((client_handle_t)0)
+#define HandleIndex(handle) ((uint32_t)((handle) & 0xFFFFFFFFu))
+#define HandleGeneration(handle) ((uint32_t)((handle) >> 32))
+#define MakeHandle(generation, index) \
+  (((client_handle_t)(generation) << 32) | (client_handle_t)(index))
+
+// Listener a client connected through
+typedef enum { kTransportTcp, kTransportWebSocket } transport_t;
+
+// Clients are read without the pool mutex by broadcasting threads, so a
+// removed client is retired through the epoch reclaimer rather than freed.
+// Its socket stays open until then so the descriptor cannot be reused by a
+// new connection while a broadcaster may still be sending on it.
+typedef struct client {
   int connfd;
-  int uid;
+  transport_t transport;
+  struct in_addr addr;  // Address it connected from
+  _Atomic client_handle_t handle;
   char name[kNameCharLimit];
+  _Atomic protocol_t protocol;
+  uint64_t features;  // Binary protocol features negotiated in HELLO
+  uint64_t resume_seq;     // Last message the client had, or its session acked
+  _Atomic uint64_t acked;  // Highest sequence number the client acked
+  uint64_t session;        // Token of its resumable session, or 0
+  bool resumed;            // Took over a session held after a drop
+  bool leaving;            // Asked to leave, so its session is not held
+  _Atomic bool kicked;     // Removed by a moderator, so neither is it
+  bool moderator;          // Gave the moderator password with /op
+  uint8_t op_failures;     // Wrong passwords it gave with /op
+  pthread_mutex_t send_mutex;  // Orders what concurrent senders queue
+  outbox_t outbox;
+  heartbeat_t heartbeat;  // Guarded by the timing wheel's mutex
+  // Large message the client is streaming, see CHUNK in protocol.h
+  uint64_t stream;      // Id of the open stream, or 0
+  size_t stream_len;    // Bytes received on it so far
+  uint8_t carry[3];     // Incomplete UTF-8 character held for the next chunk
+  size_t carry_len;
+  epoch_entry_t retire;
 } client_t;
 
 typedef struct {
-  client_t *clients[kMaxClients];
+  _Atomic(client_t *) client;
+  _Atomic uint32_t generation;
+} client_slot_t;
+
+// Immutable list of the clients currently in the chat. Writers publish a new
+// snapshot on every join or leave and retire the old one, so broadcasters can
+// iterate the list without taking any lock.
+typedef struct {
   size_t len;
-  pthread_mutex_t mutex;
+  epoch_entry_t retire;
+  client_t *members[];
+} membership_t;
+
+typedef struct {
+  client_slot_t slots[kMaxClients];
+  _Atomic(membership_t *) members;
+  atomic_size_t len;
+  pthread_mutex_t mutex;  // Serializes membership writers
 } client_pool_t;
 
 void PrintUsage(void);
 void PrintError(const char *format, ...);
 
 // Server
+int ParsePort(const char *str, in_port_t *port);
+int ParseCount(const char *str, size_t *count);
 client_t *AcceptConnection(int sockfd);
 int SetupServerSocket(in_port_t port, struct sockaddr_in *servaddr);
-int BroadcastMessage(char *msg, int uid);
-void RemoveClient(int uid);
+int BroadcastEvent(const chat_event_t *event, client_handle_t sender);
+int AnnouncePresence(const chat_event_t *event, client_handle_t sender);
+void *DigestPresence(void *arg);
+int SendEvent(client_t *cli, const chat_event_t *event);
+int SendToClient(client_t *cli, outbox_lane_t lane, const void *buf,
+                 size_t len);
+client_t *FindClientByName(const char *name);
+int HandleTextLine(client_t *cli, char *msg);
+int PostMessage(client_t *cli, const char *body, size_t body_len);
+int PublishMessage(client_handle_t sender, const char *name, const char *body,
+                   size_t body_len);
+void RejectMessage(client_handle_t sender, const char *reason);
+int PostPluginMessage(const char *name, const char *body, size_t body_len);
+int PostChunk(client_t *cli, const uint8_t *data, size_t len, bool final);
+void DeliverRemoteEvent(const chat_event_t *event);
+void SendNotice(client_t *cli, const char *notice);
+void RemoveClient(client_handle_t handle);
 int AddClient(client_t *cli);
+client_t *LookupClient(client_handle_t handle);
 void *HandleClient(void *arg);
 
 enum { kServer, kClient };
@@ -0,0 +1,106 @@
+/**
+ * @file compress.c
+ *
+ * @brief Dictionary-primed deflate compression for bulk transfers.
+ */
+
+#include "compress.h"
+
+#include <zlib.h>
+
+#define kDeflateLevel 6
+#define kDeflateWindowBits (-15)  // Raw deflate without zlib framing
+#define kDeflateMemLevel 8
+
+// zlib favors matches near the end of the dictionary, so the most frequent
+// strings come last. Chat lines are short, which leaves little history for
+// the compressor to find matches in; the dictionary supplies it up front.
+const char kChatDictionary[] =
+    "https://www. .com/ .org/ github issue pull request commit branch deploy "
+    "build test failed passed error warning log server client please could "
+    "would should maybe probably actually really thanks thank you sorry "
+    "morning afternoon tonight tomorrow yesterday today meeting review "
+    "because about after again before there their these those what when "
+    "where which while with from have this that will your just like know "
+    "think good great sure yeah yes okay ok lol haha hi hey hello bye "
+    " has left the chat === has joined the chat ===\n=== "
+    " the to and of a in is it for on you I that be are ";
+const size_t kChatDictionaryLen = sizeof(kChatDictionary) - 1;
+
+/**
+ * @brief Returns the largest compressed size of len input bytes.
+ */
+size_t CompressBound(size_t len) {
+  return (size_t)compressBound((uLong)len);
+}
+
+/**
+ * @brief Compresses a block against the chat dictionary.
+ *
+ * @param in   Bytes to compress.
+ * @param len  Number of bytes in in.
+ * @param out  Destination buffer, ideally CompressBound(len) bytes.
+ * @param cap  Size of out.
+ *
+ * @return Returns the compressed size, or 0 if compression failed or the
+ *         result does not fit in out.
+ */
+size_t CompressBlock(const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+  z_stream stream = {0};
+  size_t compressed = 0;
+
+  if (deflateInit2(&stream, kDeflateLevel, Z_DEFLATED, kDeflateWindowBits,
+                   kDeflateMemLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return 0;
+  }
+
+  if (deflateSetDictionary(&stream, (const Bytef *)kChatDictionary,
+                           (uInt)kChatDictionaryLen) == Z_OK) {
+    stream.next_in = (Bytef *)in;
+    stream.avail_in = (uInt)len;
+    stream.next_out = out;
+    stream.avail_out = (uInt)cap;
+    if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+      compressed = stream.total_out;
+    }
+  }
+
+  deflateEnd(&stream);
+  return compressed;
+}
+
+/**
+ * @brief Inflates a block compressed with CompressBlock().
+ *
+ * @param in   Compressed bytes.
+ * @param len  Number of bytes in in.
+ * @param out  Destination buffer.
+ * @param cap  Size of out. Blocks that inflate to more are rejected.
+ *
+ * @return Returns the inflated size, or -1 if the block is corrupt or too
+ *         large.
+ */
+ssize_t DecompressBlock(const uint8_t *in, size_t len, uint8_t *out,
+                        size_t cap) {
+  z_stream stream = {0};
+  ssize_t inflated = -1;
+
+  if (inflateInit2(&stream, kDeflateWindowBits) != Z_OK) {
+    return -1;
+  }
+
+  // Raw streams take the dictionary up front instead of on Z_NEED_DICT
+  if (inflateSetDictionary(&stream, (const Bytef *)kChatDictionary,
+                           (uInt)kChatDictionaryLen) == Z_OK) {
+    stream.next_in = (Bytef *)in;
+    stream.avail_in = (uInt)len;
+    stream.next_out = out;
+    stream.avail_out = (uInt)cap;
+    if (inflate(&stream, Z_FINISH) == Z_STREAM_END) {
+      inflated = (ssize_t)stream.total_out;
+    }
+  }
+
+  inflateEnd(&stream);
+  return inflated;
+}
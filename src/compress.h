@@ -0,0 +1,21 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Deflate compression primed with a dictionary of common chat text, used for
+// bulk transfers such as history replay. Blocks are raw deflate streams
+// (RFC 1951) compressed against kChatDictionary, so peers must prime their
+// inflater with the same dictionary.
+
+extern const char kChatDictionary[];
+extern const size_t kChatDictionaryLen;
+
+size_t CompressBound(size_t len);
+size_t CompressBlock(const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+ssize_t DecompressBlock(const uint8_t *in, size_t len, uint8_t *out,
+                        size_t cap);
+
+#endif  // COMPRESS_H_
@@ -0,0 +1,203 @@
+/**
+ * @file epoch.c
+ *
+ * @brief Epoch-based memory reclamation for lock-free registry readers.
+ *
+ * Every thread that reads shared objects owns a record announcing the global
+ * epoch it observed when it entered a critical section. The global epoch only
+ * advances once all active records have caught up with it, so an object
+ * retired in epoch e can be destroyed as soon as the global epoch reaches
+ * e + 2. Retired objects wait in one of three limbo lists indexed by epoch.
+ */
+
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define kEpochLimboLists 3
+
+// Records are never freed; a record released by an exiting thread is reused
+// by the next thread that needs one.
+typedef struct epoch_record {
+  _Atomic uint64_t state;  // (observed epoch << 1) | active bit
+  atomic_bool in_use;
+  unsigned int nesting;
+  struct epoch_record *next;
+} epoch_record_t;
+
+static _Atomic uint64_t global_epoch = 0;
+static _Atomic(epoch_record_t *) records = NULL;
+
+static pthread_mutex_t limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
+static epoch_entry_t *limbo[kEpochLimboLists] = {NULL};
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_record_t *self = NULL;
+
+static void ReleaseRecord(void *arg) {
+  epoch_record_t *record = (epoch_record_t *)arg;
+
+  atomic_store(&record->state, 0);
+  atomic_store(&record->in_use, false);
+}
+
+static void CreateRecordKey(void) {
+  pthread_key_create(&record_key, &ReleaseRecord);
+}
+
+/**
+ * @brief Returns the calling thread's record, claiming one on first use.
+ *
+ * Released records are reused before a new one is allocated, so the record
+ * list stays bounded by the peak number of concurrent reader threads.
+ *
+ * @return Returns the thread's record, or NULL if allocation failed.
+ */
+static epoch_record_t *AcquireRecord(void) {
+  if (self) {
+    return self;
+  }
+
+  pthread_once(&record_key_once, &CreateRecordKey);
+
+  epoch_record_t *record;
+  for (record = atomic_load(&records); record; record = record->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&record->in_use, &expected, true)) {
+      break;
+    }
+  }
+
+  if (!record) {
+    record = calloc(1, sizeof(epoch_record_t));
+    if (!record) {
+      return NULL;
+    }
+    atomic_init(&record->state, 0);
+    atomic_init(&record->in_use, true);
+
+    record->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &record->next, record)) {
+    }
+  }
+
+  record->nesting = 0;
+  pthread_setspecific(record_key, record);
+  self = record;
+  return record;
+}
+
+/**
+ * @brief Enters a read-side critical section.
+ *
+ * Objects loaded from shared pointers inside the section stay valid until the
+ * matching EpochExit(). Sections may be nested.
+ */
+void EpochEnter(void) {
+  epoch_record_t *record = AcquireRecord();
+  if (!record) {
+    abort();
+  }
+
+  if (record->nesting++ > 0) {
+    return;
+  }
+
+  // Publish the observed epoch, then confirm it did not move underneath us so
+  // that reclaimers never miss an active reader.
+  uint64_t epoch = atomic_load(&global_epoch);
+  while (1) {
+    atomic_store(&record->state, (epoch << 1) | 1);
+    uint64_t current = atomic_load(&global_epoch);
+    if (current == epoch) {
+      break;
+    }
+    epoch = current;
+  }
+}
+
+/**
+ * @brief Leaves the read-side critical section entered by EpochEnter().
+ */
+void EpochExit(void) {
+  epoch_record_t *record = self;
+
+  if (--record->nesting == 0) {
+    atomic_store(&record->state, 0);
+  }
+}
+
+/**
+ * @brief Tries to advance the global epoch by one.
+ *
+ * Must be called with limbo_mutex held so that retirements are always tagged
+ * with the epoch in effect when they were queued.
+ *
+ * @return Returns the objects that became safe to destroy, or NULL if some
+ *         reader is still behind the global epoch.
+ */
+static epoch_entry_t *AdvanceEpoch(void) {
+  uint64_t epoch = atomic_load(&global_epoch);
+
+  for (epoch_record_t *record = atomic_load(&records); record;
+       record = record->next) {
+    uint64_t state = atomic_load(&record->state);
+    if ((state & 1) && (state >> 1) != epoch) {
+      return NULL;
+    }
+  }
+
+  atomic_store(&global_epoch, epoch + 1);
+
+  // Objects retired two epochs ago can no longer be referenced
+  size_t index = (epoch + 2) % kEpochLimboLists;
+  epoch_entry_t *ready = limbo[index];
+  limbo[index] = NULL;
+  return ready;
+}
+
+static void DestroyRetired(epoch_entry_t *list) {
+  while (list) {
+    epoch_entry_t *next = list->next;
+    list->destroy(list->ptr);
+    list = next;
+  }
+}
+
+/**
+ * @brief Schedules an unlinked object for destruction.
+ *
+ * The caller must already have removed every shared reference to ptr. The
+ * destructor runs once no reader can still be traversing it, possibly on
+ * another thread.
+ *
+ * @param entry    Bookkeeping node embedded in the object.
+ * @param ptr      Object to destroy.
+ * @param destroy  Function that releases the object.
+ */
+void EpochRetire(epoch_entry_t *entry, void *ptr, epoch_destroy_fn destroy) {
+  entry->ptr = ptr;
+  entry->destroy = destroy;
+
+  pthread_mutex_lock(&limbo_mutex);
+  size_t index = atomic_load(&global_epoch) % kEpochLimboLists;
+  entry->next = limbo[index];
+  limbo[index] = entry;
+  pthread_mutex_unlock(&limbo_mutex);
+
+  EpochTryReclaim();
+}
+
+/**
+ * @brief Advances the epoch if possible and destroys objects that are safe.
+ */
+void EpochTryReclaim(void) {
+  pthread_mutex_lock(&limbo_mutex);
+  epoch_entry_t *ready = AdvanceEpoch();
+  pthread_mutex_unlock(&limbo_mutex);
+
+  DestroyRetired(ready);
+}
@@ -0,0 +1,28 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Epoch-based reclamation. Readers bracket lock-free traversals with
+// EpochEnter()/EpochExit(); writers unlink shared objects and hand them to
+// EpochRetire(), which defers the destructor until every reader that could
+// still hold a reference has left its critical section. The epoch advances
+// when objects are retired, when connections are accepted and on every tick
+// of the heartbeat wheel, so retired objects are freed on an idle server too.
+
+typedef void (*epoch_destroy_fn)(void *ptr);
+
+// Embedded in every retirable object so that retiring never allocates.
+typedef struct epoch_entry {
+  void *ptr;
+  epoch_destroy_fn destroy;
+  struct epoch_entry *next;
+} epoch_entry_t;
+
+void EpochEnter(void);
+void EpochExit(void);
+void EpochRetire(epoch_entry_t *entry, void *ptr, epoch_destroy_fn destroy);
+void EpochTryReclaim(void);
+
+#endif  // EPOCH_H_
@@ -0,0 +1,1090 @@
+/**
+ * @file federation.c
+ *
+ * @brief Server-to-server links that relay chat events between servers.
+ */
+
+#include "federation.h"
+
+#include <netdb.h>
+#include <sys/random.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "chatroom.h"
+#include "compress.h"
+
+// Largest RELAY payload: origin, sequence, event type, name and body
+#define kRelayPayloadLimit \
+  (3 * kMaxVarintLen + 1 + kNameCharLimit + kMessageCharLimit)
+#define kRelayFrameLimit (kFrameHeaderLen + kRelayPayloadLimit)
+// PUBLISH carries a topic ahead of the RELAY payload
+#define kPublishPayloadLimit \
+  (kMaxVarintLen + kNameCharLimit + kRelayPayloadLimit)
+#define kPublishFrameLimit (kFrameHeaderLen + kPublishPayloadLimit)
+// Batches are cut at frame boundaries, so one may overshoot by one frame
+#define kLinkChunkLimit (kLinkBatchBytes + kPublishFrameLimit)
+#define kLinkInputCap (2 * (kFrameHeaderLen + kLinkChunkLimit))
+
+typedef enum { kLinkAccepted, kLinkDialed, kLinkBackplane } link_role_t;
+
+typedef struct link {
+  int fd;
+  uint64_t peer;      // Node id of the other side
+  uint64_t features;  // Features both sides enabled
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;  // Signaled when frames are queued or closing is set
+  uint8_t *queue;       // RELAY frames waiting for the writer
+  size_t queue_len;
+  size_t queue_cap;
+  size_t dropped;  // Frames dropped because the queue was full
+  bool closing;
+  bool backplane;  // Connection to a pub/sub broker rather than a server
+  pthread_t writer;
+} link_t;
+
+static link_t *links[kMaxLinks];
+static pthread_mutex_t links_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t node_id;
+static atomic_uint_fast64_t next_seq;
+
+// Rooms with local members, which the backplane connection subscribes to
+static struct {
+  char name[kNameCharLimit];
+  size_t members;
+} topics[kMaxTopics];
+static link_t *backplane;
+static pthread_mutex_t topics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Ids of recently seen events. Two generations of open-addressing sets are
+// kept; when the current one fills up the older one is cleared and takes its
+// place, so an id is remembered for between kDedupeCapacity and twice that
+// many subsequent events.
+static struct {
+  uint64_t ids[2][2 * kDedupeCapacity];
+  size_t count;
+  int current;
+  pthread_mutex_t mutex;
+} seen = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief Picks the random id this server stamps on its events.
+ */
+void InitFederation(void) {
+  if (getrandom(&node_id, sizeof(node_id), 0) != sizeof(node_id)) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    node_id = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^
+              ((uint64_t)getpid() << 48);
+  }
+}
+
+/**
+ * @brief Returns the id of this server.
+ */
+uint64_t LocalNodeId(void) { return node_id; }
+
+/**
+ * @brief Hashes an event id into a non-zero dedupe key.
+ */
+static uint64_t EventKey(uint64_t origin, uint64_t seq) {
+  uint64_t key = origin ^ (seq * 0x9E3779B97F4A7C15ULL);
+  key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+  key ^= key >> 31;
+  return key ? key : 1;
+}
+
+/**
+ * @brief Probes one generation of the dedupe set.
+ *
+ * @return Returns the slot holding key, or the empty slot where it belongs.
+ */
+static uint64_t *ProbeSeen(uint64_t *ids, uint64_t key) {
+  size_t mask = 2 * kDedupeCapacity - 1;
+
+  for (size_t i = (size_t)key & mask;; i = (i + 1) & mask) {
+    if (ids[i] == key || ids[i] == 0) {
+      return &ids[i];
+    }
+  }
+}
+
+/**
+ * @brief Records an event id.
+ *
+ * @param origin  Node the event originated on.
+ * @param seq     Sequence number assigned by that node.
+ *
+ * @return Returns true if the event is new, or false if it was seen before.
+ */
+static bool MarkSeen(uint64_t origin, uint64_t seq) {
+  uint64_t key = EventKey(origin, seq);
+  bool fresh = false;
+
+  pthread_mutex_lock(&seen.mutex);
+  uint64_t *slot = ProbeSeen(seen.ids[seen.current], key);
+  if (*slot == 0 && *ProbeSeen(seen.ids[!seen.current], key) == 0) {
+    if (seen.count == kDedupeCapacity) {
+      seen.current = !seen.current;
+      memset(seen.ids[seen.current], 0, sizeof(seen.ids[seen.current]));
+      seen.count = 0;
+      slot = ProbeSeen(seen.ids[seen.current], key);
+    }
+    *slot = key;
+    seen.count++;
+    fresh = true;
+  }
+  pthread_mutex_unlock(&seen.mutex);
+
+  return fresh;
+}
+
+/**
+ * @brief Sends all bytes on a link socket, retrying partial sends.
+ *
+ * @return Returns 0 if everything was sent, or -1 on error.
+ */
+static int SendLinkBytes(int fd, const void *buf, size_t len, int flags) {
+  const uint8_t *bytes = (const uint8_t *)buf;
+
+  while (len > 0) {
+    ssize_t sent = send(fd, bytes, len, flags | MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    bytes += sent;
+    len -= (size_t)sent;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Sends part of a batch, compressed if the link negotiated it.
+ *
+ * @param link      Link to send on.
+ * @param chunk     Whole frames to send.
+ * @param len       Number of bytes in chunk.
+ * @param deflated  Scratch buffer of CompressBound(kLinkChunkLimit) bytes, or
+ *                  NULL if the link does not compress.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int SendChunk(link_t *link, const uint8_t *chunk, size_t len,
+                     uint8_t *deflated) {
+  if (deflated) {
+    size_t deflated_len = CompressBlock(chunk, len, deflated,
+                                        CompressBound(kLinkChunkLimit));
+    if (deflated_len > 0 && deflated_len < len) {
+      uint8_t header[kFrameHeaderLen];
+      header[0] = kFrameCompressed;
+      size_t header_len = 1 + EncodeVarint(deflated_len, header + 1);
+      if (SendLinkBytes(link->fd, header, header_len, MSG_MORE) < 0) {
+        return -1;
+      }
+      return SendLinkBytes(link->fd, deflated, deflated_len, 0);
+    }
+  }
+
+  return SendLinkBytes(link->fd, chunk, len, 0);
+}
+
+/**
+ * @brief Sends a batch of queued frames, cut into chunks of whole frames.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int SendBatch(link_t *link, const uint8_t *batch, size_t len,
+                     uint8_t *deflated) {
+  size_t start = 0;
+  size_t end = 0;
+  frame_t frame;
+
+  while (end < len) {
+    ssize_t frame_len = ParseFrame(batch + end, len - end,
+                                   kPublishPayloadLimit, &frame);
+    if (frame_len <= 0) {
+      return -1;
+    }
+    end += (size_t)frame_len;
+    if (end - start >= kLinkBatchBytes || end == len) {
+      if (SendChunk(link, batch + start, end - start, deflated) < 0) {
+        return -1;
+      }
+      start = end;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Writer thread of a link.
+ *
+ * Waits for queued frames, then lingers up to kLinkBatchDelayMs for more
+ * unless kLinkBatchBytes are already queued, so that bursts leave in a few
+ * large sends rather than one send per event. The queue is swapped with a
+ * second buffer so broadcasters never wait on the socket.
+ *
+ * @param arg  Link to write to.
+ */
+static void *LinkWriter(void *arg) {
+  link_t *link = (link_t *)arg;
+  uint8_t *batch = NULL;
+  size_t batch_cap = 0;
+  uint8_t *deflated = NULL;
+  bool failed = false;
+
+  if (link->features & kFeatureCompression) {
+    deflated = malloc(CompressBound(kLinkChunkLimit));
+  }
+
+  pthread_mutex_lock(&link->mutex);
+  while (1) {
+    while (link->queue_len == 0 && !link->closing) {
+      pthread_cond_wait(&link->cond, &link->mutex);
+    }
+
+    if (link->queue_len < kLinkBatchBytes && !link->closing) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += kLinkBatchDelayMs * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      while (link->queue_len < kLinkBatchBytes && !link->closing &&
+             pthread_cond_timedwait(&link->cond, &link->mutex, &deadline) !=
+                 ETIMEDOUT) {
+      }
+    }
+    if (link->closing) {
+      break;
+    }
+
+    uint8_t *swap = batch;
+    size_t swap_cap = batch_cap;
+    size_t len = link->queue_len;
+    batch = link->queue;
+    batch_cap = link->queue_cap;
+    link->queue = swap;
+    link->queue_cap = swap_cap;
+    link->queue_len = 0;
+    pthread_mutex_unlock(&link->mutex);
+
+    if (!failed && SendBatch(link, batch, len, deflated) < 0) {
+      // Let the reader notice and tear the link down
+      PrintError("Failed to send to node %016" PRIx64 ": %s\n", link->peer,
+                 strerror(errno));
+      shutdown(link->fd, SHUT_RDWR);
+      failed = true;
+    }
+
+    pthread_mutex_lock(&link->mutex);
+  }
+  pthread_mutex_unlock(&link->mutex);
+
+  free(deflated);
+  free(batch);
+  return NULL;
+}
+
+/**
+ * @brief Queues a frame on a link for its writer thread.
+ *
+ * Frames that would grow the queue past kLinkQueueBytes are dropped, so a
+ * stalled peer cannot make the server buffer without bound.
+ */
+static void EnqueueFrame(link_t *link, const uint8_t *frame, size_t len) {
+  pthread_mutex_lock(&link->mutex);
+
+  size_t need = link->queue_len + len;
+  if (need > link->queue_cap && need <= kLinkQueueBytes) {
+    size_t cap = link->queue_cap ? link->queue_cap : kLinkBatchBytes;
+    while (cap < need) {
+      cap *= 2;
+    }
+    uint8_t *queue = realloc(link->queue, cap);
+    if (queue) {
+      link->queue = queue;
+      link->queue_cap = cap;
+    }
+  }
+
+  if (need > link->queue_cap) {
+    link->dropped++;
+  } else {
+    bool was_empty = link->queue_len == 0;
+    memcpy(link->queue + link->queue_len, frame, len);
+    link->queue_len = need;
+    if (was_empty || need >= kLinkBatchBytes) {
+      pthread_cond_signal(&link->cond);
+    }
+  }
+
+  pthread_mutex_unlock(&link->mutex);
+}
+
+/**
+ * @brief Queues an event on every link but one.
+ *
+ * Servers get a RELAY frame and the backplane a PUBLISH frame on the room's
+ * topic; each is encoded at most once.
+ *
+ * @param payload      RELAY payload of the event.
+ * @param len          Size of the payload.
+ * @param relay        Encoded RELAY frame, or NULL to encode it if needed.
+ * @param relay_len    Size of the encoded RELAY frame.
+ * @param source       Link the event arrived on, or NULL if it originated
+ *                     here.
+ */
+static void FloodEvent(const uint8_t *payload, size_t len,
+                       const uint8_t *relay, size_t relay_len,
+                       const link_t *source) {
+  uint8_t relay_frame[kRelayFrameLimit];
+  uint8_t publish[kPublishFrameLimit];
+  size_t publish_len = 0;
+
+  pthread_mutex_lock(&links_mutex);
+  for (size_t i = 0; i < kMaxLinks; i++) {
+    link_t *link = links[i];
+    if (!link || link == source) {
+      continue;
+    }
+
+    if (link->backplane) {
+      if (publish_len == 0) {
+        publish_len = EncodeFrame(kFramePublish, kDefaultRoom, payload, len,
+                                  publish, sizeof(publish));
+      }
+      EnqueueFrame(link, publish, publish_len);
+    } else {
+      if (!relay) {
+        relay_len = EncodeFrame(kFrameRelay, NULL, payload, len, relay_frame,
+                                sizeof(relay_frame));
+        relay = relay_frame;
+      }
+      EnqueueFrame(link, relay, relay_len);
+    }
+  }
+  pthread_mutex_unlock(&links_mutex);
+}
+
+/**
+ * @brief Queues a SUBSCRIBE or UNSUBSCRIBE frame on the backplane.
+ *
+ * Must be called with the topics mutex held.
+ */
+static void SendSubscription(uint8_t type, const char *topic) {
+  uint8_t frame[kFrameHeaderLen + kMaxVarintLen + kNameCharLimit];
+
+  if (backplane) {
+    size_t len = EncodeFrame(type, topic, NULL, 0, frame, sizeof(frame));
+    EnqueueFrame(backplane, frame, len);
+  }
+}
+
+/**
+ * @brief Counts a local member of a room.
+ *
+ * The first member subscribes this server to the room's topic on the
+ * backplane, so the broker only sends it traffic for rooms it has members in.
+ *
+ * @param room  Room joined.
+ */
+void AddRoomMember(const char *room) {
+  pthread_mutex_lock(&topics_mutex);
+
+  size_t free_slot = kMaxTopics;
+  for (size_t i = 0; i < kMaxTopics; i++) {
+    if (topics[i].members > 0 && strcmp(topics[i].name, room) == 0) {
+      topics[i].members++;
+      goto unlock;
+    }
+    if (topics[i].members == 0 && free_slot == kMaxTopics) {
+      free_slot = i;
+    }
+  }
+
+  if (free_slot < kMaxTopics) {
+    snprintf(topics[free_slot].name, kNameCharLimit, "%s", room);
+    topics[free_slot].members = 1;
+    SendSubscription(kFrameSubscribe, room);
+  } else {
+    PrintError("Too many rooms to subscribe to %s\n", room);
+  }
+
+unlock:
+  pthread_mutex_unlock(&topics_mutex);
+}
+
+/**
+ * @brief Stops counting a local member of a room.
+ *
+ * The last member to leave unsubscribes the room's topic.
+ *
+ * @param room  Room left.
+ */
+void RemoveRoomMember(const char *room) {
+  pthread_mutex_lock(&topics_mutex);
+  for (size_t i = 0; i < kMaxTopics; i++) {
+    if (topics[i].members > 0 && strcmp(topics[i].name, room) == 0) {
+      if (--topics[i].members == 0) {
+        SendSubscription(kFrameUnsubscribe, room);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&topics_mutex);
+}
+
+/**
+ * @brief Relays an event that originated on this server to linked servers.
+ *
+ * Only messages, joins and leaves are relayed; other events concern a single
+ * local client. The RELAY frame is encoded once and queued on every link.
+ *
+ * @param event  Event to relay.
+ */
+void RelayEvent(const chat_event_t *event) {
+  uint8_t payload[kRelayPayloadLimit];
+
+  if (event->type != kEventMessage && event->type != kEventJoin &&
+      event->type != kEventLeave) {
+    return;
+  }
+
+  uint64_t seq = atomic_fetch_add(&next_seq, 1) + 1;
+  MarkSeen(node_id, seq);
+
+  size_t name_len = strlen(event->name);
+  size_t len = EncodeVarint(node_id, payload);
+  len += EncodeVarint(seq, payload + len);
+  payload[len++] = (uint8_t)event->type;
+  len += EncodeVarint(name_len, payload + len);
+  memcpy(payload + len, event->name, name_len);
+  len += name_len;
+  memcpy(payload + len, event->body, event->body_len);
+  len += event->body_len;
+
+  FloodEvent(payload, len, NULL, 0, NULL);
+}
+
+/**
+ * @brief Handles a relayed event received on a link.
+ *
+ * New events are forwarded to the other links and delivered to local
+ * clients; events seen before are dropped.
+ *
+ * @param link     Link the event arrived on.
+ * @param raw      Encoded RELAY frame to forward unchanged, or NULL if the
+ *                 event arrived in another kind of frame.
+ * @param raw_len  Size of the encoded frame.
+ * @param event    RELAY payload.
+ * @param size     Size of the payload.
+ *
+ * @return Returns 0 on success, or -1 if the payload is malformed.
+ */
+static int HandleRelay(link_t *link, const uint8_t *raw, size_t raw_len,
+                       const uint8_t *event_payload, size_t size) {
+  const uint8_t *payload = event_payload;
+  size_t len = size;
+  uint64_t origin;
+  uint64_t seq;
+  const uint8_t *name;
+  size_t name_len;
+  ssize_t used;
+
+  if ((used = DecodeVarint(payload, len, &origin)) <= 0) {
+    return -1;
+  }
+  payload += used;
+  len -= (size_t)used;
+  if ((used = DecodeVarint(payload, len, &seq)) <= 0 || (size_t)used >= len) {
+    return -1;
+  }
+  payload += used;
+  len -= (size_t)used;
+
+  event_type_t type = (event_type_t)*payload++;
+  len--;
+  if ((type != kEventMessage && type != kEventJoin && type != kEventLeave) ||
+      (used = ParseString(payload, len, &name, &name_len)) < 0 ||
+      name_len >= kNameCharLimit) {
+    return -1;
+  }
+  payload += used;
+  len -= (size_t)used;
+
+  if (!MarkSeen(origin, seq)) {
+    return 0;
+  }
+  FloodEvent(event_payload, size, raw, raw_len, link);
+
+  char name_text[kNameCharLimit];
+  char body_text[kMessageCharLimit];
+  chat_event_t event = {.type = type, .name = name_text, .body = body_text};
+  if (SanitizeText(name, name_len, name_text, sizeof(name_text)) == 0) {
+    return -1;
+  }
+  event.body_len = SanitizeText(payload, len, body_text, sizeof(body_text));
+
+  DeliverRemoteEvent(&event);
+  return 0;
+}
+
+/**
+ * @brief Handles one frame received on a link.
+ *
+ * COMPRESSED frames are inflated and the RELAY frames inside handled in turn.
+ * The backplane delivers events as PUBLISH frames instead.
+ *
+ * @return Returns 0 on success, or -1 if the link should be closed.
+ */
+static int HandleLinkFrame(link_t *link, const uint8_t *raw, size_t raw_len,
+                           const frame_t *frame, uint8_t *inflated) {
+  if (frame->type == kFrameRelay) {
+    return HandleRelay(link, raw, raw_len, frame->payload, frame->len);
+  }
+  if (frame->type == kFramePublish && link->backplane) {
+    const uint8_t *topic;
+    size_t topic_len;
+    ssize_t used = ParseString(frame->payload, frame->len, &topic,
+                               &topic_len);
+    if (used < 0) {
+      return -1;
+    }
+    return HandleRelay(link, NULL, 0, frame->payload + used,
+                       frame->len - (size_t)used);
+  }
+  if (frame->type != kFrameCompressed) {
+    return 0;  // Ignore frame types from newer servers
+  }
+
+  ssize_t len = DecompressBlock(frame->payload, frame->len, inflated,
+                                kLinkChunkLimit);
+  if (len < 0) {
+    return -1;
+  }
+
+  frame_t inner;
+  for (size_t off = 0; off < (size_t)len;) {
+    ssize_t inner_len = ParseFrame(inflated + off, (size_t)len - off,
+                                   kRelayPayloadLimit, &inner);
+    if (inner_len <= 0 || inner.type != kFrameRelay ||
+        HandleRelay(link, inflated + off, (size_t)inner_len, inner.payload,
+                    inner.len) < 0) {
+      return -1;
+    }
+    off += (size_t)inner_len;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Reads and handles frames from a link until it closes.
+ *
+ * @param link  Link to serve.
+ * @param in    Input buffer, possibly holding bytes left from the handshake.
+ * @param len   Number of bytes buffered in in.
+ */
+static void ServeLink(link_t *link, uint8_t *in, size_t len) {
+  uint8_t *inflated = malloc(kLinkChunkLimit);
+  frame_t frame;
+
+  if (!inflated) {
+    PrintError("Failed to allocate link buffer\n");
+    return;
+  }
+
+  while (1) {
+    size_t off = 0;
+    ssize_t frame_len;
+    while ((frame_len = ParseFrame(in + off, len - off,
+                                   kLinkInputCap / 2 - kFrameHeaderLen,
+                                   &frame)) > 0) {
+      if (HandleLinkFrame(link, in + off, (size_t)frame_len, &frame,
+                          inflated) < 0) {
+        frame_len = -1;
+        break;
+      }
+      off += (size_t)frame_len;
+    }
+    if (frame_len < 0) {
+      PrintError("Malformed frame from node %016" PRIx64 "\n", link->peer);
+      break;
+    }
+    memmove(in, in + off, len - off);
+    len -= off;
+
+    ssize_t received = recv(link->fd, in + len, kLinkInputCap - len, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      break;
+    }
+    len += (size_t)received;
+  }
+
+  free(inflated);
+}
+
+/**
+ * @brief Sends the LINK frame announcing this server.
+ *
+ * @param fd         Link socket.
+ * @param initiator  Whether to prefix the frame with kLinkMagic.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int SendLinkHello(int fd, bool initiator) {
+  uint8_t payload[2 * kMaxVarintLen];
+  uint8_t out[kLinkMagicLen + kFrameHeaderLen + sizeof(payload)];
+  size_t len = 0;
+
+  size_t payload_len = EncodeVarint(node_id, payload);
+  payload_len += EncodeVarint(kSupportedFeatures, payload + payload_len);
+
+  if (initiator) {
+    memcpy(out, kLinkMagic, kLinkMagicLen);
+    len = kLinkMagicLen;
+  }
+  len += EncodeFrame(kFrameLink, NULL, payload, payload_len, out + len,
+                     sizeof(out) - len);
+
+  return SendLinkBytes(fd, out, len, 0);
+}
+
+/**
+ * @brief Receives the LINK frame of the other side.
+ *
+ * Bytes received past the LINK frame are left at the start of in.
+ *
+ * @param link    Link being negotiated; its peer and features are filled in.
+ * @param in      Input buffer of kLinkInputCap bytes.
+ * @param len     Number of bytes buffered in in, updated on return.
+ * @param prefix  Number of magic bytes expected before the frame.
+ *
+ * @return Returns 0 on success, or -1 if the handshake failed.
+ */
+static int ReceiveLinkHello(link_t *link, uint8_t *in, size_t *len,
+                            size_t prefix) {
+  frame_t frame;
+  ssize_t frame_len = 0;
+
+  while (*len < prefix || (frame_len = ParseFrame(in + prefix, *len - prefix,
+                                                  2 * kMaxVarintLen,
+                                                  &frame)) == 0) {
+    ssize_t received = recv(link->fd, in + *len, kLinkInputCap - *len, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return -1;
+    }
+    *len += (size_t)received;
+  }
+
+  if (memcmp(in, kLinkMagic, prefix) != 0 || frame_len < 0 ||
+      frame.type != kFrameLink) {
+    PrintError("Malformed link handshake\n");
+    return -1;
+  }
+
+  uint64_t features;
+  ssize_t off = DecodeVarint(frame.payload, frame.len, &link->peer);
+  if (off <= 0 || DecodeVarint(frame.payload + off, frame.len - (size_t)off,
+                               &features) <= 0) {
+    PrintError("Malformed link handshake\n");
+    return -1;
+  }
+  link->features = features & kSupportedFeatures;
+
+  size_t consumed = prefix + (size_t)frame_len;
+  memmove(in, in + consumed, *len - consumed);
+  *len -= consumed;
+
+  return 0;
+}
+
+/**
+ * @brief Adds a link to the registry so that events are flooded to it.
+ *
+ * A backplane connection first subscribes to every room with local members;
+ * the topics mutex is held throughout so no membership change slips between
+ * these subscriptions and later ones.
+ *
+ * @return Returns 0 on success, or -1 if kMaxLinks links are established.
+ */
+static int RegisterLink(link_t *link) {
+  int status = -1;
+
+  if (link->backplane) {
+    pthread_mutex_lock(&topics_mutex);
+    backplane = link;
+    for (size_t i = 0; i < kMaxTopics; i++) {
+      if (topics[i].members > 0) {
+        SendSubscription(kFrameSubscribe, topics[i].name);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&links_mutex);
+  for (size_t i = 0; i < kMaxLinks; i++) {
+    if (!links[i]) {
+      links[i] = link;
+      status = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&links_mutex);
+
+  if (link->backplane) {
+    if (status < 0) {
+      backplane = NULL;
+    }
+    pthread_mutex_unlock(&topics_mutex);
+  }
+
+  return status;
+}
+
+/**
+ * @brief Removes a link from the registry.
+ */
+static void UnregisterLink(link_t *link) {
+  if (link->backplane) {
+    pthread_mutex_lock(&topics_mutex);
+    backplane = NULL;
+    pthread_mutex_unlock(&topics_mutex);
+  }
+
+  pthread_mutex_lock(&links_mutex);
+  for (size_t i = 0; i < kMaxLinks; i++) {
+    if (links[i] == link) {
+      links[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&links_mutex);
+}
+
+/**
+ * @brief Performs the handshake of a new link.
+ *
+ * @param link  Link being negotiated.
+ * @param role  How the link was opened.
+ * @param in    Input buffer of kLinkInputCap bytes.
+ * @param len   Number of bytes buffered in in, updated on return.
+ *
+ * @return Returns 0 on success, or -1 if the handshake failed.
+ */
+static int NegotiateLink(link_t *link, link_role_t role, uint8_t *in,
+                         size_t *len) {
+  if (role == kLinkBackplane) {
+    // The broker has no node id and does not reply
+    link->backplane = true;
+    return SendLinkBytes(link->fd, kBackplaneMagic, kBackplaneMagicLen, 0);
+  }
+
+  bool initiator = role == kLinkDialed;
+  if (initiator && SendLinkHello(link->fd, true) < 0) {
+    return -1;
+  }
+  if (ReceiveLinkHello(link, in, len, initiator ? 0 : kLinkMagicLen) < 0) {
+    return -1;
+  }
+  if (!initiator && SendLinkHello(link->fd, false) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Runs a link on a connected socket until it closes.
+ *
+ * @param fd    Link socket, closed before returning.
+ * @param role  How the link was opened.
+ *
+ * @return Returns 0 if the link was established, 1 if the other side turned
+ *         out to be this server, or -1 if the link could not be established.
+ */
+static int RunLink(int fd, link_role_t role) {
+  link_t *link = calloc(1, sizeof(link_t));
+  uint8_t *in = malloc(kLinkInputCap);
+  size_t len = 0;
+  int status = -1;
+
+  if (!link || !in) {
+    PrintError("Failed to allocate link\n");
+    goto close_link;
+  }
+  link->fd = fd;
+
+  if (NegotiateLink(link, role, in, &len) < 0) {
+    goto close_link;
+  }
+  if (!link->backplane && link->peer == node_id) {
+    status = 1;
+    goto close_link;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&link->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&link->mutex, NULL);
+
+  if (pthread_create(&link->writer, NULL, &LinkWriter, link) != 0) {
+    PrintError("Failed to start link writer\n");
+    goto destroy_link;
+  }
+  if (RegisterLink(link) < 0) {
+    PrintError("Too many links; refusing node %016" PRIx64 "\n", link->peer);
+  } else if (link->backplane) {
+    status = 0;
+    printf("Connected to the backplane\n");
+    ServeLink(link, in, len);
+    UnregisterLink(link);
+    printf("Disconnected from the backplane\n");
+  } else {
+    status = 0;
+    printf("Linked with node %016" PRIx64 "\n", link->peer);
+    ServeLink(link, in, len);
+    UnregisterLink(link);
+    printf("Link to node %016" PRIx64 " closed\n", link->peer);
+  }
+
+  pthread_mutex_lock(&link->mutex);
+  link->closing = true;
+  pthread_cond_signal(&link->cond);
+  pthread_mutex_unlock(&link->mutex);
+  pthread_join(link->writer, NULL);
+
+  if (link->dropped > 0) {
+    PrintError("Dropped %zu events queued for node %016" PRIx64 "\n",
+               link->dropped, link->peer);
+  }
+  free(link->queue);
+
+destroy_link:
+  pthread_cond_destroy(&link->cond);
+  pthread_mutex_destroy(&link->mutex);
+close_link:
+  close(fd);
+  free(in);
+  free(link);
+
+  return status;
+}
+
+/**
+ * @brief Thread serving a link accepted from another server.
+ */
+static void *AcceptedLinkThread(void *arg) {
+  RunLink((int)(intptr_t)arg, kLinkAccepted);
+  return NULL;
+}
+
+/**
+ * @brief Accepts a link from another server.
+ *
+ * @param sockfd  Listening socket for server links.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+int AcceptLink(int sockfd) {
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  int fd = accept(sockfd, NULL, NULL);
+  if (fd < 0) {
+    PrintError("Failed to accept link: %s\n", strerror(errno));
+    return -1;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int status = pthread_create(&tid, &attr, &AcceptedLinkThread,
+                              (void *)(intptr_t)fd);
+  pthread_attr_destroy(&attr);
+  if (status != 0) {
+    PrintError("Failed to start link thread\n");
+    close(fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Connects to a peer given as HOST:PORT.
+ *
+ * @return Returns the connected socket, or -1 on error.
+ */
+static int DialPeer(const char *address) {
+  char host[256];
+  const char *colon = strrchr(address, ':');
+  size_t host_len = (size_t)(colon - address);
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM};
+  struct addrinfo *addrs;
+  int fd = -1;
+
+  // Accept bracketed IPv6 literals such as [::1]:13003
+  if (host_len >= 2 && address[0] == '[' && colon[-1] == ']') {
+    address++;
+    host_len -= 2;
+  }
+  memcpy(host, address, host_len);
+  host[host_len] = '\0';
+
+  int status = getaddrinfo(host, colon + 1, &hints, &addrs);
+  if (status != 0) {
+    PrintError("Failed to resolve %s: %s\n", address, gai_strerror(status));
+    return -1;
+  }
+
+  for (struct addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+
+  return fd;
+}
+
+/**
+ * @brief Connects to a pub/sub broker listening on a Unix socket.
+ *
+ * @return Returns the connected socket, or -1 on error.
+ */
+static int DialBackplane(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    fd = -1;
+  }
+
+  return fd;
+}
+
+/**
+ * @brief Keeps a link to a configured peer or broker up.
+ *
+ * Reconnects with exponential backoff between kLinkRetryMinMs and
+ * kLinkRetryMaxMs, and gives up only if the peer is this server.
+ *
+ * @param address  Peer address as HOST:PORT, or the broker's socket path.
+ * @param role     kLinkDialed for a peer, or kLinkBackplane for a broker.
+ */
+static void KeepLinkUp(const char *address, link_role_t role) {
+  long backoff = kLinkRetryMinMs;
+
+  while (1) {
+    int fd = role == kLinkBackplane ? DialBackplane(address)
+                                    : DialPeer(address);
+    if (fd >= 0) {
+      int status = RunLink(fd, role);
+      if (status == 1) {
+        PrintError("Not linking %s: it is this server\n", address);
+        break;
+      }
+      if (status == 0) {
+        backoff = kLinkRetryMinMs;
+      }
+    }
+
+    struct timespec delay = {.tv_sec = backoff / 1000,
+                             .tv_nsec = backoff % 1000 * 1000000L};
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+    }
+    backoff = backoff * 2 > kLinkRetryMaxMs ? kLinkRetryMaxMs : backoff * 2;
+  }
+}
+
+/**
+ * @brief Thread keeping a link to a peer given as HOST:PORT up.
+ */
+static void *PeerThread(void *arg) {
+  KeepLinkUp((const char *)arg, kLinkDialed);
+  return NULL;
+}
+
+/**
+ * @brief Thread keeping the connection to the broker at a path up.
+ */
+static void *BackplaneThread(void *arg) {
+  KeepLinkUp((const char *)arg, kLinkBackplane);
+  return NULL;
+}
+
+/**
+ * @brief Starts linking to another server, reconnecting whenever the link
+ *        drops.
+ *
+ * @param address  Peer address as HOST:PORT. Must outlive the server.
+ *
+ * @return Returns 0 on success, or -1 if the address is malformed or the
+ *         thread could not be started.
+ */
+int ConnectPeer(const char *address) {
+  pthread_t tid;
+  pthread_attr_t attr;
+  const char *colon = strrchr(address, ':');
+  in_port_t port;
+
+  if (!colon || colon == address || colon - address >= 256 ||
+      ParsePort(colon + 1, &port) < 0) {
+    return -1;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int status = pthread_create(&tid, &attr, &PeerThread, (void *)address);
+  pthread_attr_destroy(&attr);
+
+  return status == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Starts publishing to and subscribing from a pub/sub broker,
+ *        reconnecting whenever the connection drops.
+ *
+ * @param path  Unix socket path of the broker. Must outlive the server.
+ *
+ * @return Returns 0 on success, or -1 if the path is too long or the thread
+ *         could not be started.
+ */
+int ConnectBackplane(const char *path) {
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  if (strlen(path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path)) {
+    return -1;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int status = pthread_create(&tid, &attr, &BackplaneThread, (void *)path);
+  pthread_attr_destroy(&attr);
+
+  return status == 0 ? 0 : -1;
+}
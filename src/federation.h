@@ -0,0 +1,48 @@
+#ifndef FEDERATION_H_
+#define FEDERATION_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Server-to-server links. Every server has a random node id and stamps each
+// event that originates locally with (node id, sequence number). Events are
+// flooded to all linked servers, which deliver them to their own clients and
+// forward them to their other links; the message id lets every server drop
+// copies it has already seen, so any topology, including cycles, works.
+//
+// A link starts with kLinkMagic and a LINK frame from the connecting side,
+// answered by a LINK frame from the accepting side. Both carry the sender's
+// node id and feature bitmask (varints). Afterwards each side sends RELAY
+// frames, batched per link and, if both sides enabled kFeatureCompression,
+// wrapped in COMPRESSED frames:
+//
+//   LINK   node id (varint) | features (varint)
+//   RELAY  origin node id (varint) | sequence (varint) | event type (1 byte) |
+//          name (length-prefixed) | body
+//
+// A server may also connect to a local pub/sub broker (see broker.h), which
+// is handled as one more link: events are published on the topic of their
+// room, and the server subscribes to the rooms it has local members in.
+
+#define kLinkMagic "\0CRL"
+#define kLinkMagicLen 4
+#define kMaxLinks 16
+#define kLinkBatchBytes (16 * 1024)   // Flush once this much is queued
+#define kLinkBatchDelayMs 5           // Or once the oldest frame is this old
+#define kLinkQueueBytes (1024 * 1024) // Frames beyond this are dropped
+#define kLinkRetryMinMs 500
+#define kLinkRetryMaxMs 30000
+#define kDedupeCapacity 4096
+#define kMaxTopics 64  // Rooms with local members tracked for the backplane
+
+void InitFederation(void);
+uint64_t LocalNodeId(void);
+int AcceptLink(int sockfd);
+int ConnectPeer(const char *address);
+int ConnectBackplane(const char *path);
+void AddRoomMember(const char *room);
+void RemoveRoomMember(const char *room);
+void RelayEvent(const chat_event_t *event);
+
+#endif  // FEDERATION_H_
@@ -0,0 +1,601 @@
+/**
+ * @file filter.c
+ *
+ * @brief Pipeline of filter stages run on chat messages before they are
+ *        broadcast.
+ */
+
+#include "filter.h"
+
+#include <ctype.h>
+#include <time.h>
+
+#include "automaton.h"
+#include "chatroom.h"
+#include "hash.h"
+
+#define kBannedLineLimit 256
+#define kFilterTailLen kBannedLineLimit  // End of a stream scanned again
+
+typedef enum { kFilterPass, kFilterChanged, kFilterDrop } filter_verdict_t;
+
+// Verdict on a chunk, which the client streaming it waits for
+typedef struct {
+  char *body;          // Where the filtered chunk is copied back
+  const char *reason;  // Why the chunk was dropped, or NULL
+  bool done;
+} filter_reply_t;
+
+typedef struct {
+  uint64_t sender;
+  char name[kNameCharLimit];
+  char body[kChunkLimit + 1];  // A message or a chunk
+  size_t body_len;
+  uint64_t stream;        // Stream of a chunk, or 0 for a message
+  filter_reply_t *reply;  // Where a chunk's verdict goes
+} filter_job_t;
+
+// What the links and spam stages count over a message, or over all the
+// chunks of a stream so far
+typedef struct {
+  size_t links;
+  size_t letters;
+  size_t upper;
+  size_t run;          // Length of the run of one character the text ends in
+  size_t longest_run;
+  char last;           // Last character of the text
+} filter_counts_t;
+
+// What a worker keeps about a client between messages
+typedef struct {
+  uint64_t handle;       // Client the state is about, 0 if none yet
+  double allowance;      // Messages the client may still send right away
+  uint64_t refilled_ns;  // When the allowance last grew
+  uint64_t last_hash;    // Hash of its previous message
+  unsigned int repeats;  // Times in a row it sent that message again
+  // The stream it is sending, kept between its chunks
+  uint64_t stream;             // Id of the stream, 0 if none yet
+  filter_counts_t counts;      // Counted over the stream so far
+  char tail[kFilterTailLen];   // End of the stream so far
+  size_t tail_len;
+} filter_sender_t;
+
+// A message or chunk going through the pipeline
+typedef struct {
+  filter_job_t *job;
+  filter_sender_t *sender;
+  uint64_t now_ns;
+  // Text the stages scan: the body, after the end of the stream so far for
+  // a chunk, so words and links cut by a chunk boundary are found whole
+  char *text;
+  size_t len;
+  size_t fresh;              // Where the body starts in text
+  bool continues;            // A chunk of a stream opened before
+  filter_counts_t *counts;   // Of the message or the whole stream
+  size_t masked;             // Words masked by the banned stage
+  size_t link_end;           // Where the last link found ends
+  int score;                 // Set by the spam stage
+  const char *reason;        // Why the message was dropped
+} filter_msg_t;
+
+typedef filter_verdict_t (*filter_fn)(filter_msg_t *msg);
+
+typedef struct {
+  const char *name;
+  filter_fn run;
+  bool enabled;
+  atomic_uint_fast64_t runs;
+  atomic_uint_fast64_t hits;
+  atomic_uint_fast64_t total_ns;
+  atomic_uint_fast64_t max_ns;
+} filter_stage_t;
+
+typedef struct {
+  filter_job_t jobs[kFilterQueueLen];  // Ring of queued messages
+  size_t head;
+  size_t len;
+  pthread_mutex_t mutex;
+  pthread_cond_t queued;
+  pthread_cond_t taken;
+  pthread_cond_t answered;  // A chunk got its verdict
+  // Indexed by pool slot; only the slots of this worker are used
+  filter_sender_t senders[kMaxClients];
+} filter_worker_t;
+
+static filter_verdict_t CheckRate(filter_msg_t *msg);
+static filter_verdict_t MaskBanned(filter_msg_t *msg);
+static filter_verdict_t CountLinks(filter_msg_t *msg);
+static filter_verdict_t ScoreSpam(filter_msg_t *msg);
+
+static filter_stage_t stages[kFilterStages] = {
+    {.name = "rate", .run = &CheckRate},
+    {.name = "banned", .run = &MaskBanned},
+    {.name = "links", .run = &CountLinks},
+    {.name = "spam", .run = &ScoreSpam},
+};
+
+static filter_worker_t workers[kFilterWorkers];
+static size_t filter_rate = kDefaultFilterRate;
+static automaton_t *banned_words = NULL;
+static automaton_t *link_prefixes = NULL;
+static const char *const kLinkPrefixes[] = {"http://", "https://", "ftp://",
+                                            "www."};
+
+static uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Drops messages beyond the client's rate.
+ *
+ * The client's allowance grows by filter_rate messages per second, up to
+ * kFilterBurst seconds' worth, and every message takes one. A stream takes
+ * one when it opens.
+ */
+static filter_verdict_t CheckRate(filter_msg_t *msg) {
+  filter_sender_t *sender = msg->sender;
+  double burst = (double)(filter_rate * kFilterBurst);
+
+  if (msg->continues) {
+    return kFilterPass;
+  }
+
+  sender->allowance += (double)(msg->now_ns - sender->refilled_ns) *
+                       (double)filter_rate / 1e9;
+  if (sender->allowance > burst) {
+    sender->allowance = burst;
+  }
+  sender->refilled_ns = msg->now_ns;
+
+  if (sender->allowance < 1) {
+    msg->reason = "Slow down, you are sending too many messages";
+    return kFilterDrop;
+  }
+  sender->allowance -= 1;
+  return kFilterPass;
+}
+
+static bool MaskWord(size_t pattern, size_t start, size_t end, void *arg) {
+  filter_msg_t *msg = (filter_msg_t *)arg;
+  (void)pattern;
+
+  if (end > msg->fresh && IsWholeWord(msg->text, msg->len, start, end)) {
+    // What comes before the body was sent with an earlier chunk
+    if (start < msg->fresh) {
+      start = msg->fresh;
+    }
+    memset(msg->text + start, '*', end - start);
+    msg->masked++;
+  }
+  return true;
+}
+
+/**
+ * @brief Masks banned words with '*'.
+ *
+ * A word cut by a chunk boundary is masked from the boundary on.
+ */
+static filter_verdict_t MaskBanned(filter_msg_t *msg) {
+  ScanAutomaton(banned_words, msg->text, msg->len, &MaskWord, msg);
+  return msg->masked > 0 ? kFilterChanged : kFilterPass;
+}
+
+static bool CountLink(size_t pattern, size_t start, size_t end, void *arg) {
+  filter_msg_t *msg = (filter_msg_t *)arg;
+  const char *text = msg->text;
+  (void)pattern;
+
+  if (start < msg->link_end ||
+      (start > 0 && isalnum((unsigned char)text[start - 1]))) {
+    return true;
+  }
+  // A link whose prefix ends before the body was counted with an earlier
+  // chunk
+  bool counted = end <= msg->fresh;
+  while (end < msg->len && !isspace((unsigned char)text[end])) {
+    end++;
+  }
+  msg->link_end = end;
+  if (!counted) {
+    msg->counts->links++;
+  }
+  return true;
+}
+
+/**
+ * @brief Counts the links in a message and drops it if there are too many.
+ *
+ * A link starts with one of kLinkPrefixes and runs to the next space; any
+ * prefix found inside it, like "www." after "https://", is part of it. The
+ * links of a stream add up over its chunks.
+ */
+static filter_verdict_t CountLinks(filter_msg_t *msg) {
+  ScanAutomaton(link_prefixes, msg->text, msg->len, &CountLink, msg);
+
+  if (msg->counts->links > kFilterLinkLimit) {
+    msg->reason = "Too many links";
+    return kFilterDrop;
+  }
+  return kFilterPass;
+}
+
+/**
+ * @brief Scores how much a message looks like spam and drops it from
+ *        kFilterSpamScore on.
+ *
+ * Every link scores one, every time in a row the client sends the same
+ * message again scores three, and a message of mostly upper case letters or
+ * with a run of 16 or more of the same character scores two. A stream is
+ * scored on all of its chunks so far, and whether it repeats on its first.
+ */
+static filter_verdict_t ScoreSpam(filter_msg_t *msg) {
+  const char *body = msg->text + msg->fresh;
+  size_t len = msg->len - msg->fresh;
+  filter_sender_t *sender = msg->sender;
+  filter_counts_t *counts = msg->counts;
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)body[i];
+    if (isalpha(c)) {
+      counts->letters++;
+      counts->upper += isupper(c) != 0;
+    }
+    counts->run = counts->run > 0 && counts->last == body[i]
+                      ? counts->run + 1
+                      : 1;
+    counts->last = body[i];
+    if (counts->run > counts->longest_run) {
+      counts->longest_run = counts->run;
+    }
+  }
+
+  if (!msg->continues) {
+    uint64_t hash = HashBytes(body, len);
+    sender->repeats = hash == sender->last_hash ? sender->repeats + 1 : 0;
+    sender->last_hash = hash;
+  }
+
+  msg->score = (int)counts->links + 3 * (int)sender->repeats;
+  if (counts->letters >= 12 && counts->upper * 10 >= counts->letters * 7) {
+    msg->score += 2;
+  }
+  if (counts->longest_run >= 16) {
+    msg->score += 2;
+  }
+
+  if (msg->score >= kFilterSpamScore) {
+    msg->reason = "Message looks like spam";
+    return kFilterDrop;
+  }
+  return kFilterPass;
+}
+
+/**
+ * @brief Runs a message through the enabled stages.
+ *
+ * A chunk is scanned after the end of its stream so far, which is kept for
+ * the next chunk once the chunk passed.
+ *
+ * @param job     Message or chunk; its body may be changed.
+ * @param sender  What the worker keeps about the sender.
+ *
+ * @return Returns NULL if the message passed, or why it was dropped.
+ */
+static const char *RunPipeline(filter_job_t *job, filter_sender_t *sender) {
+  char window[kFilterTailLen + sizeof(job->body)];
+  filter_counts_t counts = {0};
+  filter_msg_t msg = {.job = job,
+                      .sender = sender,
+                      .now_ns = NowNs(),
+                      .text = job->body,
+                      .len = job->body_len,
+                      .counts = &counts};
+
+  if (sender->handle != job->sender) {
+    // The slot holds a new client
+    *sender = (filter_sender_t){.handle = job->sender,
+                                .allowance =
+                                    (double)(filter_rate * kFilterBurst),
+                                .refilled_ns = msg.now_ns};
+  }
+  if (job->stream) {
+    msg.continues = sender->stream == job->stream;
+    if (!msg.continues) {
+      sender->stream = job->stream;
+      sender->counts = (filter_counts_t){0};
+      sender->tail_len = 0;
+    }
+    memcpy(window, sender->tail, sender->tail_len);
+    memcpy(window + sender->tail_len, job->body, job->body_len);
+    msg.text = window;
+    msg.len = sender->tail_len + job->body_len;
+    msg.fresh = sender->tail_len;
+    msg.counts = &sender->counts;
+  }
+
+  for (size_t i = 0; i < kFilterStages; i++) {
+    filter_stage_t *stage = &stages[i];
+    if (!stage->enabled) {
+      continue;
+    }
+
+    uint64_t started_ns = NowNs();
+    filter_verdict_t verdict = stage->run(&msg);
+    uint64_t took_ns = NowNs() - started_ns;
+
+    atomic_fetch_add(&stage->runs, 1);
+    atomic_fetch_add(&stage->total_ns, took_ns);
+    uint_fast64_t max_ns = atomic_load(&stage->max_ns);
+    while (took_ns > max_ns &&
+           !atomic_compare_exchange_weak(&stage->max_ns, &max_ns, took_ns)) {
+    }
+    if (verdict != kFilterPass) {
+      atomic_fetch_add(&stage->hits, 1);
+    }
+    if (verdict == kFilterDrop) {
+      return msg.reason;
+    }
+  }
+
+  if (job->stream) {
+    memcpy(job->body, window + msg.fresh, job->body_len);
+    size_t keep = msg.len < kFilterTailLen ? msg.len : kFilterTailLen;
+    memcpy(sender->tail, window + msg.len - keep, keep);
+    sender->tail_len = keep;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Filters the messages queued for a worker, then broadcasts them.
+ *
+ * Chunks are handed back to the clients streaming them, which relay them.
+ *
+ * @param arg  The worker.
+ */
+static void *RunWorker(void *arg) {
+  filter_worker_t *worker = (filter_worker_t *)arg;
+  filter_job_t job;
+
+  while (1) {
+    pthread_mutex_lock(&worker->mutex);
+    while (worker->len == 0) {
+      pthread_cond_wait(&worker->queued, &worker->mutex);
+    }
+    job = worker->jobs[worker->head];
+    worker->head = (worker->head + 1) % kFilterQueueLen;
+    worker->len--;
+    pthread_cond_signal(&worker->taken);
+    pthread_mutex_unlock(&worker->mutex);
+
+    const char *reason =
+        RunPipeline(&job, &worker->senders[HandleIndex(job.sender)]);
+    if (job.reply) {
+      if (reason) {
+        printf("Filtered a stream from %s: %s\n", job.name, reason);
+      }
+      memcpy(job.reply->body, job.body, job.body_len);
+      pthread_mutex_lock(&worker->mutex);
+      job.reply->reason = reason;
+      job.reply->done = true;
+      pthread_cond_broadcast(&worker->answered);
+      pthread_mutex_unlock(&worker->mutex);
+      continue;
+    }
+    if (reason) {
+      printf("Filtered a message from %s: %s\n", job.name, reason);
+      RejectMessage(job.sender, reason);
+      continue;
+    }
+    PublishMessage(job.sender, job.name, job.body, job.body_len);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Compiles the words of a file, one per line, into an automaton.
+ *
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * @param path  File to read.
+ *
+ * @return Returns the automaton, or NULL on error.
+ */
+static automaton_t *LoadBannedWords(const char *path) {
+  char line[kBannedLineLimit];
+  char **words = NULL;
+  size_t nwords = 0;
+  size_t cap = 0;
+  automaton_t *automaton = NULL;
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return NULL;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    char *word = line;
+    while (isspace((unsigned char)*word)) {
+      word++;
+    }
+    size_t len = strlen(word);
+    while (len > 0 && isspace((unsigned char)word[len - 1])) {
+      word[--len] = '\0';
+    }
+    if (len == 0 || word[0] == '#') {
+      continue;
+    }
+
+    if (nwords == cap) {
+      cap = cap ? 2 * cap : 64;
+      char **grown = realloc(words, cap * sizeof(char *));
+      if (!grown) {
+        goto done;
+      }
+      words = grown;
+    }
+    if (!(words[nwords] = strdup(word))) {
+      goto done;
+    }
+    nwords++;
+  }
+
+  if (!ferror(file)) {
+    automaton = BuildAutomaton((const char *const *)words, nwords);
+  }
+
+done:
+  for (size_t i = 0; i < nwords; i++) {
+    free(words[i]);
+  }
+  free(words);
+  fclose(file);
+  return automaton;
+}
+
+/**
+ * @brief Sets the pipeline up and starts its workers.
+ *
+ * @param banned_path  File of banned words, or NULL to mask none.
+ * @param rate         Messages per second a client may send, or 0 for no
+ *                     limit.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+int StartFilters(const char *banned_path, size_t rate) {
+  pthread_t tid;
+
+  filter_rate = rate;
+  if (banned_path && !(banned_words = LoadBannedWords(banned_path))) {
+    return -1;
+  }
+  link_prefixes = BuildAutomaton(
+      kLinkPrefixes, sizeof(kLinkPrefixes) / sizeof(kLinkPrefixes[0]));
+  if (!link_prefixes) {
+    return -1;
+  }
+
+  stages[0].enabled = rate > 0;
+  stages[1].enabled = banned_words != NULL;
+  stages[2].enabled = true;
+  stages[3].enabled = true;
+
+  for (size_t i = 0; i < kFilterWorkers; i++) {
+    filter_worker_t *worker = &workers[i];
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->queued, NULL);
+    pthread_cond_init(&worker->taken, NULL);
+    pthread_cond_init(&worker->answered, NULL);
+    if (pthread_create(&tid, NULL, &RunWorker, worker) != 0) {
+      return -1;
+    }
+    pthread_detach(tid);
+  }
+  return 0;
+}
+
+/**
+ * @brief Queues a message or chunk for the sender's worker.
+ *
+ * Waits while the worker has no room for it. Must be called with the
+ * worker's mutex held.
+ */
+static void QueueJob(filter_worker_t *worker, uint64_t sender,
+                     const char *name, const char *body, size_t body_len,
+                     uint64_t stream, filter_reply_t *reply) {
+  while (worker->len == kFilterQueueLen) {
+    pthread_cond_wait(&worker->taken, &worker->mutex);
+  }
+  filter_job_t *job =
+      &worker->jobs[(worker->head + worker->len) % kFilterQueueLen];
+  job->sender = sender;
+  snprintf(job->name, sizeof(job->name), "%s", name);
+  memcpy(job->body, body, body_len);
+  job->body[body_len] = '\0';
+  job->body_len = body_len;
+  job->stream = stream;
+  job->reply = reply;
+  worker->len++;
+  pthread_cond_signal(&worker->queued);
+}
+
+/**
+ * @brief Queues a chat message for filtering and broadcasting.
+ *
+ * Waits while the sender's worker has no room for it.
+ *
+ * @param sender    Handle of the sending client.
+ * @param name      Its name.
+ * @param body      Sanitized message body.
+ * @param body_len  Length of the message body.
+ *
+ * @return Returns 0 on success.
+ */
+int FilterMessage(uint64_t sender, const char *name, const char *body,
+                  size_t body_len) {
+  filter_worker_t *worker = &workers[HandleIndex(sender) % kFilterWorkers];
+
+  if (body_len >= kMessageCharLimit) {
+    body_len = kMessageCharLimit - 1;
+  }
+
+  pthread_mutex_lock(&worker->mutex);
+  QueueJob(worker, sender, name, body, body_len, 0, NULL);
+  pthread_mutex_unlock(&worker->mutex);
+
+  return 0;
+}
+
+/**
+ * @brief Filters a chunk of a message the client is streaming.
+ *
+ * The chunk is queued behind the sender's messages, and the call waits for
+ * the worker's verdict, so the caller relays the chunk in order.
+ *
+ * @param sender    Handle of the sending client.
+ * @param name      Its name.
+ * @param stream    Id of the stream.
+ * @param body      Sanitized chunk. Banned words are masked in place.
+ * @param body_len  Length of the chunk, at most kChunkLimit.
+ *
+ * @return Returns NULL if the chunk passed, or why it was dropped.
+ */
+const char *FilterChunk(uint64_t sender, const char *name, uint64_t stream,
+                        char *body, size_t body_len) {
+  filter_worker_t *worker = &workers[HandleIndex(sender) % kFilterWorkers];
+  filter_reply_t reply = {.body = body};
+
+  pthread_mutex_lock(&worker->mutex);
+  QueueJob(worker, sender, name, body, body_len, stream, &reply);
+  while (!reply.done) {
+    pthread_cond_wait(&worker->answered, &worker->mutex);
+  }
+  pthread_mutex_unlock(&worker->mutex);
+
+  return reply.reason;
+}
+
+/**
+ * @brief Reads the counters of the stages.
+ *
+ * @param stats  Where the counters are stored, in pipeline order.
+ * @param cap    Capacity of stats.
+ *
+ * @return Returns the number of stages stored.
+ */
+size_t GetFilterStats(filter_stats_t *stats, size_t cap) {
+  size_t n = cap < kFilterStages ? cap : kFilterStages;
+
+  for (size_t i = 0; i < n; i++) {
+    stats[i] = (filter_stats_t){.name = stages[i].name,
+                                .enabled = stages[i].enabled,
+                                .runs = atomic_load(&stages[i].runs),
+                                .hits = atomic_load(&stages[i].hits),
+                                .total_ns = atomic_load(&stages[i].total_ns),
+                                .max_ns = atomic_load(&stages[i].max_ns)};
+  }
+  return n;
+}
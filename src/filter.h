@@ -0,0 +1,58 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Ingress filters. Every chat message a client posts passes through a
+// pipeline of stages before it is broadcast, in this order:
+//
+//   rate    drops messages beyond a client's rate (-R, 0 turns it off), with
+//           bursts of up to kFilterBurst seconds' worth
+//   banned  masks the words listed in the file given with -F with '*'
+//   links   counts links and drops messages with more than kFilterLinkLimit
+//   spam    scores the message on its links, how often the client repeated
+//           it and how much it shouts, and drops it from kFilterSpamScore on
+//
+// The pipeline runs on kFilterWorkers worker threads. A message goes to the
+// worker of its sender's pool slot, so one client's messages keep their
+// order while different clients' messages are filtered in parallel. Each
+// worker has a queue of kFilterQueueLen messages; a client posting faster
+// than its worker keeps up waits for room. State kept per client, such as
+// its rate allowance, belongs to the client's worker, so stages take no
+// locks. Each stage counts the messages it ran on, those it changed or
+// dropped, and the time it took; /filters shows them.
+//
+// Chunks of a streamed message go through the sender's worker too, and are
+// relayed once they pass: a stream takes one message of the rate when it
+// opens, banned words and links are found across chunk boundaries, and the
+// links, shouting and runs of all its chunks so far add up to its spam
+// score. A dropped chunk aborts the stream.
+
+#define kFilterWorkers 4
+#define kFilterQueueLen 64
+#define kDefaultFilterRate 10  // Messages per second, see -R
+#define kFilterBurst 2         // Seconds of messages a client may save up
+#define kFilterLinkLimit 3
+#define kFilterSpamScore 6
+#define kFilterStages 4
+
+typedef struct {
+  const char *name;
+  bool enabled;
+  uint64_t runs;      // Messages the stage ran on
+  uint64_t hits;      // Messages it changed or dropped
+  uint64_t total_ns;  // Time spent in the stage
+  uint64_t max_ns;    // Longest run
+} filter_stats_t;
+
+int StartFilters(const char *banned_path, size_t rate);
+int FilterMessage(uint64_t sender, const char *name, const char *body,
+                  size_t body_len);
+const char *FilterChunk(uint64_t sender, const char *name, uint64_t stream,
+                        char *body, size_t body_len);
+size_t GetFilterStats(filter_stats_t *stats, size_t cap);
+
+#endif  // FILTER_H_
@@ -0,0 +1,58 @@
+/**
+ * @file hash.c
+ *
+ * @brief Multiply-fold 64-bit hash for content addressing.
+ */
+
+#include "hash.h"
+
+#include <endian.h>
+#include <string.h>
+
+static const uint64_t kHashPrimes[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL,
+    0x589965cc75374cc3ULL};
+
+/**
+ * @brief Multiplies two words and folds the 128-bit product to 64 bits.
+ */
+static inline uint64_t Fold(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+/**
+ * @brief Reads a little-endian word from an unaligned address.
+ */
+static inline uint64_t ReadWord(const uint8_t *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return le64toh(word);
+}
+
+/**
+ * @brief Hashes a byte string.
+ *
+ * @param data  Bytes to hash.
+ * @param len   Number of bytes.
+ *
+ * @return Returns the 64-bit hash.
+ */
+uint64_t HashBytes(const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t hash = Fold(len ^ kHashPrimes[0], kHashPrimes[1]);
+  size_t left = len;
+
+  while (left > 16) {
+    hash = Fold(ReadWord(p) ^ kHashPrimes[1], ReadWord(p + 8) ^ hash);
+    p += 16;
+    left -= 16;
+  }
+
+  // The last 1 to 16 bytes, zero-padded
+  uint8_t tail[16] = {0};
+  memcpy(tail, p, left);
+  hash = Fold(ReadWord(tail) ^ kHashPrimes[2], ReadWord(tail + 8) ^ hash);
+
+  return Fold(hash ^ kHashPrimes[3], (uint64_t)len ^ kHashPrimes[0]);
+}
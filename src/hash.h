@@ -0,0 +1,16 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fast non-cryptographic 64-bit hash for content addressing and
+// deduplication. It reads 16 bytes per round and folds each through a
+// 64x64->128-bit multiply, so it runs at memory speed on long inputs. It is
+// not meant to resist attackers: anything deduplicated by hash must compare
+// the content too before trusting a match. Hashes are stable across runs and
+// hosts, since attachment ids on disk are derived from them.
+
+uint64_t HashBytes(const void *data, size_t len);
+
+#endif  // HASH_H_
@@ -0,0 +1,273 @@
+/**
+ * @file heartbeat.c
+ *
+ * @brief Heartbeat pings on a timing wheel, RTT estimates and eviction.
+ */
+
+#include "heartbeat.h"
+
+#include <time.h>
+
+#include "chatroom.h"
+
+#define kPingPayloadLen 8
+
+static struct {
+  heartbeat_t *slots[kWheelSlots];
+  uint64_t now;  // Current tick
+  pthread_mutex_t mutex;
+} wheel = {.now = 0, .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// Round-trip times measured since the last report
+static atomic_uint_fast64_t rtt_counts[kRttBuckets];
+
+/**
+ * @brief Reads the monotonic clock in nanoseconds.
+ */
+static uint64_t NowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Takes a timer off the wheel. Must be called with the wheel mutex
+ *        held.
+ */
+static void Unschedule(heartbeat_t *heartbeat) {
+  if (!heartbeat->armed) {
+    return;
+  }
+  if (heartbeat->prev) {
+    heartbeat->prev->next = heartbeat->next;
+  } else {
+    wheel.slots[heartbeat->expires % kWheelSlots] = heartbeat->next;
+  }
+  if (heartbeat->next) {
+    heartbeat->next->prev = heartbeat->prev;
+  }
+  heartbeat->next = NULL;
+  heartbeat->prev = NULL;
+  heartbeat->armed = false;
+}
+
+/**
+ * @brief Puts a timer on the wheel, replacing any earlier schedule. Must be
+ *        called with the wheel mutex held.
+ *
+ * @param heartbeat  Timer to schedule.
+ * @param delay_ms   Time until it fires, rounded up to whole ticks.
+ */
+static void Schedule(heartbeat_t *heartbeat, uint64_t delay_ms) {
+  uint64_t ticks = (delay_ms + kWheelTickMs - 1) / kWheelTickMs;
+
+  Unschedule(heartbeat);
+  heartbeat->expires = wheel.now + (ticks > 0 ? ticks : 1);
+
+  heartbeat_t **slot = &wheel.slots[heartbeat->expires % kWheelSlots];
+  heartbeat->prev = NULL;
+  heartbeat->next = *slot;
+  if (*slot) {
+    (*slot)->prev = heartbeat;
+  }
+  *slot = heartbeat;
+  heartbeat->armed = true;
+}
+
+/**
+ * @brief Pings a client, or disconnects it if its last ping went unanswered.
+ *        Must be called with the wheel mutex held.
+ */
+static void FireHeartbeat(heartbeat_t *heartbeat) {
+  client_t *cli = heartbeat->client;
+
+  if (heartbeat->ping_sent) {
+    printf("Client not answering heartbeats: %s\n", cli->name);
+    // Its own thread notices the shutdown and removes it
+    shutdown(cli->connfd, SHUT_RDWR);
+    return;
+  }
+
+  uint64_t sent = NowNs();
+  uint8_t payload[kPingPayloadLen];
+  for (int i = 0; i < kPingPayloadLen; i++) {
+    payload[i] = (uint8_t)(sent >> (8 * (kPingPayloadLen - 1 - i)));
+  }
+
+  uint8_t ping[kWebSocketMaxHeaderLen + kFrameHeaderLen + kPingPayloadLen];
+  size_t ping_len;
+  if (atomic_load(&cli->protocol) == kProtocolWebSocket) {
+    ping_len = EncodeWebSocketFrame(kWebSocketPing, payload, sizeof(payload),
+                                    ping, sizeof(ping));
+  } else {
+    ping_len = EncodeFrame(kFramePing, NULL, payload, sizeof(payload), ping,
+                           sizeof(ping));
+  }
+  if (SendToClient(cli, kLaneControl, ping, ping_len) < 0) {
+    return;
+  }
+
+  uint64_t timeout_ms = 4 * heartbeat->srtt_us / 1000;
+  if (timeout_ms < kHeartbeatTimeoutMs) {
+    timeout_ms = kHeartbeatTimeoutMs;
+  }
+  heartbeat->ping_sent = sent;
+  Schedule(heartbeat, timeout_ms);
+}
+
+/**
+ * @brief Logs the round-trip times measured since the last report.
+ */
+static void ReportRtt(void) {
+  char report[kRttBuckets * 24];
+  size_t len = 0;
+  uint64_t total = 0;
+
+  for (int i = 0; i < kRttBuckets; i++) {
+    uint64_t count = atomic_exchange(&rtt_counts[i], 0);
+    if (count == 0) {
+      continue;
+    }
+    total += count;
+    if (i == kRttBuckets - 1) {
+      len += snprintf(report + len, sizeof(report) - len, " >=%dms:%" PRIu64,
+                      1 << (i - 1), count);
+    } else {
+      len += snprintf(report + len, sizeof(report) - len, " <%dms:%" PRIu64,
+                      1 << i, count);
+    }
+  }
+
+  if (total > 0) {
+    printf("Heartbeat RTT histogram (%" PRIu64 " samples):%s\n", total,
+           report);
+  }
+}
+
+/**
+ * @brief Advances the timing wheel every kWheelTickMs, fires due timers and
+ *        reclaims retired objects.
+ *
+ * @param arg  Unused.
+ *
+ * @return Never returns.
+ */
+static void *RunWheel(void *arg) {
+  struct timespec next;
+  uint64_t report_ticks = kRttReportMs / kWheelTickMs;
+  (void)arg;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (1) {
+    next.tv_nsec += kWheelTickMs * 1000000L;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    pthread_mutex_lock(&wheel.mutex);
+    uint64_t now = ++wheel.now;
+    heartbeat_t *heartbeat = wheel.slots[now % kWheelSlots];
+    while (heartbeat) {
+      heartbeat_t *following = heartbeat->next;
+      // Timers a full turn or more away share the slot and stay
+      if (heartbeat->expires <= now) {
+        Unschedule(heartbeat);
+        FireHeartbeat(heartbeat);
+      }
+      heartbeat = following;
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+
+    // Otherwise nothing retired frees up while no client comes or goes
+    EpochTryReclaim();
+    if (now % report_ticks == 0) {
+      ReportRtt();
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Starts the thread that drives the timing wheel.
+ *
+ * @return Returns 0 on success, or -1 if the thread could not be created.
+ */
+int StartHeartbeats(void) {
+  pthread_t tid;
+
+  if (pthread_create(&tid, NULL, &RunWheel, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+/**
+ * @brief Starts pinging a client.
+ *
+ * @param cli  Binary or WebSocket client that joined the chat.
+ */
+void WatchClient(client_t *cli) {
+  pthread_mutex_lock(&wheel.mutex);
+  cli->heartbeat.client = cli;
+  cli->heartbeat.ping_sent = 0;
+  Schedule(&cli->heartbeat, kHeartbeatIntervalMs);
+  pthread_mutex_unlock(&wheel.mutex);
+}
+
+/**
+ * @brief Stops pinging a client. Must be called before the client is removed.
+ *
+ * @param cli  Client to stop pinging. It need not be watched.
+ */
+void UnwatchClient(client_t *cli) {
+  pthread_mutex_lock(&wheel.mutex);
+  Unschedule(&cli->heartbeat);
+  pthread_mutex_unlock(&wheel.mutex);
+}
+
+/**
+ * @brief Handles a PONG from a client.
+ *
+ * A PONG answering the outstanding heartbeat gives a round-trip time sample,
+ * which updates the client's smoothed estimate the way TCP does and is
+ * counted in the histogram. The next ping is then scheduled. PONGs answering
+ * pings the client did not get from the heartbeat are ignored.
+ *
+ * @param cli      Client that sent the PONG.
+ * @param payload  PONG payload.
+ * @param len      Length of the payload.
+ */
+void ReceivePong(client_t *cli, const uint8_t *payload, size_t len) {
+  heartbeat_t *heartbeat = &cli->heartbeat;
+  uint64_t sent = 0;
+
+  if (len != kPingPayloadLen) {
+    return;
+  }
+  for (int i = 0; i < kPingPayloadLen; i++) {
+    sent = (sent << 8) | payload[i];
+  }
+
+  pthread_mutex_lock(&wheel.mutex);
+  if (heartbeat->armed && heartbeat->ping_sent != 0 &&
+      heartbeat->ping_sent == sent) {
+    uint64_t rtt_us = (NowNs() - sent) / 1000;
+    heartbeat->srtt_us = heartbeat->srtt_us == 0
+                             ? rtt_us
+                             : (7 * heartbeat->srtt_us + rtt_us) / 8;
+    heartbeat->ping_sent = 0;
+    Schedule(heartbeat, kHeartbeatIntervalMs);
+
+    int bucket = 0;
+    for (uint64_t ms = rtt_us / 1000; ms > 0 && bucket < kRttBuckets - 1;
+         ms >>= 1) {
+      bucket++;
+    }
+    atomic_fetch_add(&rtt_counts[bucket], 1);
+  }
+  pthread_mutex_unlock(&wheel.mutex);
+}
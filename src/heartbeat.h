@@ -0,0 +1,43 @@
+#ifndef HEARTBEAT_H_
+#define HEARTBEAT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Server-initiated heartbeats. Every binary and WebSocket client is pinged
+// kHeartbeatIntervalMs after it last answered, and disconnected if it does
+// not answer within kHeartbeatTimeoutMs, or four times its smoothed round-trip
+// time if that is longer. The PING payload is the time it was sent, echoed in
+// the PONG, which gives a round-trip time sample for the client's estimate
+// and for a histogram logged every kRttReportMs.
+//
+// Heartbeat timers live on a hashed timing wheel of kWheelSlots slots
+// advanced every kWheelTickMs, so scheduling, rescheduling and cancelling a
+// timer take constant time however many clients are connected.
+
+#define kHeartbeatIntervalMs 15000
+#define kHeartbeatTimeoutMs 10000
+#define kWheelTickMs 500
+#define kWheelSlots 64
+#define kRttBuckets 16  // Under 1 ms, then powers of two up to 16 s and over
+#define kRttReportMs 60000
+
+struct client;
+
+typedef struct heartbeat {
+  struct heartbeat *next;  // Timers in the same wheel slot
+  struct heartbeat *prev;
+  struct client *client;
+  uint64_t expires;    // Wheel tick the timer fires at
+  uint64_t ping_sent;  // When the unanswered ping was sent (ns), or 0
+  uint64_t srtt_us;    // Smoothed round-trip time, or 0 before any sample
+  bool armed;
+} heartbeat_t;
+
+int StartHeartbeats(void);
+void WatchClient(struct client *cli);
+void UnwatchClient(struct client *cli);
+void ReceivePong(struct client *cli, const uint8_t *payload, size_t len);
+
+#endif  // HEARTBEAT_H_
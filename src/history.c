@@ -0,0 +1,339 @@
+/**
+ * @file history.c
+ *
+ * @brief Ring of recent messages with encode-once, compress-once blocks.
+ */
+
+#include "history.h"
+
+#include "chatroom.h"
+#include "compress.h"
+#include "hash.h"
+
+/**
+ * @brief Encodes history entries back to back.
+ *
+ * @param entries   Entries to encode.
+ * @param count     Number of entries.
+ * @param encoding  Encoding to use.
+ * @param len       Where the encoded length is stored.
+ * @param offsets   Where the offset of each entry is stored, or NULL.
+ *
+ * @return Returns the malloc'd encoding, or NULL if allocation failed.
+ */
+static uint8_t *EncodeEntries(history_entry_t *const *entries, size_t count,
+                              history_encoding_t encoding, size_t *len,
+                              uint32_t *offsets) {
+  size_t cap = count * kEventBufferSize;
+  uint8_t *out = malloc(cap > 0 ? cap : 1);
+  if (!out) {
+    return NULL;
+  }
+
+  *len = 0;
+  for (size_t i = 0; i < count; i++) {
+    chat_event_t event = {.type = kEventHistory,
+                          .name = entries[i]->name,
+                          .body = entries[i]->body,
+                          .body_len = entries[i]->body_len,
+                          .seq = entries[i]->seq};
+    if (offsets) {
+      offsets[i] = (uint32_t)*len;
+    }
+    if (encoding == kHistoryText) {
+      *len += EncodeTextEvent(&event, (char *)out + *len, cap - *len);
+    } else {
+      *len += EncodeBinaryEvent(
+          &event, encoding == kHistorySequenced ? kFeatureSequence : 0,
+          out + *len, cap - *len);
+    }
+  }
+
+  return out;
+}
+
+static void FreeBlock(history_block_t *block) {
+  for (size_t i = 0; i < kHistoryEncodings; i++) {
+    free(block->encoded[i]);
+    free(block->compressed[i]);
+  }
+  free(block);
+}
+
+static void ReleaseBlock(history_block_t *block) {
+  if (atomic_fetch_sub(&block->refs, 1) == 1) {
+    FreeBlock(block);
+  }
+}
+
+/**
+ * @brief Builds the COMPRESSED frame carrying one of a block's binary
+ *        encodings.
+ *
+ * @return Returns 0 on success, or -1 if compression failed or did not pay
+ *         off, in which case replays fall back to the plain frames.
+ */
+static int CompressBlockFrames(history_block_t *block,
+                               history_encoding_t encoding) {
+  const uint8_t *frames = block->encoded[encoding];
+  size_t frames_len = block->encoded_len[encoding];
+  size_t bound = CompressBound(frames_len);
+  uint8_t *deflated = malloc(bound);
+  if (!deflated) {
+    return -1;
+  }
+
+  size_t deflated_len = CompressBlock(frames, frames_len, deflated, bound);
+  if (deflated_len == 0 || deflated_len >= frames_len) {
+    free(deflated);
+    return -1;
+  }
+
+  size_t cap = kFrameHeaderLen + deflated_len;
+  uint8_t *compressed = malloc(cap);
+  if (compressed) {
+    block->compressed_len[encoding] = EncodeFrame(
+        kFrameCompressed, NULL, deflated, deflated_len, compressed, cap);
+    block->compressed[encoding] = compressed;
+  }
+  free(deflated);
+
+  return compressed ? 0 : -1;
+}
+
+/**
+ * @brief Finds or stores the shared copy of a message body. Must be called
+ *        with the history mutex held.
+ *
+ * @return Returns the body with a reference taken, or NULL if allocation
+ *         failed.
+ */
+static history_body_t *InternBody(history_t *history, const char *body,
+                                  size_t body_len, uint64_t hash) {
+  history_body_t **bucket =
+      &history->bodies[hash & (kHistoryBodyBuckets - 1)];
+
+  for (history_body_t *shared = *bucket; shared; shared = shared->next) {
+    if (shared->hash == hash && shared->len == body_len &&
+        memcmp(shared->data, body, body_len) == 0) {
+      shared->refs++;
+      return shared;
+    }
+  }
+
+  history_body_t *shared = malloc(sizeof(history_body_t) + body_len);
+  if (!shared) {
+    return NULL;
+  }
+  memcpy(shared->data, body, body_len);
+  shared->hash = hash;
+  shared->len = body_len;
+  shared->refs = 1;
+  shared->next = *bucket;
+  *bucket = shared;
+  return shared;
+}
+
+/**
+ * @brief Drops an entry's reference to its body, freeing the body with the
+ *        last one. Must be called with the history mutex held.
+ */
+static void ReleaseBody(history_t *history, history_body_t *shared) {
+  if (--shared->refs > 0) {
+    return;
+  }
+
+  history_body_t **link =
+      &history->bodies[shared->hash & (kHistoryBodyBuckets - 1)];
+  while (*link != shared) {
+    link = &(*link)->next;
+  }
+  *link = shared->next;
+  free(shared);
+}
+
+/**
+ * @brief Seals the open block and pushes it into the ring.
+ *
+ * Must be called with the history mutex held.
+ */
+static void SealOpenBlock(history_t *history) {
+  history_block_t *block = calloc(1, sizeof(history_block_t));
+
+  if (block) {
+    atomic_init(&block->refs, 1);
+    for (size_t i = 0; i < history->nopen; i++) {
+      block->seqs[i] = history->open[i]->seq;
+    }
+    for (size_t i = 0; i < kHistoryEncodings; i++) {
+      block->encoded[i] = EncodeEntries(
+          history->open, history->nopen, (history_encoding_t)i,
+          &block->encoded_len[i],
+          i == kHistorySequenced ? block->offsets : NULL);
+      if (!block->encoded[i]) {
+        FreeBlock(block);
+        block = NULL;
+        break;
+      }
+    }
+  }
+  if (block) {
+    CompressBlockFrames(block, kHistoryFrames);
+    CompressBlockFrames(block, kHistorySequenced);
+  }
+  if (!block) {
+    PrintError("Failed to seal history block; dropping its messages\n");
+  }
+
+  for (size_t i = 0; i < history->nopen; i++) {
+    ReleaseBody(history, history->open[i]->shared);
+    free(history->open[i]);
+  }
+  history->nopen = 0;
+
+  if (!block) {
+    return;
+  }
+  if (history->nblocks == kHistoryBlocks) {
+    ReleaseBlock(history->blocks[0]);
+    memmove(history->blocks, history->blocks + 1,
+            (kHistoryBlocks - 1) * sizeof(history_block_t *));
+    history->nblocks--;
+  }
+  history->blocks[history->nblocks++] = block;
+}
+
+/**
+ * @brief Records a chat message in the history.
+ *
+ * @param history   History to append to.
+ * @param name      Name of the sender.
+ * @param body      Message body.
+ * @param body_len  Length of the message body.
+ *
+ * @return Returns the sequence number assigned to the message. Numbers are
+ *         assigned even if the message could not be stored.
+ */
+uint64_t AppendHistory(history_t *history, const char *name,
+                       const char *body, size_t body_len) {
+  size_t name_len = strlen(name);
+  uint64_t hash = HashBytes(body, body_len);
+  history_entry_t *entry = malloc(sizeof(history_entry_t) + name_len + 1);
+  if (entry) {
+    memcpy(entry->data, name, name_len + 1);
+    entry->name = entry->data;
+    entry->body_len = body_len;
+  }
+
+  pthread_mutex_lock(&history->mutex);
+  uint64_t seq = ++history->seq;
+  if (entry && (entry->shared = InternBody(history, body, body_len, hash))) {
+    entry->seq = seq;
+    entry->body = entry->shared->data;
+    history->open[history->nopen++] = entry;
+    if (history->nopen == kHistoryBlockLen) {
+      SealOpenBlock(history);
+    }
+  } else {
+    PrintError("Failed to allocate memory for history\n");
+    free(entry);
+  }
+  pthread_mutex_unlock(&history->mutex);
+
+  return seq;
+}
+
+/**
+ * @brief Captures the current history for replay to one client.
+ *
+ * Sealed blocks are shared with the history and only referenced; messages in
+ * the open block are encoded for the replay. When resuming, blocks the client
+ * already has are left out, and a block it has in part is sent from the
+ * first message it is missing.
+ *
+ * @param history   History to capture.
+ * @param encoding  Encoding the client receives.
+ * @param after     Sequence number of the last message the client has, or 0
+ *                  to capture everything. Only honored for
+ *                  kHistorySequenced, since other clients cannot tell which
+ *                  messages they were sent. A sequence number the room has
+ *                  not reached yet is from an earlier run of the server and
+ *                  is treated as 0.
+ * @param replay    Where the captured history is stored. Must be released
+ *                  with ReleaseHistory().
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+int CaptureHistory(history_t *history, history_encoding_t encoding,
+                   uint64_t after, history_replay_t *replay) {
+  if (encoding != kHistorySequenced) {
+    after = 0;
+  }
+  replay->encoding = encoding;
+  replay->skip = 0;
+  replay->stale = false;
+  replay->missed = 0;
+
+  pthread_mutex_lock(&history->mutex);
+
+  if (after > history->seq) {
+    replay->stale = true;
+    after = 0;
+  }
+  uint64_t oldest = history->seq + 1;
+  if (history->nblocks > 0) {
+    oldest = history->blocks[0]->seqs[0];
+  } else if (history->nopen > 0) {
+    oldest = history->open[0]->seq;
+  }
+  if (after > 0 && after + 1 < oldest) {
+    replay->missed = oldest - after - 1;
+  }
+
+  size_t open_from = 0;
+  while (open_from < history->nopen && history->open[open_from]->seq <= after) {
+    open_from++;
+  }
+  replay->tail = EncodeEntries(history->open + open_from,
+                               history->nopen - open_from, encoding,
+                               &replay->tail_len, NULL);
+  if (!replay->tail) {
+    pthread_mutex_unlock(&history->mutex);
+    return -1;
+  }
+
+  size_t first = 0;
+  while (first < history->nblocks &&
+         history->blocks[first]->seqs[kHistoryBlockLen - 1] <= after) {
+    first++;
+  }
+  if (first < history->nblocks) {
+    const history_block_t *block = history->blocks[first];
+    size_t i = 0;
+    while (block->seqs[i] <= after) {
+      i++;
+    }
+    replay->skip = block->offsets[i];
+  }
+
+  replay->nblocks = history->nblocks - first;
+  for (size_t i = 0; i < replay->nblocks; i++) {
+    replay->blocks[i] = history->blocks[first + i];
+    atomic_fetch_add(&replay->blocks[i]->refs, 1);
+  }
+
+  pthread_mutex_unlock(&history->mutex);
+  return 0;
+}
+
+/**
+ * @brief Releases what CaptureHistory() captured.
+ */
+void ReleaseHistory(history_replay_t *replay) {
+  for (size_t i = 0; i < replay->nblocks; i++) {
+    ReleaseBlock(replay->blocks[i]);
+  }
+  free(replay->tail);
+  replay->nblocks = 0;
+  replay->tail = NULL;
+}
@@ -0,0 +1,95 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Recent chat messages, replayed to clients when they join. Messages are
+// collected in an open block; once it holds kHistoryBlockLen messages it is
+// sealed, which encodes it once per history_encoding_t and compresses the
+// binary encodings a single time. Sealed blocks are immutable and shared by
+// every replay until they age out of the ring.
+//
+// Every message gets the next sequence number of the room. Clients that
+// track sequence numbers can resume from the last one they saw. A resume
+// point newer than the newest message comes from an earlier run of the
+// server and replays everything; one older than the history replays all of
+// it and reports how many messages were lost in between.
+//
+// Bodies of the messages in the open block are interned by their HashBytes()
+// hash, so a body that bots or spammers send over and over is stored once.
+
+#define kHistoryBlockLen 32
+#define kHistoryBlocks 4
+#define kHistoryBodyBuckets 64  // A power of two
+
+typedef enum {
+  kHistoryText,       // Messages as telnet users see them
+  kHistoryFrames,     // HISTORY frames
+  kHistorySequenced,  // HISTORY frames with sequence numbers
+  kHistoryEncodings,
+} history_encoding_t;
+
+// Message body shared by every entry with the same content
+typedef struct history_body {
+  struct history_body *next;  // Bodies in the same bucket
+  uint64_t hash;
+  size_t refs;  // Entries using it, guarded by the history mutex
+  size_t len;
+  char data[];
+} history_body_t;
+
+typedef struct {
+  uint64_t seq;
+  const char *name;
+  const char *body;
+  size_t body_len;
+  history_body_t *shared;  // Storage for body
+  char data[];             // Storage for name
+} history_entry_t;
+
+typedef struct {
+  atomic_uint refs;
+  uint8_t *encoded[kHistoryEncodings];
+  size_t encoded_len[kHistoryEncodings];
+  // Binary encodings as one COMPRESSED frame, or NULL
+  uint8_t *compressed[kHistoryEncodings];
+  size_t compressed_len[kHistoryEncodings];
+  // Sequence number of each message, and where it starts in the
+  // kHistorySequenced encoding
+  uint64_t seqs[kHistoryBlockLen];
+  uint32_t offsets[kHistoryBlockLen];
+} history_block_t;
+
+typedef struct {
+  history_block_t *blocks[kHistoryBlocks];  // Oldest first
+  size_t nblocks;
+  history_entry_t *open[kHistoryBlockLen];
+  size_t nopen;
+  history_body_t *bodies[kHistoryBodyBuckets];  // Bodies of the open block
+  uint64_t seq;  // Sequence number of the newest message
+  pthread_mutex_t mutex;
+} history_t;
+
+// Messages captured for one replay
+typedef struct {
+  history_encoding_t encoding;
+  history_block_t *blocks[kHistoryBlocks];
+  size_t nblocks;
+  size_t skip;    // Bytes of the first block's encoding to leave out
+  uint8_t *tail;  // Messages of the open block, encoded for the replay
+  size_t tail_len;
+  bool stale;       // The resume point was from an earlier run of the server
+  uint64_t missed;  // Messages after the resume point that aged out
+} history_replay_t;
+
+uint64_t AppendHistory(history_t *history, const char *name, const char *body,
+                       size_t body_len);
+int CaptureHistory(history_t *history, history_encoding_t encoding,
+                   uint64_t after, history_replay_t *replay);
+void ReleaseHistory(history_replay_t *replay);
+
+#endif  // HISTORY_H_
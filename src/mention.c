@@ -0,0 +1,418 @@
+/**
+ * @file mention.c
+ *
+ * @brief Registry of watched names and keywords, and the automaton that
+ *        finds them in messages.
+ */
+
+#include "mention.h"
+
+#include <ctype.h>
+#include <strings.h>
+
+#include "automaton.h"
+#include "chatroom.h"
+
+#define kRebuildRetryMs 100
+
+_Static_assert(kPatternLimit >= 1 + kNameCharLimit,
+               "a mention pattern must hold any name");
+_Static_assert(kPatternLimit > kKeywordLimit,
+               "a pattern must hold any keyword");
+
+typedef struct {
+  watcher_t watcher;
+  bool keyword;  // Added with /watch, rather than the watcher's own name
+  uint8_t len;
+  char pattern[kPatternLimit];
+} watch_t;
+
+// Immutable once published
+typedef struct {
+  automaton_t *automaton;
+  watch_t *watches;  // Pattern i of the automaton is watches[i]
+  size_t len;
+  epoch_entry_t retire;
+} mention_index_t;
+
+static struct {
+  watch_t *watches;
+  size_t len;
+  size_t cap;
+  bool dirty;  // Changed since the index was last built
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  _Atomic(mention_index_t *) index;
+} registry = {.watches = NULL,
+              .len = 0,
+              .cap = 0,
+              .dirty = false,
+              .mutex = PTHREAD_MUTEX_INITIALIZER,
+              .changed = PTHREAD_COND_INITIALIZER,
+              .index = NULL};
+
+static void DestroyIndex(void *arg) {
+  mention_index_t *index = (mention_index_t *)arg;
+
+  FreeAutomaton(index->automaton);
+  free(index->watches);
+  free(index);
+}
+
+/**
+ * @brief Compiles a copy of the registry into an index.
+ *
+ * @param watches  Copy of the registry; the index takes it over.
+ * @param len      Number of patterns in it.
+ *
+ * @return Returns the index, or NULL if allocation failed.
+ */
+static mention_index_t *BuildIndex(watch_t *watches, size_t len) {
+  mention_index_t *index = calloc(1, sizeof(mention_index_t));
+  const char **patterns = malloc((len + 1) * sizeof(char *));
+  if (!index || !patterns) {
+    goto fail;
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    patterns[i] = watches[i].pattern;
+  }
+  index->automaton = BuildAutomaton(patterns, len);
+  if (!index->automaton) {
+    goto fail;
+  }
+  index->watches = watches;
+  index->len = len;
+
+  free(patterns);
+  return index;
+
+fail:
+  free(patterns);
+  free(index);
+  free(watches);
+  return NULL;
+}
+
+/**
+ * @brief Rebuilds the automaton whenever the registry changes.
+ *
+ * Waits kMentionSettleMs after a change before copying the registry, so a
+ * burst of changes is compiled once.
+ */
+static void *RunBuilder(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&registry.mutex);
+  while (1) {
+    while (!registry.dirty) {
+      pthread_cond_wait(&registry.changed, &registry.mutex);
+    }
+    pthread_mutex_unlock(&registry.mutex);
+    usleep(kMentionSettleMs * 1000);
+    pthread_mutex_lock(&registry.mutex);
+
+    size_t npatterns = registry.len;
+    watch_t *patterns = malloc((npatterns + 1) * sizeof(watch_t));
+    if (patterns) {
+      if (npatterns > 0) {
+        memcpy(patterns, registry.watches, npatterns * sizeof(watch_t));
+      }
+      registry.dirty = false;
+    }
+    pthread_mutex_unlock(&registry.mutex);
+
+    mention_index_t *index = patterns ? BuildIndex(patterns, npatterns)
+                                      : NULL;
+    if (!index) {
+      PrintError("Failed to build mention automaton. Retrying...\n");
+      pthread_mutex_lock(&registry.mutex);
+      registry.dirty = true;
+      pthread_mutex_unlock(&registry.mutex);
+      usleep(kRebuildRetryMs * 1000);
+      pthread_mutex_lock(&registry.mutex);
+      continue;
+    }
+
+    mention_index_t *old = atomic_exchange(&registry.index, index);
+    if (old) {
+      EpochRetire(&old->retire, old, &DestroyIndex);
+    }
+    pthread_mutex_lock(&registry.mutex);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Starts the thread that rebuilds the automaton.
+ *
+ * @return Returns 0 on success, or -1 if the thread could not be started.
+ */
+int StartMentions(void) {
+  pthread_t tid;
+
+  if (pthread_create(&tid, NULL, &RunBuilder, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+/**
+ * @brief Adds a pattern to the registry. The registry mutex must be held.
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+static int AddWatch(watcher_t watcher, bool keyword, const char *pattern,
+                    size_t len) {
+  if (registry.len == registry.cap) {
+    size_t cap = registry.cap ? 2 * registry.cap : kMaxClients;
+    watch_t *watches = realloc(registry.watches, cap * sizeof(watch_t));
+    if (!watches) {
+      return -1;
+    }
+    registry.watches = watches;
+    registry.cap = cap;
+  }
+
+  watch_t *watch = &registry.watches[registry.len++];
+  watch->watcher = watcher;
+  watch->keyword = keyword;
+  watch->len = (uint8_t)len;
+  memcpy(watch->pattern, pattern, len);
+  watch->pattern[len] = '\0';
+
+  registry.dirty = true;
+  pthread_cond_signal(&registry.changed);
+  return 0;
+}
+
+/**
+ * @brief Removes the pattern at an index of the registry. The registry mutex
+ *        must be held.
+ */
+static void RemoveWatch(size_t index) {
+  registry.watches[index] = registry.watches[--registry.len];
+  registry.dirty = true;
+  pthread_cond_signal(&registry.changed);
+}
+
+/**
+ * @brief Watches "@NAME" for a client joining the chat.
+ *
+ * @param watcher  Handle of the client.
+ * @param name     Its name.
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+int WatchName(watcher_t watcher, const char *name) {
+  char pattern[kPatternLimit];
+  int len = snprintf(pattern, sizeof(pattern), "@%s", name);
+
+  pthread_mutex_lock(&registry.mutex);
+  int status = AddWatch(watcher, false, pattern, (size_t)len);
+  pthread_mutex_unlock(&registry.mutex);
+
+  return status;
+}
+
+/**
+ * @brief Adds a keyword to the ones a client watches.
+ *
+ * Watching a keyword twice has no effect.
+ *
+ * @param watcher  Handle of the client.
+ * @param keyword  Keyword, at most kKeywordLimit bytes without spaces.
+ *
+ * @return Returns 0 on success, or -1 with errno set to EINVAL if the
+ *         keyword is not valid, ENOSPC if the client already watches
+ *         kMaxKeywords keywords, or ENOMEM.
+ */
+int WatchKeyword(watcher_t watcher, const char *keyword) {
+  size_t len = strlen(keyword);
+  size_t count = 0;
+
+  if (len == 0 || len > kKeywordLimit) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (isspace((unsigned char)keyword[i])) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&registry.mutex);
+  for (size_t i = 0; i < registry.len; i++) {
+    watch_t *watch = &registry.watches[i];
+    if (watch->watcher != watcher || !watch->keyword) {
+      continue;
+    }
+    if (strcasecmp(watch->pattern, keyword) == 0) {
+      pthread_mutex_unlock(&registry.mutex);
+      return 0;
+    }
+    count++;
+  }
+
+  int status;
+  if (count == kMaxKeywords) {
+    errno = ENOSPC;
+    status = -1;
+  } else if ((status = AddWatch(watcher, true, keyword, len)) < 0) {
+    errno = ENOMEM;
+  }
+  pthread_mutex_unlock(&registry.mutex);
+
+  return status;
+}
+
+/**
+ * @brief Removes a keyword from the ones a client watches.
+ *
+ * @param watcher  Handle of the client.
+ * @param keyword  Keyword, matched ignoring ASCII case.
+ *
+ * @return Returns 0 on success, or -1 with errno set to ENOENT if the client
+ *         does not watch it.
+ */
+int UnwatchKeyword(watcher_t watcher, const char *keyword) {
+  int status = -1;
+
+  pthread_mutex_lock(&registry.mutex);
+  for (size_t i = 0; i < registry.len; i++) {
+    watch_t *watch = &registry.watches[i];
+    if (watch->watcher == watcher && watch->keyword &&
+        strcasecmp(watch->pattern, keyword) == 0) {
+      RemoveWatch(i);
+      status = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&registry.mutex);
+
+  if (status < 0) {
+    errno = ENOENT;
+  }
+  return status;
+}
+
+/**
+ * @brief Lists the keywords a client watches.
+ *
+ * @param watcher  Handle of the client.
+ * @param out      Where the keywords are written, separated by spaces and
+ *                 NUL-terminated.
+ * @param cap      Size of out.
+ *
+ * @return Returns the number of keywords.
+ */
+size_t ListKeywords(watcher_t watcher, char *out, size_t cap) {
+  size_t count = 0;
+  size_t len = 0;
+
+  out[0] = '\0';
+  pthread_mutex_lock(&registry.mutex);
+  for (size_t i = 0; i < registry.len; i++) {
+    watch_t *watch = &registry.watches[i];
+    if (watch->watcher != watcher || !watch->keyword) {
+      continue;
+    }
+    int written = snprintf(out + len, cap - len, "%s%s", count ? " " : "",
+                           watch->pattern);
+    if (written > 0 && (size_t)written < cap - len) {
+      len += (size_t)written;
+    }
+    count++;
+  }
+  pthread_mutex_unlock(&registry.mutex);
+
+  return count;
+}
+
+/**
+ * @brief Removes every pattern a client watches, as it leaves.
+ *
+ * @param watcher  Handle of the client.
+ */
+void ForgetWatcher(watcher_t watcher) {
+  pthread_mutex_lock(&registry.mutex);
+  for (size_t i = registry.len; i-- > 0;) {
+    if (registry.watches[i].watcher == watcher) {
+      RemoveWatch(i);
+    }
+  }
+  pthread_mutex_unlock(&registry.mutex);
+}
+
+// Hits of one scan
+typedef struct {
+  const mention_index_t *index;
+  const char *body;
+  size_t len;
+  watcher_t sender;
+  mention_hit_t *hits;
+  size_t nhits;
+  size_t cap;
+} mention_scan_t;
+
+/**
+ * @brief Records a match unless it is part of a longer word, is the sender's
+ *        own or its watcher was already hit.
+ *
+ * @return Returns false once there is no room for more hits.
+ */
+static bool AddHit(size_t pattern, size_t start, size_t end, void *arg) {
+  mention_scan_t *scan = (mention_scan_t *)arg;
+  const watch_t *watch = &scan->index->watches[pattern];
+
+  if (!IsWholeWord(scan->body, scan->len, start, end) ||
+      watch->watcher == scan->sender) {
+    return true;
+  }
+  for (size_t i = 0; i < scan->nhits; i++) {
+    if (scan->hits[i].watcher == watch->watcher) {
+      return true;
+    }
+  }
+
+  mention_hit_t *hit = &scan->hits[scan->nhits++];
+  hit->watcher = watch->watcher;
+  memcpy(hit->pattern, watch->pattern, watch->len + 1);
+  return scan->nhits < scan->cap;
+}
+
+/**
+ * @brief Finds the clients a message mentions or contains a keyword of.
+ *
+ * Each client is hit at most once, for the first of its patterns to end in
+ * the message.
+ *
+ * @param body    Message body.
+ * @param len     Length of the body.
+ * @param sender  Handle of the sender, who is never hit.
+ * @param hits    Where the hits are stored.
+ * @param cap     Capacity of hits.
+ *
+ * @return Returns the number of hits.
+ */
+size_t MatchMentions(const char *body, size_t len, watcher_t sender,
+                     mention_hit_t *hits, size_t cap) {
+  mention_scan_t scan = {.body = body,
+                         .len = len,
+                         .sender = sender,
+                         .hits = hits,
+                         .nhits = 0,
+                         .cap = cap};
+
+  EpochEnter();
+  scan.index = atomic_load(&registry.index);
+  if (scan.index && cap > 0) {
+    ScanAutomaton(scan.index->automaton, body, len, &AddHit, &scan);
+  }
+  EpochExit();
+
+  return scan.nhits;
+}
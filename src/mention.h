@@ -0,0 +1,48 @@
+#ifndef MENTION_H_
+#define MENTION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Mentions and keyword watches. Every client in the chat watches "@NAME" for
+// its own name and may watch up to kMaxKeywords keywords of its own. Each
+// message is scanned once, before it is broadcast, for every watched pattern
+// at the same time, and the clients whose patterns it contains are sent a
+// MENTION event besides the message itself. Messages streamed in chunks are
+// relayed a chunk at a time and not scanned.
+//
+// The patterns are compiled into one Aho-Corasick automaton (see
+// automaton.h), so scanning a message takes one table lookup per byte
+// however many patterns there are. Matching ignores ASCII case, and a
+// pattern only matches as a whole word.
+//
+// The automaton is immutable once built. Joins, leaves and watch changes
+// only mark the registry dirty; a background thread rebuilds the automaton
+// once changes have settled for kMentionSettleMs, publishes it and retires
+// the previous one through the epoch reclaimer, so a burst of joins costs one
+// rebuild and messages are never scanned under a lock.
+
+#define kMentionSettleMs 20
+#define kMaxKeywords 16
+#define kKeywordLimit 32
+#define kPatternLimit 65  // "@", the longest name and its NUL
+
+typedef uint64_t watcher_t;  // Client handle
+
+typedef struct {
+  watcher_t watcher;
+  char pattern[kPatternLimit];  // As registered, "@NAME" for mentions
+} mention_hit_t;
+
+int StartMentions(void);
+int WatchName(watcher_t watcher, const char *name);
+int WatchKeyword(watcher_t watcher, const char *keyword);
+int UnwatchKeyword(watcher_t watcher, const char *keyword);
+size_t ListKeywords(watcher_t watcher, char *out, size_t cap);
+void ForgetWatcher(watcher_t watcher);
+size_t MatchMentions(const char *body, size_t len, watcher_t sender,
+                     mention_hit_t *hits, size_t cap);
+
+#endif  // MENTION_H_
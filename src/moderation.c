@@ -0,0 +1,347 @@
+/**
+ * @file moderation.c
+ *
+ * @brief Ban and mute lists, and the moderator password.
+ */
+
+#include "moderation.h"
+
+#include <ctype.h>
+
+#include "chatroom.h"
+#include "hash.h"
+
+#define kEmptyKey 0
+#define kRemovedKey 1
+#define kMuteWords ((kMaxClients + 63) / 64)
+
+// What a key is the hash of: a lowercased name or an address
+typedef struct {
+  size_t len;
+  char bytes[kNameCharLimit];
+} set_value_t;
+
+typedef struct {
+  uint64_t *keys;       // kEmptyKey, kRemovedKey or a hash
+  set_value_t *values;  // Indexed like keys, only read when the hash matches
+  size_t cap;           // Power of two, or 0 before the first key
+  size_t used;     // Slots not empty, removed keys included
+  size_t len;      // Keys in the set
+  pthread_rwlock_t lock;
+} key_set_t;
+
+static key_set_t banned_names = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+static key_set_t banned_addresses = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+static key_set_t muted_names = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+static _Atomic uint64_t muted_slots[kMuteWords];
+
+static char password[kPasswordLimit];
+static size_t password_len = 0;
+
+/**
+ * @brief Finds where a key is in a set, or where it would go.
+ *
+ * Keys whose hashes collide are told apart by their values.
+ *
+ * @return Returns the index of the key, or of the empty slot ending its
+ *         probe sequence. The set must not be full.
+ */
+static size_t ProbeKey(const key_set_t *set, uint64_t key,
+                       const set_value_t *value) {
+  size_t mask = set->cap - 1;
+
+  for (size_t i = (size_t)key & mask;; i = (i + 1) & mask) {
+    if (set->keys[i] == kEmptyKey ||
+        (set->keys[i] == key && set->values[i].len == value->len &&
+         memcmp(set->values[i].bytes, value->bytes, value->len) == 0)) {
+      return i;
+    }
+  }
+}
+
+static bool ContainsKey(key_set_t *set, uint64_t key,
+                        const set_value_t *value) {
+  pthread_rwlock_rdlock(&set->lock);
+  bool found =
+      set->cap > 0 && set->keys[ProbeKey(set, key, value)] != kEmptyKey;
+  pthread_rwlock_unlock(&set->lock);
+
+  return found;
+}
+
+/**
+ * @brief Rehashes a set into a table at most a quarter full, dropping
+ *        removed keys. The set must be locked exclusively.
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+static int ResizeSet(key_set_t *set) {
+  size_t cap = kModerationSetInitialCap;
+  while (cap < 4 * (set->len + 1)) {
+    cap *= 2;
+  }
+
+  key_set_t resized = {.keys = calloc(cap, sizeof(uint64_t)),
+                       .values = malloc(cap * sizeof(set_value_t)),
+                       .cap = cap};
+  if (!resized.keys || !resized.values) {
+    free(resized.keys);
+    free(resized.values);
+    return -1;
+  }
+
+  for (size_t i = 0; i < set->cap; i++) {
+    if (set->keys[i] != kEmptyKey && set->keys[i] != kRemovedKey) {
+      size_t j = ProbeKey(&resized, set->keys[i], &set->values[i]);
+      resized.keys[j] = set->keys[i];
+      resized.values[j] = set->values[i];
+      resized.used++;
+    }
+  }
+
+  free(set->keys);
+  free(set->values);
+  set->keys = resized.keys;
+  set->values = resized.values;
+  set->cap = resized.cap;
+  set->used = resized.used;
+  return 0;
+}
+
+static int AddKey(key_set_t *set, uint64_t key, const set_value_t *value) {
+  int status = 0;
+
+  pthread_rwlock_wrlock(&set->lock);
+  // Keep at least half of the slots empty so probe sequences stay short
+  if (2 * (set->used + 1) > set->cap && ResizeSet(set) < 0) {
+    status = -1;
+  } else {
+    size_t i = ProbeKey(set, key, value);
+    if (set->keys[i] == kEmptyKey) {
+      set->keys[i] = key;
+      set->values[i] = *value;
+      set->used++;
+      set->len++;
+    }
+  }
+  pthread_rwlock_unlock(&set->lock);
+
+  return status;
+}
+
+static bool RemoveKey(key_set_t *set, uint64_t key,
+                      const set_value_t *value) {
+  bool found = false;
+
+  pthread_rwlock_wrlock(&set->lock);
+  if (set->cap > 0) {
+    size_t i = ProbeKey(set, key, value);
+    if (set->keys[i] != kEmptyKey) {
+      // Keys further along the probe sequence must still be found
+      set->keys[i] = kRemovedKey;
+      set->len--;
+      found = true;
+    }
+  }
+  pthread_rwlock_unlock(&set->lock);
+
+  return found;
+}
+
+/**
+ * @brief Hashes a name, ignoring ASCII case.
+ *
+ * @param name   Name to hash.
+ * @param value  Where the lowercased name is stored.
+ */
+static uint64_t NameKey(const char *name, set_value_t *value) {
+  size_t len = 0;
+
+  for (; name[len] && len < sizeof(value->bytes); len++) {
+    value->bytes[len] = (char)tolower((unsigned char)name[len]);
+  }
+  value->len = len;
+  uint64_t key = HashBytes(value->bytes, len);
+  return key <= kRemovedKey ? key + 2 : key;
+}
+
+static uint64_t AddressKey(struct in_addr addr, set_value_t *value) {
+  value->len = sizeof(addr.s_addr);
+  memcpy(value->bytes, &addr.s_addr, sizeof(addr.s_addr));
+  uint64_t key = HashBytes(value->bytes, value->len);
+  return key <= kRemovedKey ? key + 2 : key;
+}
+
+/**
+ * @brief Reads the moderator password, the first line of a file.
+ *
+ * @param path  File to read.
+ *
+ * @return Returns 0 on success, or -1 if the file could not be read or its
+ *         first line is empty.
+ */
+int LoadModeratorPassword(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+
+  if (!fgets(password, sizeof(password), file)) {
+    password[0] = '\0';
+  }
+  fclose(file);
+
+  password_len = strcspn(password, "\r\n");
+  password[password_len] = '\0';
+  if (password_len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+bool IsModerationEnabled(void) {
+  return password_len > 0;
+}
+
+/**
+ * @brief Checks a password against the moderator password.
+ *
+ * Takes as long whatever prefix of the password is right.
+ *
+ * @param attempt  Password to check.
+ *
+ * @return Returns true if moderation is enabled and the password is right.
+ */
+bool CheckModeratorPassword(const char *attempt) {
+  size_t len = strlen(attempt);
+  unsigned char diff = len != password_len;
+
+  if (password_len == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < password_len; i++) {
+    diff |= (unsigned char)(password[i] ^ attempt[i < len ? i : 0]);
+  }
+  return diff == 0;
+}
+
+/**
+ * @brief Bans a name.
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+int BanName(const char *name) {
+  set_value_t value;
+  uint64_t key = NameKey(name, &value);
+
+  return AddKey(&banned_names, key, &value);
+}
+
+/**
+ * @brief Lifts the ban on a name.
+ *
+ * @return Returns true if the name was banned.
+ */
+bool UnbanName(const char *name) {
+  set_value_t value;
+  uint64_t key = NameKey(name, &value);
+
+  return RemoveKey(&banned_names, key, &value);
+}
+
+bool IsBannedName(const char *name) {
+  set_value_t value;
+  uint64_t key = NameKey(name, &value);
+
+  return ContainsKey(&banned_names, key, &value);
+}
+
+/**
+ * @brief Bans an IPv4 address.
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+int BanAddress(struct in_addr addr) {
+  set_value_t value;
+  uint64_t key = AddressKey(addr, &value);
+
+  return AddKey(&banned_addresses, key, &value);
+}
+
+/**
+ * @brief Lifts the ban on an IPv4 address.
+ *
+ * @return Returns true if the address was banned.
+ */
+bool UnbanAddress(struct in_addr addr) {
+  set_value_t value;
+  uint64_t key = AddressKey(addr, &value);
+
+  return RemoveKey(&banned_addresses, key, &value);
+}
+
+bool IsBannedAddress(struct in_addr addr) {
+  set_value_t value;
+  uint64_t key = AddressKey(addr, &value);
+
+  return ContainsKey(&banned_addresses, key, &value);
+}
+
+/**
+ * @brief Mutes a name from now on, including after reconnects.
+ *
+ * The slots of clients already connected with the name are muted separately
+ * with SetSlotMuted().
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+int MuteName(const char *name) {
+  set_value_t value;
+  uint64_t key = NameKey(name, &value);
+
+  return AddKey(&muted_names, key, &value);
+}
+
+/**
+ * @brief Unmutes a name.
+ *
+ * @return Returns true if the name was muted.
+ */
+bool UnmuteName(const char *name) {
+  set_value_t value;
+  uint64_t key = NameKey(name, &value);
+
+  return RemoveKey(&muted_names, key, &value);
+}
+
+bool IsMutedName(const char *name) {
+  set_value_t value;
+  uint64_t key = NameKey(name, &value);
+
+  return ContainsKey(&muted_names, key, &value);
+}
+
+/**
+ * @brief Sets whether the client in a pool slot is muted.
+ *
+ * @param slot   Pool slot index.
+ * @param muted  Whether its messages are kept from the room.
+ */
+void SetSlotMuted(uint32_t slot, bool muted) {
+  uint64_t bit = (uint64_t)1 << (slot % 64);
+
+  if (muted) {
+    atomic_fetch_or(&muted_slots[slot / 64], bit);
+  } else {
+    atomic_fetch_and(&muted_slots[slot / 64], ~bit);
+  }
+}
+
+bool IsSlotMuted(uint32_t slot) {
+  return (atomic_load_explicit(&muted_slots[slot / 64],
+                               memory_order_relaxed) >>
+          (slot % 64)) &
+         1;
+}
@@ -0,0 +1,52 @@
+#ifndef MODERATION_H_
+#define MODERATION_H_
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Moderation. With -M PATH, a client that sends "/op PASSWORD", where
+// PASSWORD is the first line of the file at PATH, becomes a moderator and
+// may mute, kick and ban other clients. Each wrong password is answered
+// only after kOpFailureDelayMs, and a client that gives kOpFailureLimit of
+// them is disconnected, so guessing costs a reconnect every few seconds.
+//
+// Banned names, banned addresses and muted names are kept in hash sets of
+// their 64-bit hashes (see hash.h): open addressing with linear probing in a
+// flat array of keys, at most half full, so a miss usually touches one cache
+// line. The lowercased name or the address is kept in a parallel array and
+// compared only when a hash matches, so a name whose hash collides with a
+// banned one is not banned. Names are hashed lowercased, so a ban or mute
+// covers every spelling of a name. Sets are read under a shared lock, so
+// checking every connection against the ban list at accept costs next to
+// nothing.
+//
+// Whether each pool slot's client is muted is also kept in a bitmap, set
+// when a client is muted and recomputed from the muted names whenever a
+// client joins, so a muted name stays muted across reconnects. Checking
+// whether a message's sender is muted is then a single atomic load.
+
+#define kModerationSetInitialCap 64  // Power of two
+#define kPasswordLimit 128
+#define kOpFailureDelayMs 1000  // Before answering a wrong /op password
+#define kOpFailureLimit 3       // Wrong passwords before disconnecting
+
+int LoadModeratorPassword(const char *path);
+bool IsModerationEnabled(void);
+bool CheckModeratorPassword(const char *password);
+
+int BanName(const char *name);
+bool UnbanName(const char *name);
+bool IsBannedName(const char *name);
+int BanAddress(struct in_addr addr);
+bool UnbanAddress(struct in_addr addr);
+bool IsBannedAddress(struct in_addr addr);
+int MuteName(const char *name);
+bool UnmuteName(const char *name);
+bool IsMutedName(const char *name);
+
+void SetSlotMuted(uint32_t slot, bool muted);
+bool IsSlotMuted(uint32_t slot);
+
+#endif  // MODERATION_H_
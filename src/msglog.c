@@ -0,0 +1,336 @@
+/**
+ * @file msglog.c
+ *
+ * @brief Append-only file of every chat message, read back by offset.
+ */
+
+#define _GNU_SOURCE
+#include "msglog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "chatroom.h"
+
+static int log_fd = -1;
+// Bytes of complete records; readers never look past it
+static _Atomic uint64_t log_size;
+static uint64_t last_time_ms;  // Time of the newest record
+
+// Sparse time index. Marks are only appended, by the thread appending to the
+// log, past the nmarks readers look at.
+static struct {
+  int fd;
+  log_mark_t *marks;  // Mapping of the index file
+  size_t cap;         // Marks the mapping holds
+  atomic_size_t nmarks;
+  // Held shared by readers, and exclusively only to grow the mapping
+  pthread_rwlock_t lock;
+} time_index = {.fd = -1,
+                .marks = NULL,
+                .cap = 0,
+                .lock = PTHREAD_RWLOCK_INITIALIZER};
+
+static void PutLe(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint64_t GetLe(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    value = (value << 8) | in[i];
+  }
+  return value;
+}
+
+/**
+ * @brief Grows the time index file and its mapping by kLogMarkChunk marks.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int GrowTimeIndex(void) {
+  size_t cap = time_index.cap + kLogMarkChunk;
+
+  if (ftruncate(time_index.fd, (off_t)(cap * sizeof(log_mark_t))) < 0) {
+    return -1;
+  }
+  void *marks =
+      time_index.marks
+          ? mremap(time_index.marks, time_index.cap * sizeof(log_mark_t),
+                   cap * sizeof(log_mark_t), MREMAP_MAYMOVE)
+          : mmap(NULL, cap * sizeof(log_mark_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, time_index.fd, 0);
+  if (marks == MAP_FAILED) {
+    return -1;
+  }
+  time_index.marks = (log_mark_t *)marks;
+  time_index.cap = cap;
+  return 0;
+}
+
+/**
+ * @brief Marks a record in the time index if it is kLogMarkSpan bytes or
+ *        more past the last mark.
+ *
+ * Must only be called by the thread appending to the log.
+ */
+static void MarkRecord(uint64_t time_ms, uint64_t offset) {
+  size_t n = atomic_load(&time_index.nmarks);
+
+  if (time_index.fd < 0 ||
+      (n > 0 && offset - time_index.marks[n - 1].offset < kLogMarkSpan)) {
+    return;
+  }
+  if (n == time_index.cap) {
+    pthread_rwlock_wrlock(&time_index.lock);
+    int status = GrowTimeIndex();
+    pthread_rwlock_unlock(&time_index.lock);
+    if (status < 0) {
+      PrintError("Failed to grow message log index: %s\n", strerror(errno));
+      return;
+    }
+  }
+  time_index.marks[n] = (log_mark_t){.time_ms = time_ms, .offset = offset};
+  atomic_store(&time_index.nmarks, n + 1);
+}
+
+/**
+ * @brief Maps the time index of a log and finds its valid marks.
+ *
+ * Marks must point at increasing offsets within the log, with times that
+ * never go backwards; the index is cut at the first one that does not.
+ *
+ * @param path      Path of the log file.
+ * @param log_size  Size of the log file.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int OpenTimeIndex(const char *path, uint64_t log_size) {
+  char index_path[4096];
+  struct stat st;
+
+  if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >=
+      (int)sizeof(index_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  time_index.fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (time_index.fd < 0 || fstat(time_index.fd, &st) < 0) {
+    return -1;
+  }
+
+  // Map what is there, rounded up to whole chunks
+  size_t marks = (size_t)st.st_size / sizeof(log_mark_t);
+  size_t chunks = (marks + kLogMarkChunk - 1) / kLogMarkChunk;
+  time_index.cap = chunks > 0 ? (chunks - 1) * kLogMarkChunk : 0;
+  if (GrowTimeIndex() < 0) {
+    return -1;
+  }
+
+  size_t n = 0;
+  const log_mark_t *mark = time_index.marks;
+  while (n < time_index.cap && mark[n].time_ms != 0 &&
+         mark[n].offset < log_size &&
+         (n == 0 ? mark[n].offset == 0
+                 : mark[n].offset > mark[n - 1].offset &&
+                       mark[n].time_ms >= mark[n - 1].time_ms)) {
+    n++;
+  }
+  memset(time_index.marks + n, 0, (time_index.cap - n) * sizeof(log_mark_t));
+  atomic_store(&time_index.nmarks, n);
+  return 0;
+}
+
+/**
+ * @brief Opens the message log and its time index, creating them if needed.
+ *
+ * Walks the records after the last mark in the index, marking them as
+ * needed, and truncates a record cut short at the end.
+ *
+ * @param path  Path of the log file.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+int OpenMessageLog(const char *path) {
+  struct stat st;
+  uint8_t header[kLogHeaderLen + 8];
+
+  log_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (log_fd < 0 || fstat(log_fd, &st) < 0 ||
+      OpenTimeIndex(path, (uint64_t)st.st_size) < 0) {
+    return -1;
+  }
+
+  size_t n = atomic_load(&time_index.nmarks);
+  uint64_t offset = n > 0 ? time_index.marks[n - 1].offset : 0;
+  while (offset + sizeof(header) <= (uint64_t)st.st_size &&
+         pread(log_fd, header, sizeof(header), (off_t)offset) ==
+             (ssize_t)sizeof(header)) {
+    uint64_t len = GetLe(header, kLogHeaderLen);
+    if (len < kLogFixedLen ||
+        offset + kLogHeaderLen + len > (uint64_t)st.st_size) {
+      break;
+    }
+    uint64_t time_ms = GetLe(header + kLogHeaderLen, 8);
+    if (time_ms > last_time_ms) {
+      last_time_ms = time_ms;
+    }
+    MarkRecord(last_time_ms, offset);
+    offset += kLogHeaderLen + len;
+  }
+  if (offset < (uint64_t)st.st_size) {
+    printf("Truncating message log after %" PRIu64 " bytes\n", offset);
+    if (ftruncate(log_fd, (off_t)offset) < 0) {
+      return -1;
+    }
+    // The cut record may have been marked
+    n = atomic_load(&time_index.nmarks);
+    while (n > 0 && time_index.marks[n - 1].offset >= offset) {
+      time_index.marks[--n] = (log_mark_t){0};
+    }
+    atomic_store(&time_index.nmarks, n);
+  }
+
+  atomic_store(&log_size, offset);
+  return 0;
+}
+
+/**
+ * @brief Appends a chat message to the log, if there is one.
+ *
+ * Callers must serialize appends; the room mutex does.
+ *
+ * @param name      Name of the sender.
+ * @param body      Message body.
+ * @param body_len  Length of the message body.
+ */
+void AppendMessageLog(const char *name, const char *body, size_t body_len) {
+  uint8_t record[kLogHeaderLen + kLogFixedLen + kNameCharLimit +
+                 kMessageCharLimit];
+  struct timespec now;
+
+  if (log_fd < 0) {
+    return;
+  }
+
+  size_t name_len = strnlen(name, kNameCharLimit - 1);
+  if (body_len > kMessageCharLimit) {
+    body_len = kMessageCharLimit;
+  }
+  size_t len = kLogFixedLen + name_len + body_len;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t time_ms =
+      (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+  if (time_ms < last_time_ms) {
+    time_ms = last_time_ms;
+  }
+  PutLe(record, len, kLogHeaderLen);
+  PutLe(record + kLogHeaderLen, time_ms, 8);
+  record[kLogHeaderLen + 8] = (uint8_t)name_len;
+  memcpy(record + kLogHeaderLen + kLogFixedLen, name, name_len);
+  memcpy(record + kLogHeaderLen + kLogFixedLen + name_len, body, body_len);
+
+  ssize_t written = write(log_fd, record, kLogHeaderLen + len);
+  if (written != (ssize_t)(kLogHeaderLen + len)) {
+    PrintError("Failed to append to message log: %s\n",
+               written < 0 ? strerror(errno) : "short write");
+    return;
+  }
+  uint64_t offset = atomic_fetch_add(&log_size, kLogHeaderLen + len);
+  last_time_ms = time_ms;
+  MarkRecord(time_ms, offset);
+}
+
+/**
+ * @brief Tells whether messages are logged.
+ */
+bool HasMessageLog(void) {
+  return log_fd >= 0;
+}
+
+/**
+ * @brief Returns the size of the complete records in the log, or 0 if there
+ *        is no log.
+ */
+uint64_t MessageLogSize(void) {
+  return atomic_load(&log_size);
+}
+
+/**
+ * @brief Finds where to start reading the log for the messages logged at or
+ *        after a time.
+ *
+ * @param time_ms  Time in milliseconds since the epoch.
+ *
+ * @return Returns the offset of the last marked record logged before
+ *         time_ms, or 0. Records from there on that were logged before
+ *         time_ms, at most kLogMarkSpan bytes of them, are to be skipped.
+ */
+uint64_t SeekMessageLog(uint64_t time_ms) {
+  pthread_rwlock_rdlock(&time_index.lock);
+  size_t lo = 0;
+  size_t hi = atomic_load(&time_index.nmarks);
+  // Find the first mark at or after time_ms
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (time_index.marks[mid].time_ms < time_ms) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  uint64_t offset = lo > 0 ? time_index.marks[lo - 1].offset : 0;
+  pthread_rwlock_unlock(&time_index.lock);
+
+  return offset;
+}
+
+/**
+ * @brief Reads one record of the log.
+ *
+ * @param offset  Where the record starts.
+ * @param record  Where the record is stored.
+ * @param buf     Buffer for the record's name and body.
+ * @param cap     Size of buf.
+ *
+ * @return Returns 0 on success, or -1 if there is no complete record at
+ *         offset or it does not fit in buf.
+ */
+int ReadMessageLog(uint64_t offset, log_record_t *record, char *buf,
+                   size_t cap) {
+  uint8_t header[kLogHeaderLen + kLogFixedLen];
+  uint64_t size = atomic_load(&log_size);
+
+  if (log_fd < 0 || offset + sizeof(header) > size ||
+      pread(log_fd, header, sizeof(header), (off_t)offset) !=
+          (ssize_t)sizeof(header)) {
+    return -1;
+  }
+
+  uint64_t len = GetLe(header, kLogHeaderLen);
+  size_t name_len = header[kLogHeaderLen + 8];
+  if (len < kLogFixedLen + name_len || offset + kLogHeaderLen + len > size ||
+      len - kLogFixedLen > cap) {
+    return -1;
+  }
+
+  size_t rest = (size_t)(len - kLogFixedLen);
+  if (pread(log_fd, buf, rest, (off_t)(offset + sizeof(header))) !=
+      (ssize_t)rest) {
+    return -1;
+  }
+
+  record->offset = offset;
+  record->next = offset + kLogHeaderLen + len;
+  record->time_ms = GetLe(header + kLogHeaderLen, 8);
+  memcpy(record->name, buf, name_len);
+  record->name[name_len] = '\0';
+  record->body = buf + name_len;
+  record->body_len = rest - name_len;
+  return 0;
+}
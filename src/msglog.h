@@ -0,0 +1,57 @@
+#ifndef MSGLOG_H_
+#define MSGLOG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Persistent message log. With -p PATH every chat message is appended to the
+// file at PATH, which survives restarts and feeds the search index. The log
+// is append-only; a record is written with a single write(), in the order
+// messages are numbered. Messages streamed in chunks are not numbered, so
+// they are not logged.
+//
+// Each record is a 4-byte little-endian length of the rest of the record,
+// then the time the message was logged (8 bytes, little-endian milliseconds
+// since the epoch), the sender's name length (1 byte), the name and the
+// body. A record is identified by its offset in the file. A record cut short
+// by a crash is truncated away when the log is opened. Logged times never go
+// backwards, even if the clock does.
+//
+// A sparse time index in PATH.idx marks the time and offset of a record at
+// least every kLogMarkSpan bytes of the log. The index file is mapped into
+// memory and grown kLogMarkChunk marks at a time, so it is kept on disk
+// without ever being read or written with a syscall. Finding the messages
+// since a time is a binary search over the marks, then a sequential read of
+// at most kLogMarkSpan bytes to the first message at or after it.
+
+#define kLogHeaderLen 4
+#define kLogFixedLen (8 + 1)  // Time and name length
+#define kLogMarkSpan (64 * 1024)
+#define kLogMarkChunk 4096
+
+// Marks are stored in host byte order
+typedef struct {
+  uint64_t time_ms;  // Time of the marked record, 0 in unused marks
+  uint64_t offset;   // Where the marked record starts
+} log_mark_t;
+
+typedef struct {
+  uint64_t offset;   // Where the record starts
+  uint64_t next;     // Where the following record starts
+  uint64_t time_ms;  // When it was logged
+  char name[256];
+  const char *body;  // Points into the caller's buffer
+  size_t body_len;
+} log_record_t;
+
+int OpenMessageLog(const char *path);
+bool HasMessageLog(void);
+void AppendMessageLog(const char *name, const char *body, size_t body_len);
+uint64_t MessageLogSize(void);
+uint64_t SeekMessageLog(uint64_t time_ms);
+int ReadMessageLog(uint64_t offset, log_record_t *record, char *buf,
+                   size_t cap);
+
+#endif  // MSGLOG_H_
@@ -0,0 +1,260 @@
+/**
+ * @file outbox.c
+ *
+ * @brief Two-lane send queues that let control frames overtake bulk data.
+ */
+
+#include "outbox.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/**
+ * @brief Tells whether a closing outbox has run out of time to flush.
+ */
+static bool FlushExpired(outbox_t *outbox) {
+  struct timespec now;
+
+  if (!atomic_load(&outbox->closing)) {
+    return false;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > outbox->deadline.tv_sec ||
+         (now.tv_sec == outbox->deadline.tv_sec &&
+          now.tv_nsec >= outbox->deadline.tv_nsec);
+}
+
+/**
+ * @brief Sends one item in full.
+ *
+ * Sends never block, so a writer stuck on a client that stopped reading
+ * still notices when its outbox is stopped.
+ *
+ * @return Returns 0 if everything was sent, or -1 on error or if the outbox
+ *         was stopped before the item could be sent.
+ */
+static int SendItem(outbox_t *outbox, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(outbox->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent >= 0) {
+      buf += sent;
+      len -= (size_t)sent;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || FlushExpired(outbox)) {
+      return -1;
+    }
+
+    struct pollfd pfd = {.fd = outbox->fd, .events = POLLOUT};
+    poll(&pfd, 1, kOutboxPollMs);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Sends queued items, control lane first, until the outbox stops.
+ *
+ * @param arg  Outbox to drain.
+ *
+ * @return Returns NULL once the outbox is stopped and drained, or sending
+ *         failed.
+ */
+static void *OutboxWriter(void *arg) {
+  outbox_t *outbox = (outbox_t *)arg;
+
+  pthread_mutex_lock(&outbox->mutex);
+  while (1) {
+    while (!outbox->head[kLaneControl] && !outbox->head[kLaneData] &&
+           !atomic_load(&outbox->closing)) {
+      pthread_cond_wait(&outbox->cond, &outbox->mutex);
+    }
+
+    outbox_lane_t lane = outbox->head[kLaneControl] ? kLaneControl : kLaneData;
+    outbox_item_t *item = outbox->head[lane];
+    if (!item) {
+      break;
+    }
+    outbox->head[lane] = item->next;
+    if (!item->next) {
+      outbox->tail[lane] = NULL;
+    }
+    outbox->queued -= item->len;
+    pthread_mutex_unlock(&outbox->mutex);
+
+    int status = SendItem(outbox, item->data, item->len);
+    free(item);
+
+    pthread_mutex_lock(&outbox->mutex);
+    if (status < 0) {
+      outbox->failed = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&outbox->mutex);
+
+  return NULL;
+}
+
+/**
+ * @brief Initializes an empty outbox for a connection.
+ *
+ * Also caps the socket's send buffer at kOutboxSocketBuffer.
+ *
+ * @param outbox  Outbox to initialize.
+ * @param fd      Socket the outbox sends on.
+ */
+void InitOutbox(outbox_t *outbox, int fd) {
+  int sndbuf = kOutboxSocketBuffer;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  outbox->fd = fd;
+  pthread_mutex_init(&outbox->mutex, NULL);
+  pthread_cond_init(&outbox->cond, NULL);
+  for (int lane = 0; lane < kLanes; lane++) {
+    outbox->head[lane] = NULL;
+    outbox->tail[lane] = NULL;
+  }
+  outbox->queued = 0;
+  outbox->failed = false;
+  atomic_init(&outbox->closing, false);
+  outbox->started = false;
+}
+
+/**
+ * @brief Starts the writer thread of an outbox.
+ *
+ * @param outbox  Outbox to start.
+ *
+ * @return Returns 0 on success, or -1 if the thread could not be created.
+ */
+int StartOutbox(outbox_t *outbox) {
+  if (pthread_create(&outbox->writer, NULL, &OutboxWriter, outbox) != 0) {
+    return -1;
+  }
+  outbox->started = true;
+  return 0;
+}
+
+/**
+ * @brief Queues bytes to be sent as one item.
+ *
+ * The buffers are copied, so the caller may reuse them right away.
+ *
+ * @param outbox  Outbox to queue on.
+ * @param lane    Lane to queue on.
+ * @param iov     Buffers to send back to back.
+ * @param iovcnt  Number of buffers.
+ *
+ * @return Returns 0 on success, or -1 with errno set to ENOBUFS if the
+ *         outbox is full, EPIPE if it is stopped, sending failed or it filled
+ *         up before, or ENOMEM.
+ */
+int PostOutbox(outbox_t *outbox, outbox_lane_t lane, const struct iovec *iov,
+               int iovcnt) {
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+
+  outbox_item_t *item = malloc(sizeof(outbox_item_t) + len);
+  if (!item) {
+    errno = ENOMEM;
+    return -1;
+  }
+  item->next = NULL;
+  item->len = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(item->data + item->len, iov[i].iov_base, iov[i].iov_len);
+    item->len += iov[i].iov_len;
+  }
+
+  pthread_mutex_lock(&outbox->mutex);
+  int error = 0;
+  if (outbox->failed || atomic_load(&outbox->closing)) {
+    error = EPIPE;
+  } else if (outbox->queued + len > kOutboxBytes) {
+    outbox->failed = true;
+    error = ENOBUFS;
+  } else {
+    if (outbox->tail[lane]) {
+      outbox->tail[lane]->next = item;
+    } else {
+      outbox->head[lane] = item;
+    }
+    outbox->tail[lane] = item;
+    outbox->queued += len;
+    pthread_cond_signal(&outbox->cond);
+  }
+  pthread_mutex_unlock(&outbox->mutex);
+
+  if (error) {
+    free(item);
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Returns the number of bytes queued and not yet being sent.
+ *
+ * @param outbox  Outbox to look at.
+ */
+size_t OutboxBacklog(outbox_t *outbox) {
+  pthread_mutex_lock(&outbox->mutex);
+  size_t queued = outbox->queued;
+  pthread_mutex_unlock(&outbox->mutex);
+
+  return queued;
+}
+
+/**
+ * @brief Stops an outbox, sending what is queued for up to kOutboxFlushMs.
+ *
+ * Items queued after the outbox is stopped are refused.
+ *
+ * @param outbox  Outbox to stop.
+ */
+void StopOutbox(outbox_t *outbox) {
+  pthread_mutex_lock(&outbox->mutex);
+  clock_gettime(CLOCK_MONOTONIC, &outbox->deadline);
+  outbox->deadline.tv_sec += kOutboxFlushMs / 1000;
+  outbox->deadline.tv_nsec += (kOutboxFlushMs % 1000) * 1000000L;
+  if (outbox->deadline.tv_nsec >= 1000000000L) {
+    outbox->deadline.tv_sec++;
+    outbox->deadline.tv_nsec -= 1000000000L;
+  }
+  atomic_store(&outbox->closing, true);
+  pthread_cond_signal(&outbox->cond);
+  pthread_mutex_unlock(&outbox->mutex);
+
+  if (outbox->started) {
+    pthread_join(outbox->writer, NULL);
+    outbox->started = false;
+  }
+}
+
+/**
+ * @brief Frees whatever is still queued on a stopped outbox.
+ *
+ * @param outbox  Outbox to destroy.
+ */
+void DestroyOutbox(outbox_t *outbox) {
+  for (int lane = 0; lane < kLanes; lane++) {
+    outbox_item_t *item = outbox->head[lane];
+    while (item) {
+      outbox_item_t *next = item->next;
+      free(item);
+      item = next;
+    }
+  }
+  pthread_cond_destroy(&outbox->cond);
+  pthread_mutex_destroy(&outbox->mutex);
+}
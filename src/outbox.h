@@ -0,0 +1,56 @@
+#ifndef OUTBOX_H_
+#define OUTBOX_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// Per-connection send queues drained by a writer thread. Bytes are queued on
+// one of two lanes: control (server notices, pongs, handshake replies) and
+// data (chat, presence, history replay). The writer always sends queued
+// control items before the next data item, so control traffic never waits
+// behind a deep data queue for more than the one item being sent. Items are
+// sent whole, so frames from the two lanes never interleave.
+
+#define kOutboxBytes (1024 * 1024)  // Queued bytes allowed per connection
+#define kOutboxFlushMs 1000         // How long a stopping outbox keeps sending
+#define kOutboxPollMs 100
+// Socket send buffer of a connection with an outbox. Bytes in the kernel can
+// no longer be overtaken, so it is kept small and the backlog stays queued.
+#define kOutboxSocketBuffer (64 * 1024)
+
+typedef enum { kLaneControl, kLaneData, kLanes } outbox_lane_t;
+
+typedef struct outbox_item {
+  struct outbox_item *next;
+  size_t len;
+  uint8_t data[];
+} outbox_item_t;
+
+typedef struct {
+  int fd;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;  // Signaled when items are queued or closing is set
+  outbox_item_t *head[kLanes];
+  outbox_item_t *tail[kLanes];
+  size_t queued;  // Bytes queued on both lanes
+  bool failed;    // Sending failed; nothing more is queued
+  _Atomic bool closing;
+  struct timespec deadline;  // Until when a closing outbox keeps sending
+  bool started;
+  pthread_t writer;
+} outbox_t;
+
+void InitOutbox(outbox_t *outbox, int fd);
+int StartOutbox(outbox_t *outbox);
+int PostOutbox(outbox_t *outbox, outbox_lane_t lane, const struct iovec *iov,
+               int iovcnt);
+size_t OutboxBacklog(outbox_t *outbox);
+void StopOutbox(outbox_t *outbox);
+void DestroyOutbox(outbox_t *outbox);
+
+#endif  // OUTBOX_H_
@@ -0,0 +1,210 @@
+/**
+ * @file plugin.c
+ *
+ * @brief Loads plugins and calls their hooks on threads of their own.
+ */
+
+#include "plugin.h"
+
+#include <dlfcn.h>
+#include <time.h>
+
+#include "chatroom.h"
+
+typedef struct {
+  event_type_t type;
+  char name[kNameCharLimit];
+  char body[kMessageCharLimit];
+  size_t body_len;
+  uint64_t seq;
+  uint64_t time_ms;
+} plugin_job_t;
+
+typedef struct {
+  plugin_t plugin;
+  void *library;
+  plugin_job_t jobs[kPluginQueueLen];  // Ring of queued events
+  size_t head;
+  size_t len;
+  uint64_t dropped;  // Events dropped since the ring last emptied
+  pthread_mutex_t mutex;
+  pthread_cond_t queued;
+} plugin_slot_t;
+
+static const plugin_host_t host = {.abi_version = kPluginAbiVersion,
+                                   .post_message = &PostPluginMessage};
+
+static plugin_slot_t *plugins[kMaxPlugins];
+static size_t nplugins = 0;
+
+/**
+ * @brief Returns the hook of a plugin for an event type, or NULL.
+ */
+static plugin_hook_fn PluginHook(const plugin_t *plugin, event_type_t type) {
+  switch (type) {
+    case kEventJoin:
+      return plugin->on_join;
+    case kEventMessage:
+      return plugin->on_message;
+    case kEventLeave:
+      return plugin->on_leave;
+    default:
+      return NULL;
+  }
+}
+
+/**
+ * @brief Calls a plugin's hooks for the events queued for it.
+ *
+ * @param arg  The plugin's slot.
+ */
+static void *RunPlugin(void *arg) {
+  plugin_slot_t *slot = (plugin_slot_t *)arg;
+  plugin_job_t job;
+
+  while (1) {
+    pthread_mutex_lock(&slot->mutex);
+    while (slot->len == 0) {
+      pthread_cond_wait(&slot->queued, &slot->mutex);
+    }
+    job = slot->jobs[slot->head];
+    slot->head = (slot->head + 1) % kPluginQueueLen;
+    slot->len--;
+    uint64_t dropped = slot->len == 0 ? slot->dropped : 0;
+    slot->dropped -= dropped;
+    pthread_mutex_unlock(&slot->mutex);
+
+    plugin_event_t event = {
+        .name = job.name,
+        .body = job.type == kEventMessage ? job.body : NULL,
+        .body_len = job.body_len,
+        .seq = job.seq,
+        .time_ms = job.time_ms};
+    PluginHook(&slot->plugin, job.type)(slot->plugin.state, &event);
+
+    if (dropped > 0) {
+      printf("Plugin %s fell behind and missed %" PRIu64 " events\n",
+             slot->plugin.name, dropped);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Loads a plugin and starts its dispatch thread.
+ *
+ * @param path  Path of the shared library, as given to dlopen().
+ *
+ * @return Returns 0 on success, or -1 on error, which has been printed.
+ */
+int LoadPlugin(const char *path) {
+  plugin_slot_t *slot = NULL;
+  pthread_t tid;
+
+  if (nplugins == kMaxPlugins) {
+    PrintError("Too many plugins (at most %d)\n", kMaxPlugins);
+    return -1;
+  }
+
+  void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    PrintError("Failed to load plugin: %s\n", dlerror());
+    return -1;
+  }
+
+  plugin_init_fn init;
+  *(void **)&init = dlsym(library, kPluginInitSymbol);
+  if (!init) {
+    PrintError("Not a plugin, no %s: %s\n", kPluginInitSymbol, path);
+    goto fail;
+  }
+
+  slot = calloc(1, sizeof(plugin_slot_t));
+  if (!slot) {
+    PrintError("Failed to allocate memory for plugin\n");
+    goto fail;
+  }
+  slot->library = library;
+  if (init(&host, &slot->plugin) != 0) {
+    PrintError("Plugin refused to start: %s\n", path);
+    goto fail;
+  }
+  if (slot->plugin.abi_version == 0 ||
+      slot->plugin.abi_version > kPluginAbiVersion) {
+    PrintError("Plugin needs a newer server (ABI %u, have %u): %s\n",
+               slot->plugin.abi_version, kPluginAbiVersion, path);
+    goto fail;
+  }
+  if (!slot->plugin.name) {
+    slot->plugin.name = path;
+  }
+
+  pthread_mutex_init(&slot->mutex, NULL);
+  pthread_cond_init(&slot->queued, NULL);
+  if (pthread_create(&tid, NULL, &RunPlugin, slot) != 0) {
+    PrintError("Failed to start plugin %s\n", slot->plugin.name);
+    goto fail;
+  }
+  pthread_detach(tid);
+
+  plugins[nplugins++] = slot;
+  printf("Loaded plugin %s\n", slot->plugin.name);
+  return 0;
+
+fail:
+  free(slot);
+  dlclose(library);
+  return -1;
+}
+
+/**
+ * @brief Queues an event for the plugins with a hook for it.
+ *
+ * Never waits for a plugin: an event a plugin has no room for is dropped
+ * for that plugin.
+ *
+ * @param event  Join, leave or numbered chat message. Other events are
+ *               ignored.
+ */
+void NotifyPlugins(const chat_event_t *event) {
+  struct timespec now;
+  uint64_t time_ms = 0;
+
+  for (size_t i = 0; i < nplugins; i++) {
+    plugin_slot_t *slot = plugins[i];
+    if (!PluginHook(&slot->plugin, event->type)) {
+      continue;
+    }
+    if (time_ms == 0) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      time_ms = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+    }
+
+    size_t body_len = event->type == kEventMessage ? event->body_len : 0;
+    if (body_len >= kMessageCharLimit) {
+      body_len = kMessageCharLimit - 1;
+    }
+
+    pthread_mutex_lock(&slot->mutex);
+    if (slot->len == kPluginQueueLen) {
+      slot->dropped++;
+      pthread_mutex_unlock(&slot->mutex);
+      continue;
+    }
+    plugin_job_t *job =
+        &slot->jobs[(slot->head + slot->len) % kPluginQueueLen];
+    job->type = event->type;
+    snprintf(job->name, sizeof(job->name), "%s", event->name);
+    if (body_len > 0) {
+      memcpy(job->body, event->body, body_len);
+    }
+    job->body[body_len] = '\0';
+    job->body_len = body_len;
+    job->seq = event->seq;
+    job->time_ms = time_ms;
+    slot->len++;
+    pthread_cond_signal(&slot->queued);
+    pthread_mutex_unlock(&slot->mutex);
+  }
+}
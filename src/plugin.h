@@ -0,0 +1,23 @@
+#ifndef PLUGIN_H_
+#define PLUGIN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "plugin_api.h"
+#include "protocol.h"
+
+// Plugins loaded with -P (see plugin_api.h for the ABI). Each plugin gets a
+// dispatch thread and a ring of kPluginQueueLen events. Threads announcing
+// joins and leaves and broadcasting messages copy the event into the ring of
+// every plugin with a hook for it and move on; when a ring is full the event
+// is dropped for that plugin and counted, so queueing never waits. The
+// dispatch thread logs the count once it has caught up.
+
+#define kMaxPlugins 8
+#define kPluginQueueLen 256
+
+int LoadPlugin(const char *path);
+void NotifyPlugins(const chat_event_t *event);
+
+#endif  // PLUGIN_H_
@@ -0,0 +1,61 @@
+#ifndef PLUGIN_API_H_
+#define PLUGIN_API_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Plugin ABI, the only header a plugin needs. A plugin is a shared library,
+// loaded at startup with -P PATH, that exports a function named
+// kPluginInitSymbol of type plugin_init_fn. The server calls it once with the
+// functions it offers plugins and a zeroed plugin_t for the plugin to fill
+// in; a nonzero return refuses the plugin and stops the server.
+//
+// The server calls on_join, on_message and on_leave for the clients joining,
+// the chat messages broadcast and the clients leaving, including those of
+// linked servers. Messages streamed in chunks are relayed without ever being
+// held whole, so on_message never sees them. Hooks run on a thread of their
+// plugin's own, one at a time and in the order the events happened, never on
+// a thread serving clients. Events wait for the plugin in a bounded queue; a
+// plugin that falls too far behind misses events rather than holding up
+// delivery, and the server logs how many it missed. Strings in an event are
+// only valid during the call.
+//
+// The ABI only grows. Fields are appended to the end of the structs below
+// and kPluginAbiVersion is bumped when they are, so a plugin built against
+// an older version keeps loading, while one built against a newer version
+// than the server's is refused.
+
+#define kPluginAbiVersion 1
+#define kPluginInitSymbol "chat_plugin_init"
+
+typedef struct {
+  const char *name;  // Client that joined, left or sent the message
+  const char *body;  // NUL-terminated message body, or NULL
+  size_t body_len;
+  uint64_t seq;      // Sequence number of a message, or 0
+  uint64_t time_ms;  // When it happened, in ms since the Unix epoch
+} plugin_event_t;
+
+typedef struct {
+  uint32_t abi_version;  // kPluginAbiVersion of the server
+  // Broadcasts a chat message from name to the room, like one a client sent
+  // but not filtered. Plugins see their own messages too. Returns 0 on
+  // success, or -1 on error.
+  int (*post_message)(const char *name, const char *body, size_t body_len);
+} plugin_host_t;
+
+typedef void (*plugin_hook_fn)(void *state, const plugin_event_t *event);
+
+typedef struct {
+  uint32_t abi_version;  // kPluginAbiVersion the plugin was built with
+  const char *name;      // Shown in the server's log
+  void *state;           // Passed to every hook
+  // Each hook may be NULL
+  plugin_hook_fn on_join;
+  plugin_hook_fn on_message;
+  plugin_hook_fn on_leave;
+} plugin_t;
+
+typedef int (*plugin_init_fn)(const plugin_host_t *host, plugin_t *plugin);
+
+#endif  // PLUGIN_API_H_
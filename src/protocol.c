@@ -0,0 +1,387 @@
+/**
+ * @file protocol.c
+ *
+ * @brief Encoding and decoding of the text and binary wire protocols.
+ */
+
+#include "protocol.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "chatroom.h"
+
+/**
+ * @brief Encodes an unsigned integer as a LEB128 varint.
+ *
+ * @param value  Value to encode.
+ * @param out    Destination buffer of at least kMaxVarintLen bytes.
+ *
+ * @return Returns the number of bytes written.
+ */
+size_t EncodeVarint(uint64_t value, uint8_t *out) {
+  size_t len = 0;
+
+  while (value >= 0x80) {
+    out[len++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (uint8_t)value;
+
+  return len;
+}
+
+/**
+ * @brief Decodes a LEB128 varint.
+ *
+ * @param buf    Bytes to decode.
+ * @param len    Number of bytes available in buf.
+ * @param value  Where the decoded value is stored.
+ *
+ * @return Returns the number of bytes consumed, 0 if buf ends before the
+ *         varint does, or -1 if the varint is longer than kMaxVarintLen.
+ */
+ssize_t DecodeVarint(const uint8_t *buf, size_t len, uint64_t *value) {
+  uint64_t result = 0;
+
+  for (size_t i = 0; i < kMaxVarintLen; i++) {
+    if (i >= len) {
+      return 0;
+    }
+    result |= (uint64_t)(buf[i] & 0x7F) << (7 * i);
+    if (!(buf[i] & 0x80)) {
+      *value = result;
+      return (ssize_t)(i + 1);
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Parses one binary frame from the start of a buffer.
+ *
+ * The frame payload is not copied; it points into buf.
+ *
+ * @param buf          Received bytes.
+ * @param len          Number of bytes in buf.
+ * @param max_payload  Largest payload accepted.
+ * @param frame        Where the parsed frame is stored.
+ *
+ * @return Returns the total size of the frame, 0 if buf does not yet hold a
+ *         complete frame, or -1 if the frame is malformed or too large.
+ */
+ssize_t ParseFrame(const uint8_t *buf, size_t len, size_t max_payload,
+                   frame_t *frame) {
+  uint64_t payload_len;
+
+  if (len < 1) {
+    return 0;
+  }
+
+  ssize_t varint_len = DecodeVarint(buf + 1, len - 1, &payload_len);
+  if (varint_len <= 0) {
+    return varint_len;
+  }
+  if (payload_len > max_payload) {
+    return -1;
+  }
+
+  size_t header_len = 1 + (size_t)varint_len;
+  if (len - header_len < payload_len) {
+    return 0;
+  }
+
+  frame->type = buf[0];
+  frame->payload = buf + header_len;
+  frame->len = (size_t)payload_len;
+
+  return (ssize_t)(header_len + payload_len);
+}
+
+/**
+ * @brief Parses a varint length-prefixed string from a frame payload.
+ *
+ * @param buf      Payload bytes.
+ * @param len      Number of bytes in buf.
+ * @param str      Where a pointer to the string bytes is stored.
+ * @param str_len  Where the string length is stored.
+ *
+ * @return Returns the number of bytes consumed, or -1 if the payload is
+ *         truncated.
+ */
+ssize_t ParseString(const uint8_t *buf, size_t len, const uint8_t **str,
+                    size_t *str_len) {
+  uint64_t value;
+
+  ssize_t varint_len = DecodeVarint(buf, len, &value);
+  if (varint_len <= 0 || value > len - (size_t)varint_len) {
+    return -1;
+  }
+
+  *str = buf + varint_len;
+  *str_len = (size_t)value;
+
+  return varint_len + (ssize_t)value;
+}
+
+/**
+ * @brief Encodes a binary frame.
+ *
+ * @param type      Frame type.
+ * @param name      Optional name to prefix the payload with, or NULL.
+ * @param body      Remainder of the payload.
+ * @param body_len  Number of bytes in body.
+ * @param out       Destination buffer.
+ * @param cap       Size of out.
+ *
+ * @return Returns the encoded frame size, or 0 if it does not fit in out.
+ */
+size_t EncodeFrame(uint8_t type, const char *name, const void *body,
+                   size_t body_len, uint8_t *out, size_t cap) {
+  uint8_t name_header[kMaxVarintLen];
+  size_t name_len = name ? strlen(name) : 0;
+  size_t name_header_len = name ? EncodeVarint(name_len, name_header) : 0;
+  size_t payload_len = name_header_len + name_len + body_len;
+
+  uint8_t header[kFrameHeaderLen];
+  header[0] = type;
+  size_t header_len = 1 + EncodeVarint(payload_len, header + 1);
+
+  if (header_len + payload_len > cap) {
+    return 0;
+  }
+
+  size_t off = 0;
+  memcpy(out + off, header, header_len);
+  off += header_len;
+  memcpy(out + off, name_header, name_header_len);
+  off += name_header_len;
+  if (name) {
+    memcpy(out + off, name, name_len);
+    off += name_len;
+  }
+  memcpy(out + off, body, body_len);
+  off += body_len;
+
+  return off;
+}
+
+/**
+ * @brief Replaces line breaks with spaces.
+ *
+ * @param begin  First byte to process.
+ * @param end    Byte past the last one to process.
+ */
+static void FlattenLines(uint8_t *begin, uint8_t *end) {
+  for (uint8_t *p = begin; p < end; p++) {
+    if (*p == '\n') {
+      *p = ' ';
+    }
+  }
+}
+
+/**
+ * @brief Formats an event the way telnet users see it.
+ *
+ * @param event  Event to format.
+ * @param out    Destination buffer.
+ * @param cap    Size of out.
+ *
+ * @return Returns the length of the formatted text, truncated to fit in out.
+ */
+size_t EncodeTextEvent(const chat_event_t *event, char *out, size_t cap) {
+  int body_len = (int)event->body_len;
+  int len;
+
+  switch (event->type) {
+    case kEventJoin:
+      len = snprintf(out, cap, "\n=== %s has joined the chat ===\n",
+                     event->name);
+      break;
+    case kEventLeave:
+      len = snprintf(out, cap, "\n=== %s has left the chat ===\n",
+                     event->name);
+      break;
+    case kEventDirect:
+      len = snprintf(out, cap, "[DM] %s%s%.*s\n", event->name, kPromptString,
+                     body_len, event->body);
+      break;
+    case kEventNotice:
+      len = snprintf(out, cap, "\n=== %.*s ===\n", body_len, event->body);
+      break;
+    case kEventMention:
+      len = snprintf(out, cap, "[%s] %s%s%.*s\n", event->pattern, event->name,
+                     kPromptString, body_len, event->body);
+      break;
+    case kEventChunk:
+      if (body_len == 0) {
+        return 0;
+      }
+      len = snprintf(out, cap, "%s%s%.*s\n", event->name, kPromptString,
+                     body_len, event->body);
+      if (len > 0) {
+        // Keep the chunk on one line, as SanitizeText() does for messages
+        size_t end = (size_t)len < cap ? (size_t)len - 1 : cap - 1;
+        FlattenLines((uint8_t *)out + strlen(event->name) +
+                         strlen(kPromptString),
+                     (uint8_t *)out + end);
+      }
+      break;
+    case kEventMessage:
+    case kEventHistory:
+    default:
+      len = snprintf(out, cap, "%s%s%.*s\n", event->name, kPromptString,
+                     body_len, event->body);
+      break;
+  }
+
+  if (len < 0) {
+    return 0;
+  }
+  return (size_t)len < cap ? (size_t)len : cap - 1;
+}
+
+/**
+ * @brief Encodes a frame carrying a name and body behind a prefix.
+ *
+ * @param type        Frame type.
+ * @param event       Event providing the name and body.
+ * @param prefix      Bytes preceding the name, with room for a varint more.
+ * @param prefix_len  Number of bytes in prefix.
+ * @param out         Destination buffer.
+ * @param cap         Size of out.
+ *
+ * @return Returns the encoded frame size, or 0 if it does not fit in out.
+ */
+static size_t EncodePrefixedFrame(uint8_t type, const chat_event_t *event,
+                                  uint8_t *prefix, size_t prefix_len,
+                                  uint8_t *out, size_t cap) {
+  size_t name_len = strlen(event->name);
+  prefix_len += EncodeVarint(name_len, prefix + prefix_len);
+  size_t payload_len = prefix_len + name_len + event->body_len;
+
+  uint8_t header[kFrameHeaderLen];
+  header[0] = type;
+  size_t header_len = 1 + EncodeVarint(payload_len, header + 1);
+
+  if (header_len + payload_len > cap) {
+    return 0;
+  }
+
+  size_t off = 0;
+  memcpy(out + off, header, header_len);
+  off += header_len;
+  memcpy(out + off, prefix, prefix_len);
+  off += prefix_len;
+  memcpy(out + off, event->name, name_len);
+  off += name_len;
+  memcpy(out + off, event->body, event->body_len);
+  off += event->body_len;
+
+  return off;
+}
+
+/**
+ * @brief Tells which feature changes how an event is encoded.
+ *
+ * Binary clients receive an event in one of two encodings, depending on
+ * whether they negotiated this feature.
+ *
+ * @param event  Event to encode.
+ *
+ * @return Returns the feature, or 0 if every binary client gets the same
+ *         encoding.
+ */
+uint64_t EventFeature(const chat_event_t *event) {
+  switch (event->type) {
+    case kEventMessage:
+    case kEventHistory:
+      return kFeatureSequence;
+    case kEventChunk:
+      return kFeatureChunks;
+    case kEventMention:
+      return kFeatureMentions;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief Encodes an event as a binary frame.
+ *
+ * @param event     Event to encode.
+ * @param features  Features the recipient negotiated.
+ * @param out       Destination buffer.
+ * @param cap       Size of out.
+ *
+ * @return Returns the encoded frame size, or 0 if it does not fit in out or
+ *         there is nothing to send.
+ */
+size_t EncodeBinaryEvent(const chat_event_t *event, uint64_t features,
+                         uint8_t *out, size_t cap) {
+  uint8_t prefix[2 * kMaxVarintLen + 1];
+  size_t prefix_len;
+
+  if ((features & kFeatureSequence) && (event->type == kEventMessage ||
+                                        event->type == kEventHistory)) {
+    prefix_len = EncodeVarint(event->seq, prefix);
+    return EncodePrefixedFrame(
+        event->type == kEventMessage ? kFrameMessage : kFrameHistory, event,
+        prefix, prefix_len, out, cap);
+  }
+
+  if (event->type == kEventChunk) {
+    if (features & kFeatureChunks) {
+      prefix_len = EncodeVarint(event->stream, prefix);
+      prefix[prefix_len++] = event->chunk_flags;
+      return EncodePrefixedFrame(kFrameChunk, event, prefix, prefix_len, out,
+                                 cap);
+    }
+    if (event->body_len == 0) {
+      return 0;
+    }
+    size_t len = EncodeFrame(kFrameMessage, event->name, event->body,
+                             event->body_len, out, cap);
+    if (len > 0) {
+      FlattenLines(out + len - event->body_len, out + len);
+    }
+    return len;
+  }
+
+  if (event->type == kEventMention) {
+    if (!(features & kFeatureMentions)) {
+      return 0;
+    }
+    size_t pattern_len = strlen(event->pattern);
+    uint8_t mention[3 * kMaxVarintLen + pattern_len];
+    prefix_len = EncodeVarint(event->seq, mention);
+    prefix_len += EncodeVarint(pattern_len, mention + prefix_len);
+    memcpy(mention + prefix_len, event->pattern, pattern_len);
+    prefix_len += pattern_len;
+    return EncodePrefixedFrame(kFrameMention, event, mention, prefix_len, out,
+                               cap);
+  }
+
+  switch (event->type) {
+    case kEventJoin:
+      return EncodeFrame(kFrameJoin, NULL, event->name, strlen(event->name),
+                         out, cap);
+    case kEventLeave:
+      return EncodeFrame(kFrameLeave, NULL, event->name, strlen(event->name),
+                         out, cap);
+    case kEventDirect:
+      return EncodeFrame(kFrameDirect, event->name, event->body,
+                         event->body_len, out, cap);
+    case kEventHistory:
+      return EncodeFrame(kFrameHistory, event->name, event->body,
+                         event->body_len, out, cap);
+    case kEventNotice:
+      return EncodeFrame(kFrameNotice, NULL, event->body, event->body_len, out,
+                         cap);
+    case kEventMessage:
+    default:
+      return EncodeFrame(kFrameMessage, event->name, event->body,
+                         event->body_len, out, cap);
+  }
+}
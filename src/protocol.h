@@ -0,0 +1,175 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Wire protocols. Text mode is the line-oriented telnet protocol. A client
+// opts into the binary protocol by sending kProtocolMagic as its very first
+// bytes followed by a HELLO frame; a telnet user can never type the leading
+// NUL byte, so the two cannot be confused.
+//
+// Binary frames are laid out as:
+//
+//   type (1 byte) | payload length (varint) | payload
+//
+// Payloads that carry a sender or target name prefix it with its varint
+// length; the message body is the remainder of the payload.
+//
+//   HELLO    c->s: version (varint) | name     s->c: version (varint)
+//            From version 2 on, both directions carry a feature bitmask
+//            (varint) right after the version; the server answers with the
+//            subset of the requested features it enables. A client asking
+//            for kFeatureSequence follows the bitmask with the last
+//            sequence number it received (varint), or 0 if none. With
+//            kFeatureResume, the client then sends the token of the session
+//            it resumes (varint), or 0 for a new one, and the server
+//            answers with the session's token after its bitmask, or 0 if
+//            the session could not be opened.
+//   MESSAGE  c->s: body                        s->c: name | body
+//   DIRECT   c->s: target name | body          s->c: sender name | body
+//   JOIN     s->c: name
+//   LEAVE    c->s: empty, leaves for good  s->c: name
+//   HISTORY  c->s: since (varint) [| until (varint)]
+//            s->c: name | body
+//            With kFeatureSequence, MESSAGE and HISTORY frames from the
+//            server start with the message's sequence number (varint).
+//            A client asks for the logged messages of a time range, in
+//            milliseconds since the epoch, until excluded and open if left
+//            out. The server answers with at most kRangeLimit HISTORY
+//            frames, numbered 0 as logged messages are not, then a NOTICE.
+//   ACK      c->s: highest sequence number received (varint)
+//   PING     either way: opaque payload, answered by a PONG echoing it
+//   NOTICE   s->c: human readable server notice
+//   COMPRESSED  s->c: raw deflate stream, primed with kChatDictionary, that
+//            inflates to a sequence of frames. Only sent to clients that
+//            negotiated kFeatureCompression.
+//   CHUNK    c->s: flags (1 byte) | data
+//            s->c: stream id (varint) | flags (1 byte) | name | data
+//            Part of a message too large for one MESSAGE frame, sent as a
+//            stream of chunks of at most kChunkLimit bytes. A client has at
+//            most one stream open: its first CHUNK opens it and the one with
+//            kChunkFinal set ends it. The server numbers streams and relays
+//            each chunk as it arrives, unlike MESSAGE data keeping line
+//            breaks. kChunkAbort marks a stream cut short because it grew
+//            past the server's limit or its sender left. Clients without
+//            kFeatureChunks get each chunk as a MESSAGE instead.
+//   MENTION  c->s: watch (1 byte) | keyword
+//            s->c: sequence number (varint) | pattern | name | body
+//            A client watches a keyword with watch set to 1 and stops with
+//            0; the server answers with a NOTICE. The server sends a MENTION
+//            after a message whose body contains the client's name as
+//            "@NAME", or a keyword it watches, as a whole word. pattern is
+//            the one found, and the rest repeats the MESSAGE. Only sent to
+//            clients that negotiated kFeatureMentions.
+
+// Clients are pending until their protocol is known and they have a name;
+// pending clients are not sent any broadcasts. WebSocket clients use the text
+// protocol wrapped in WebSocket frames.
+typedef enum {
+  kProtocolPending,
+  kProtocolText,
+  kProtocolBinary,
+  kProtocolWebSocket,
+} protocol_t;
+
+#define kProtocolMagic "\0CRP"
+#define kProtocolMagicLen 4
+#define kProtocolVersion 2
+#define kMaxVarintLen 10
+#define kFrameHeaderLen (1 + kMaxVarintLen)
+
+typedef enum {
+  kFrameHello = 0x01,
+  kFrameMessage = 0x02,
+  kFrameDirect = 0x03,
+  kFrameJoin = 0x04,
+  kFrameLeave = 0x05,
+  kFrameHistory = 0x06,
+  kFrameAck = 0x07,
+  kFramePing = 0x08,
+  kFramePong = 0x09,
+  kFrameNotice = 0x0A,
+  kFrameCompressed = 0x0B,
+  kFrameLink = 0x0C,   // Server links only, see federation.h
+  kFrameRelay = 0x0D,  // Server links only, see federation.h
+  kFrameSubscribe = 0x0E,    // Broker only, see broker.h
+  kFrameUnsubscribe = 0x0F,  // Broker only, see broker.h
+  kFramePublish = 0x10,      // Broker only, see broker.h
+  kFrameChunk = 0x11,
+  kFrameMention = 0x12,
+} frame_type_t;
+
+enum { kChunkFinal = 1 << 0, kChunkAbort = 1 << 1 };
+
+#define kChunkLimit 4096  // Largest data in one CHUNK frame
+
+// Optional features negotiated in HELLO
+// Sequence numbers increase by one with every message in the room, so a
+// client can spot gaps, and a client reconnecting with the last sequence
+// number it saw is only replayed the history it missed. A client with a
+// resumable session (see session.h) that reconnects within the grace period
+// rejoins without the room seeing it leave and join again. In rooms large
+// enough for joins and leaves to be digested into periodic NOTICEs, clients
+// with kFeaturePresence still get every JOIN and LEAVE frame instead.
+// Clients with kFeatureChunks receive large messages as CHUNK frames.
+// Clients with kFeatureMentions are told when a message mentions them.
+enum {
+  kFeatureCompression = 1 << 0,
+  kFeatureSequence = 1 << 1,
+  kFeatureResume = 1 << 2,
+  kFeaturePresence = 1 << 3,
+  kFeatureChunks = 1 << 4,
+  kFeatureMentions = 1 << 5,
+};
+#define kSupportedFeatures                                      \
+  ((uint64_t)kFeatureCompression | (uint64_t)kFeatureSequence | \
+   (uint64_t)kFeatureResume | (uint64_t)kFeaturePresence |      \
+   (uint64_t)kFeatureChunks | (uint64_t)kFeatureMentions)
+
+typedef struct {
+  uint8_t type;
+  const uint8_t *payload;
+  size_t len;
+} frame_t;
+
+// Protocol-independent description of something to deliver to clients.
+// Encoders turn it into the bytes of a particular protocol.
+typedef enum {
+  kEventMessage,
+  kEventDirect,
+  kEventJoin,
+  kEventLeave,
+  kEventHistory,
+  kEventNotice,
+  kEventChunk,
+  kEventMention,
+} event_type_t;
+
+typedef struct {
+  event_type_t type;
+  const char *name;  // Sender, or the client joining/leaving
+  const char *body;
+  size_t body_len;
+  uint64_t seq;  // Sequence number of messages in the room, or 0
+  uint64_t stream;      // Stream a chunk belongs to
+  uint8_t chunk_flags;  // kChunkFinal and kChunkAbort
+  const char *pattern;  // Name or keyword a mention was found by
+} chat_event_t;
+
+size_t EncodeVarint(uint64_t value, uint8_t *out);
+ssize_t DecodeVarint(const uint8_t *buf, size_t len, uint64_t *value);
+ssize_t ParseFrame(const uint8_t *buf, size_t len, size_t max_payload,
+                   frame_t *frame);
+ssize_t ParseString(const uint8_t *buf, size_t len, const uint8_t **str,
+                    size_t *str_len);
+size_t EncodeFrame(uint8_t type, const char *name, const void *body,
+                   size_t body_len, uint8_t *out, size_t cap);
+size_t EncodeTextEvent(const chat_event_t *event, char *out, size_t cap);
+uint64_t EventFeature(const chat_event_t *event);
+size_t EncodeBinaryEvent(const chat_event_t *event, uint64_t features,
+                         uint8_t *out, size_t cap);
+
+#endif  // PROTOCOL_H_
@@ -0,0 +1,459 @@
+/**
+ * @file scan.c
+ *
+ * @brief Vectorized line framing and input validation.
+ *
+ * Plain ASCII text without control characters is by far the most common
+ * input, so the vector loops only test whether a block holds any byte below
+ * 0x20 (which, compared as signed, also catches every non-ASCII byte) or DEL.
+ * Blocks without such bytes are skipped; the others are handed to the scalar
+ * state machine, which finds newlines and validates UTF-8. The widest
+ * implementation the CPU supports is selected at first use.
+ *
+ * Sanitization reuses the scan as its fast path: text that scans clean is
+ * copied as is, and only the remainder after the first rejected byte goes
+ * through the byte-wise sanitizer.
+ */
+
+#include "scan.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define kScanX86 1
+#endif
+
+// UTF-8 decoding state carried across blocks
+typedef struct {
+  int need;      // Continuation bytes still expected
+  uint8_t lo;    // Lowest valid value for the next continuation byte
+  uint8_t hi;    // Highest valid value for the next continuation byte
+  size_t start;  // Offset of the current sequence's lead byte
+  size_t len;    // Number of bytes being scanned
+} utf8_state_t;
+
+typedef void (*scan_fn)(const uint8_t *buf, size_t len, scan_result_t *result);
+
+static void Reject(scan_result_t *result, size_t offset) {
+  if (offset < result->invalid_at) {
+    result->invalid_at = offset;
+  }
+}
+
+/**
+ * @brief Runs the scalar state machine over buf[begin, end).
+ *
+ * @return Returns true if a newline was found, in which case result is
+ *         complete.
+ */
+static bool ScanBytes(const uint8_t *buf, size_t begin, size_t end,
+                      utf8_state_t *state, scan_result_t *result) {
+  for (size_t i = begin; i < end; i++) {
+    uint8_t byte = buf[i];
+
+    if (state->need > 0) {
+      if (byte >= state->lo && byte <= state->hi) {
+        state->need--;
+        state->lo = 0x80;
+        state->hi = 0xBF;
+        continue;
+      }
+      // Truncated sequence; the byte starts something new
+      Reject(result, state->start);
+      state->need = 0;
+    }
+
+    state->start = i;
+    if (byte < 0x80) {
+      if (byte == '\n') {
+        result->len = i;
+        result->found = true;
+        return true;
+      }
+      if ((byte < 0x20 && byte != '\t' && byte != '\r') || byte == 0x7F) {
+        Reject(result, i);
+      } else if (byte == '\r' && (i + 1 >= state->len || buf[i + 1] != '\n')) {
+        // A bare carriage return could overwrite what the terminal shows
+        Reject(result, i);
+      }
+    } else if (byte == 0xC2) {
+      // Accept U+00A0 and up, rejecting the C1 controls
+      state->need = 1;
+      state->lo = 0xA0;
+      state->hi = 0xBF;
+    } else if (byte > 0xC2 && byte <= 0xDF) {
+      state->need = 1;
+    } else if (byte >= 0xE0 && byte <= 0xEF) {
+      state->need = 2;
+      state->lo = byte == 0xE0 ? 0xA0 : 0x80;  // Overlong forms
+      state->hi = byte == 0xED ? 0x9F : 0xBF;  // Surrogates
+    } else if (byte >= 0xF0 && byte <= 0xF4) {
+      state->need = 3;
+      state->lo = byte == 0xF0 ? 0x90 : 0x80;  // Overlong forms
+      state->hi = byte == 0xF4 ? 0x8F : 0xBF;  // Above U+10FFFF
+    } else {
+      Reject(result, i);
+    }
+  }
+
+  return false;
+}
+
+static void BeginScan(size_t len, utf8_state_t *state, scan_result_t *result) {
+  state->need = 0;
+  state->lo = 0x80;
+  state->hi = 0xBF;
+  state->start = 0;
+  state->len = len;
+  result->len = len;
+  result->found = false;
+  result->invalid_at = SIZE_MAX;
+}
+
+static void EndScan(size_t len, utf8_state_t *state, scan_result_t *result) {
+  if (state->need > 0) {
+    Reject(result, state->start);
+  }
+  result->len = len;
+}
+
+static void ScanScalar(const uint8_t *buf, size_t len, scan_result_t *result) {
+  utf8_state_t state;
+
+  BeginScan(len, &state, result);
+  if (!ScanBytes(buf, 0, len, &state, result)) {
+    EndScan(len, &state, result);
+  }
+}
+
+#ifdef kScanX86
+static void ScanSse2(const uint8_t *buf, size_t len, scan_result_t *result) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7F);
+  utf8_state_t state;
+  size_t i = 0;
+
+  BeginScan(len, &state, result);
+  for (; i + 16 <= len; i += 16) {
+    size_t begin = i;
+
+    if (state.need == 0) {
+      __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+      __m128i special = _mm_or_si128(_mm_cmplt_epi8(block, space),
+                                     _mm_cmpeq_epi8(block, del));
+      unsigned int mask = (unsigned int)_mm_movemask_epi8(special);
+      if (!mask) {
+        continue;
+      }
+      begin += (size_t)__builtin_ctz(mask);
+    }
+
+    if (ScanBytes(buf, begin, i + 16, &state, result)) {
+      return;
+    }
+  }
+
+  if (!ScanBytes(buf, i, len, &state, result)) {
+    EndScan(len, &state, result);
+  }
+}
+
+__attribute__((target("avx2"))) static void ScanAvx2(const uint8_t *buf,
+                                                     size_t len,
+                                                     scan_result_t *result) {
+  const __m256i space = _mm256_set1_epi8(0x20);
+  const __m256i del = _mm256_set1_epi8(0x7F);
+  utf8_state_t state;
+  size_t i = 0;
+
+  BeginScan(len, &state, result);
+  for (; i + 32 <= len; i += 32) {
+    size_t begin = i;
+
+    if (state.need == 0) {
+      __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+      __m256i special = _mm256_or_si256(_mm256_cmpgt_epi8(space, block),
+                                        _mm256_cmpeq_epi8(block, del));
+      unsigned int mask = (unsigned int)_mm256_movemask_epi8(special);
+      if (!mask) {
+        continue;
+      }
+      begin += (size_t)__builtin_ctz(mask);
+    }
+
+    if (ScanBytes(buf, begin, i + 32, &state, result)) {
+      return;
+    }
+  }
+
+  if (!ScanBytes(buf, i, len, &state, result)) {
+    EndScan(len, &state, result);
+  }
+}
+#endif
+
+static scan_fn scan_impl = &ScanScalar;
+static const char *scan_impl_name = "scalar";
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void SelectScanImplementation(void) {
+#ifdef kScanX86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan_impl = &ScanAvx2;
+    scan_impl_name = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    scan_impl = &ScanSse2;
+    scan_impl_name = "sse2";
+  }
+#endif
+}
+
+/**
+ * @brief Finds the first line in buf and validates the bytes before it.
+ *
+ * A multi-byte sequence cut off by the end of buf is reported as invalid, so
+ * callers that wait for more input should scan again once it arrives.
+ *
+ * @param buf     Bytes to scan.
+ * @param len     Number of bytes in buf.
+ * @param result  Where the line length and validation result are stored.
+ */
+void ScanLine(const uint8_t *buf, size_t len, scan_result_t *result) {
+  pthread_once(&scan_once, &SelectScanImplementation);
+  scan_impl(buf, len, result);
+}
+
+/**
+ * @brief Returns the name of the implementation ScanLine() dispatches to.
+ */
+const char *ScanImplementation(void) {
+  pthread_once(&scan_once, &SelectScanImplementation);
+  return scan_impl_name;
+}
+
+#define kEscape 0x1B
+#define kBell 0x07
+#define kC1Csi 0x9B
+#define kC1Osc 0x9D
+
+static const char kReplacementChar[] = "\xEF\xBF\xBD";  // U+FFFD
+
+/**
+ * @brief Decodes one UTF-8 sequence.
+ *
+ * @param in   Bytes to decode.
+ * @param len  Number of bytes available in in.
+ * @param cp   Where the decoded code point is stored.
+ *
+ * @return Returns the sequence length, or 0 if it is invalid or truncated.
+ */
+static size_t DecodeUtf8(const uint8_t *in, size_t len, uint32_t *cp) {
+  uint8_t lead = in[0];
+  size_t need;
+  uint8_t lo = 0x80, hi = 0xBF;
+
+  if (lead < 0x80) {
+    *cp = lead;
+    return 1;
+  } else if (lead >= 0xC2 && lead <= 0xDF) {
+    need = 1;
+    *cp = lead & 0x1F;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    need = 2;
+    lo = lead == 0xE0 ? 0xA0 : 0x80;
+    hi = lead == 0xED ? 0x9F : 0xBF;
+    *cp = lead & 0x0F;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    need = 3;
+    lo = lead == 0xF0 ? 0x90 : 0x80;
+    hi = lead == 0xF4 ? 0x8F : 0xBF;
+    *cp = lead & 0x07;
+  } else {
+    return 0;
+  }
+
+  if (len < need + 1) {
+    return 0;
+  }
+  for (size_t i = 1; i <= need; i++) {
+    if (in[i] < lo || in[i] > hi) {
+      return 0;
+    }
+    lo = 0x80;
+    hi = 0xBF;
+    *cp = (*cp << 6) | (in[i] & 0x3F);
+  }
+
+  return need + 1;
+}
+
+/**
+ * @brief Returns the length of the terminal control sequence starting at in.
+ *
+ * Handles CSI sequences (ESC [ or U+009B), string sequences such as OSC and
+ * DCS terminated by BEL or ESC \, and two byte ESC sequences. Unterminated
+ * sequences extend to the end of the input.
+ */
+static size_t SkipControlSequence(const uint8_t *in, size_t len) {
+  size_t i;
+  bool csi = false;
+  bool string = false;
+
+  if (in[0] == kEscape) {
+    if (len < 2) {
+      return 1;
+    }
+    csi = in[1] == '[';
+    string = in[1] == ']' || in[1] == 'P' || in[1] == 'X' || in[1] == '^' ||
+             in[1] == '_';
+    i = 2;
+    if (!csi && !string) {
+      return in[1] >= 0x20 && in[1] < 0x7F ? 2 : 1;
+    }
+  } else {
+    // Two byte encodings of U+009B and U+009D
+    csi = in[1] == kC1Csi;
+    string = in[1] == kC1Osc;
+    i = 2;
+  }
+
+  if (csi) {
+    // Parameter and intermediate bytes, then one final byte
+    while (i < len && in[i] >= 0x20 && in[i] <= 0x3F) {
+      i++;
+    }
+    return i < len && in[i] >= 0x40 && in[i] <= 0x7E ? i + 1 : i;
+  }
+
+  for (; i < len; i++) {
+    if (in[i] == kBell) {
+      return i + 1;
+    }
+    if (in[i] == kEscape && i + 1 < len && in[i + 1] == '\\') {
+      return i + 2;
+    }
+  }
+  return len;
+}
+
+/**
+ * @brief Copies text, dropping what could corrupt a recipient's terminal.
+ *
+ * @param in     Text to sanitize.
+ * @param len    Number of bytes in in.
+ * @param out    Destination buffer. The result is NUL-terminated.
+ * @param cap    Size of out, including the terminator.
+ * @param lines  Whether to keep '\n' line breaks rather than make them
+ *               spaces. '\r' becomes a space either way.
+ *
+ * @return Returns the length of the sanitized text.
+ */
+static size_t Sanitize(const uint8_t *in, size_t len, char *out, size_t cap,
+                       bool lines) {
+  scan_result_t scan;
+  size_t limit = cap - 1;
+  size_t i;
+  size_t n;
+
+  ScanLine(in, len, &scan);
+
+  // Everything before the first newline or rejected byte is clean
+  i = scan.invalid_at < scan.len ? scan.invalid_at : scan.len;
+  if (i > limit) {
+    // Back off to the start of the character crossing the limit
+    i = limit;
+    while (i > 0 && (in[i] & 0xC0) == 0x80) {
+      i--;
+    }
+  }
+  memcpy(out, in, i);
+  n = i;
+
+  while (i < len) {
+    uint8_t byte = in[i];
+    uint32_t cp;
+    size_t seq_len;
+
+    if (byte == kEscape ||
+        (byte == 0xC2 && i + 1 < len &&
+         (in[i + 1] == kC1Csi || in[i + 1] == kC1Osc))) {
+      i += SkipControlSequence(in + i, len - i);
+      continue;
+    }
+
+    if (byte == '\n' || byte == '\r') {
+      if (n + 1 > limit) {
+        break;
+      }
+      out[n++] = lines && byte == '\n' ? '\n' : ' ';
+      i++;
+      continue;
+    }
+
+    seq_len = DecodeUtf8(in + i, len - i, &cp);
+    if (seq_len == 0) {
+      if (n + sizeof(kReplacementChar) - 1 > limit) {
+        break;
+      }
+      memcpy(out + n, kReplacementChar, sizeof(kReplacementChar) - 1);
+      n += sizeof(kReplacementChar) - 1;
+      i++;
+      continue;
+    }
+
+    if ((cp < 0x20 && cp != '\t') || (cp >= 0x7F && cp <= 0x9F)) {
+      i += seq_len;
+      continue;
+    }
+
+    if (n + seq_len > limit) {
+      break;
+    }
+    memcpy(out + n, in + i, seq_len);
+    n += seq_len;
+    i += seq_len;
+  }
+
+  out[n] = '\0';
+  return n;
+}
+
+/**
+ * @brief Copies text, dropping what could corrupt a recipient's terminal.
+ *
+ * Terminal escape sequences and control characters other than tabs are
+ * removed, line breaks become spaces so a message cannot fake further lines,
+ * and invalid UTF-8 is replaced with U+FFFD. Text that is already clean is
+ * copied with a single memcpy(). The output is truncated on a character
+ * boundary if it does not fit.
+ *
+ * @param in   Text to sanitize.
+ * @param len  Number of bytes in in.
+ * @param out  Destination buffer. The result is NUL-terminated.
+ * @param cap  Size of out, including the terminator.
+ *
+ * @return Returns the length of the sanitized text.
+ */
+size_t SanitizeText(const uint8_t *in, size_t len, char *out, size_t cap) {
+  return Sanitize(in, len, out, cap, false);
+}
+
+/**
+ * @brief Copies multi-line text, dropping what could corrupt a terminal.
+ *
+ * Like SanitizeText(), but '\n' line breaks are kept, for pasted text whose
+ * recipients take care of displaying them.
+ *
+ * @param in   Text to sanitize.
+ * @param len  Number of bytes in in.
+ * @param out  Destination buffer. The result is NUL-terminated.
+ * @param cap  Size of out, including the terminator.
+ *
+ * @return Returns the length of the sanitized text.
+ */
+size_t SanitizeBlock(const uint8_t *in, size_t len, char *out, size_t cap) {
+  return Sanitize(in, len, out, cap, true);
+}
@@ -0,0 +1,24 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Single pass scanner for received text. It finds the end of the first line
+// and, for the bytes before it, the first control character or invalid UTF-8
+// sequence. Tabs and the carriage return of a "\r\n" are allowed; every other
+// C0 control, DEL and C1 control (U+0080 to U+009F) is flagged.
+
+typedef struct {
+  size_t len;         // Offset of the first '\n', or the buffer length
+  bool found;         // Whether a '\n' was found
+  size_t invalid_at;  // Offset of the first rejected byte, or SIZE_MAX
+} scan_result_t;
+
+void ScanLine(const uint8_t *buf, size_t len, scan_result_t *result);
+const char *ScanImplementation(void);
+size_t SanitizeText(const uint8_t *in, size_t len, char *out, size_t cap);
+size_t SanitizeBlock(const uint8_t *in, size_t len, char *out, size_t cap);
+
+#endif  // SCAN_H_
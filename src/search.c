@@ -0,0 +1,612 @@
+/**
+ * @file search.c
+ *
+ * @brief Inverted index over the message log, built and merged in the
+ *        background.
+ */
+
+#include "search.h"
+
+#include <ctype.h>
+#include <time.h>
+
+#include "chatroom.h"
+#include "msglog.h"
+
+// Slots of the term table of a segment being built. A segment takes no new
+// messages once half of them are used, leaving room for one more message.
+#define kBuildSlots (1 << 15)
+#define kBuildInitialCap 16
+
+// Posting list being built for one term
+typedef struct {
+  char term[kTermLimit + 1];
+  uint8_t *postings;
+  size_t len;
+  size_t cap;
+  uint32_t count;
+  uint64_t last;  // Newest record in the list
+} build_term_t;
+
+typedef struct {
+  uint32_t term;      // Offset of the NUL-terminated term in terms
+  uint32_t postings;  // Offset of the list in postings
+  uint32_t len;       // Length of the list in bytes
+  uint32_t count;     // Records in the list
+  uint64_t last;      // Newest record in the list
+} index_term_t;
+
+// Immutable once published
+typedef struct {
+  size_t ndocs;
+  size_t nterms;
+  index_term_t *dir;  // Sorted by term
+  char *terms;
+  uint8_t *postings;
+} index_segment_t;
+
+static struct {
+  index_segment_t *segments[kMaxSegments];  // Oldest first
+  size_t nsegments;
+  bool running;
+  // Queries hold it shared while they read segments; the indexer holds it
+  // exclusively only to swap segments in and out
+  pthread_rwlock_t lock;
+} search_index = {.nsegments = 0,
+                  .running = false,
+                  .lock = PTHREAD_RWLOCK_INITIALIZER};
+
+static bool IsTermByte(unsigned char c) {
+  return isalnum(c) || c >= 0x80;
+}
+
+/**
+ * @brief Cuts the next term out of a text.
+ *
+ * @param text  Where to start; advanced past the term.
+ * @param end   End of the text.
+ * @param term  Where the NUL-terminated, lowercased term is stored. Must
+ *              hold kTermLimit + 1 bytes.
+ *
+ * @return Returns the term's length, or 0 if there are no more terms.
+ */
+static size_t NextTerm(const char **text, const char *end, char *term) {
+  const char *p = *text;
+
+  while (p < end) {
+    while (p < end && !IsTermByte((unsigned char)*p)) {
+      p++;
+    }
+
+    size_t len = 0;
+    while (p < end && IsTermByte((unsigned char)*p)) {
+      if (len < kTermLimit) {
+        term[len++] = (char)tolower((unsigned char)*p);
+      }
+      p++;
+    }
+    // Single letters and digits are too common to be worth indexing
+    if (len >= 2) {
+      term[len] = '\0';
+      *text = p;
+      return len;
+    }
+  }
+
+  *text = p;
+  return 0;
+}
+
+/**
+ * @brief FNV-1a hash of a term, for the build table.
+ */
+static uint32_t HashTerm(const char *term) {
+  uint32_t hash = 2166136261u;
+  while (*term) {
+    hash = (hash ^ (uint8_t)*term++) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief Adds a record to a term's posting list being built.
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+static int AddPosting(build_term_t *entry, uint64_t doc) {
+  if (entry->count > 0 && entry->last == doc) {
+    return 0;
+  }
+  if (entry->len + kMaxVarintLen > entry->cap) {
+    size_t cap = entry->cap ? 2 * entry->cap : kBuildInitialCap;
+    uint8_t *postings = realloc(entry->postings, cap);
+    if (!postings) {
+      return -1;
+    }
+    entry->postings = postings;
+    entry->cap = cap;
+  }
+  // The first entry is the offset itself, the others the gap to the one
+  // before
+  uint64_t gap = entry->count > 0 ? doc - entry->last : doc;
+  entry->len += EncodeVarint(gap, entry->postings + entry->len);
+  entry->last = doc;
+  entry->count++;
+  return 0;
+}
+
+static int CompareBuildTerms(const void *a, const void *b) {
+  return strcmp((*(build_term_t *const *)a)->term,
+                (*(build_term_t *const *)b)->term);
+}
+
+static void FreeSegment(index_segment_t *segment) {
+  if (segment) {
+    free(segment->dir);
+    free(segment->terms);
+    free(segment->postings);
+    free(segment);
+  }
+}
+
+/**
+ * @brief Allocates a segment for the given number of terms and bytes.
+ */
+static index_segment_t *AllocSegment(size_t nterms, size_t terms_len,
+                                     size_t postings_len) {
+  index_segment_t *segment = calloc(1, sizeof(index_segment_t));
+  if (!segment) {
+    return NULL;
+  }
+  segment->dir = malloc((nterms > 0 ? nterms : 1) * sizeof(index_term_t));
+  segment->terms = malloc(terms_len > 0 ? terms_len : 1);
+  segment->postings = malloc(postings_len > 0 ? postings_len : 1);
+  if (!segment->dir || !segment->terms || !segment->postings) {
+    FreeSegment(segment);
+    return NULL;
+  }
+  return segment;
+}
+
+/**
+ * @brief Indexes log records from an offset into a new segment.
+ *
+ * Stops after kSegmentDocs records, at the end of the log, or when the
+ * segment's term table is half full.
+ *
+ * @param from  Offset of the first record; advanced past the last one
+ *              indexed.
+ *
+ * @return Returns the segment, or NULL on error or if there was nothing to
+ *         index.
+ */
+static index_segment_t *BuildSegment(uint64_t *from) {
+  char buf[256 + kMessageCharLimit];
+  char term[kTermLimit + 1];
+  log_record_t record;
+  size_t nterms = 0;
+  size_t ndocs = 0;
+  index_segment_t *segment = NULL;
+
+  build_term_t *table = calloc(kBuildSlots, sizeof(build_term_t));
+  if (!table) {
+    return NULL;
+  }
+
+  uint64_t offset = *from;
+  while (ndocs < kSegmentDocs && nterms < kBuildSlots / 2 &&
+         ReadMessageLog(offset, &record, buf, sizeof(buf)) == 0) {
+    const char *text = record.body;
+    const char *end = record.body + record.body_len;
+    while (NextTerm(&text, end, term) > 0) {
+      uint32_t slot = HashTerm(term) & (kBuildSlots - 1);
+      while (table[slot].postings && strcmp(table[slot].term, term) != 0) {
+        slot = (slot + 1) & (kBuildSlots - 1);
+      }
+      if (!table[slot].postings) {
+        strcpy(table[slot].term, term);
+        nterms++;
+      }
+      if (AddPosting(&table[slot], offset) < 0) {
+        goto free_table;
+      }
+    }
+    offset = record.next;
+    ndocs++;
+  }
+  if (ndocs == 0) {
+    goto free_table;
+  }
+
+  build_term_t **sorted =
+      malloc((nterms > 0 ? nterms : 1) * sizeof(build_term_t *));
+  if (!sorted) {
+    goto free_table;
+  }
+  size_t terms_len = 0;
+  size_t postings_len = 0;
+  for (size_t slot = 0, i = 0; slot < kBuildSlots; slot++) {
+    if (table[slot].postings) {
+      sorted[i++] = &table[slot];
+      terms_len += strlen(table[slot].term) + 1;
+      postings_len += table[slot].len;
+    }
+  }
+  qsort(sorted, nterms, sizeof(*sorted), &CompareBuildTerms);
+
+  segment = AllocSegment(nterms, terms_len, postings_len);
+  if (segment) {
+    segment->ndocs = ndocs;
+    segment->nterms = nterms;
+    terms_len = 0;
+    postings_len = 0;
+    for (size_t i = 0; i < nterms; i++) {
+      size_t term_len = strlen(sorted[i]->term) + 1;
+      segment->dir[i] = (index_term_t){.term = (uint32_t)terms_len,
+                                       .postings = (uint32_t)postings_len,
+                                       .len = (uint32_t)sorted[i]->len,
+                                       .count = sorted[i]->count,
+                                       .last = sorted[i]->last};
+      memcpy(segment->terms + terms_len, sorted[i]->term, term_len);
+      memcpy(segment->postings + postings_len, sorted[i]->postings,
+             sorted[i]->len);
+      terms_len += term_len;
+      postings_len += sorted[i]->len;
+    }
+    *from = offset;
+  }
+  free(sorted);
+
+free_table:
+  for (size_t slot = 0; slot < kBuildSlots; slot++) {
+    free(table[slot].postings);
+  }
+  free(table);
+  return segment;
+}
+
+/**
+ * @brief Merges two adjacent segments into one.
+ *
+ * Posting lists of a term in both are concatenated, re-encoding only the
+ * first entry of the newer list as a gap from the last of the older one.
+ *
+ * @param older  Segment with the older records.
+ * @param newer  Segment with the newer records.
+ *
+ * @return Returns the merged segment, or NULL if allocation failed.
+ */
+static index_segment_t *MergeSegments(const index_segment_t *older,
+                                      const index_segment_t *newer) {
+  size_t terms_len = 0;
+  size_t postings_len = 0;
+
+  for (size_t i = 0; i < older->nterms; i++) {
+    terms_len += strlen(older->terms + older->dir[i].term) + 1;
+    postings_len += older->dir[i].len;
+  }
+  for (size_t i = 0; i < newer->nterms; i++) {
+    terms_len += strlen(newer->terms + newer->dir[i].term) + 1;
+    postings_len += newer->dir[i].len;
+  }
+
+  index_segment_t *merged =
+      AllocSegment(older->nterms + newer->nterms, terms_len, postings_len);
+  if (!merged) {
+    return NULL;
+  }
+  merged->ndocs = older->ndocs + newer->ndocs;
+
+  size_t i = 0;
+  size_t j = 0;
+  terms_len = 0;
+  postings_len = 0;
+  while (i < older->nterms || j < newer->nterms) {
+    const index_term_t *a = i < older->nterms ? &older->dir[i] : NULL;
+    const index_term_t *b = j < newer->nterms ? &newer->dir[j] : NULL;
+    int order = !a   ? 1
+                : !b ? -1
+                     : strcmp(older->terms + a->term, newer->terms + b->term);
+    const char *term = order <= 0 ? older->terms + a->term
+                                  : newer->terms + b->term;
+    index_term_t *out = &merged->dir[merged->nterms++];
+    size_t term_len = strlen(term) + 1;
+
+    memcpy(merged->terms + terms_len, term, term_len);
+    out->term = (uint32_t)terms_len;
+    out->postings = (uint32_t)postings_len;
+    out->len = 0;
+    out->count = 0;
+    terms_len += term_len;
+
+    uint8_t *dst = merged->postings + postings_len;
+    if (order <= 0) {
+      memcpy(dst, older->postings + a->postings, a->len);
+      out->len = a->len;
+      out->count = a->count;
+      out->last = a->last;
+      i++;
+    }
+    if (order >= 0) {
+      const uint8_t *src = newer->postings + b->postings;
+      size_t len = b->len;
+      if (out->count > 0) {
+        uint64_t first;
+        ssize_t consumed = DecodeVarint(src, len, &first);
+        if (consumed <= 0) {
+          FreeSegment(merged);
+          return NULL;
+        }
+        // Re-encoding a smaller gap never takes more bytes
+        out->len += EncodeVarint(first - out->last, dst + out->len);
+        src += consumed;
+        len -= (size_t)consumed;
+      }
+      memcpy(dst + out->len, src, len);
+      out->len += len;
+      out->count += b->count;
+      out->last = b->last;
+      j++;
+    }
+    postings_len += out->len;
+  }
+
+  return merged;
+}
+
+/**
+ * @brief Publishes a new segment, then merges segments until each one
+ *        holds more than twice as many messages as the next.
+ *
+ * Only the indexer changes the segment list, so it reads the list without
+ * the lock and builds merged segments while queries go on.
+ */
+static void PublishSegment(index_segment_t *segment) {
+  pthread_rwlock_wrlock(&search_index.lock);
+  if (search_index.nsegments == kMaxSegments) {
+    // Cannot happen with the merge policy short of allocation failures
+    pthread_rwlock_unlock(&search_index.lock);
+    PrintError("Too many index segments; dropping %zu messages\n",
+               segment->ndocs);
+    FreeSegment(segment);
+    return;
+  }
+  search_index.segments[search_index.nsegments++] = segment;
+  pthread_rwlock_unlock(&search_index.lock);
+
+  while (search_index.nsegments >= 2) {
+    size_t n = search_index.nsegments;
+    index_segment_t *older = search_index.segments[n - 2];
+    index_segment_t *newer = search_index.segments[n - 1];
+    if (older->ndocs > 2 * newer->ndocs) {
+      break;
+    }
+
+    index_segment_t *merged = MergeSegments(older, newer);
+    if (!merged) {
+      PrintError("Failed to merge index segments\n");
+      break;
+    }
+    pthread_rwlock_wrlock(&search_index.lock);
+    search_index.segments[n - 2] = merged;
+    search_index.nsegments--;
+    pthread_rwlock_unlock(&search_index.lock);
+    FreeSegment(older);
+    FreeSegment(newer);
+  }
+}
+
+/**
+ * @brief Indexes the message log as it grows.
+ *
+ * A segment that fails to build, for instance for lack of memory, is tried
+ * again from the same offset after the next interval. The failure is logged
+ * once, and so is the recovery.
+ *
+ * @param arg  Unused.
+ *
+ * @return Never returns.
+ */
+static void *RunIndexer(void *arg) {
+  const struct timespec interval = {
+      .tv_sec = kIndexIntervalMs / 1000,
+      .tv_nsec = (kIndexIntervalMs % 1000) * 1000000L};
+  uint64_t indexed = 0;
+  bool failing = false;
+  (void)arg;
+
+  while (1) {
+    while (indexed < MessageLogSize()) {
+      index_segment_t *segment = BuildSegment(&indexed);
+      if (!segment) {
+        if (!failing) {
+          PrintError("Failed to index message log at offset %" PRIu64
+                     ". Retrying...\n",
+                     indexed);
+          failing = true;
+        }
+        break;
+      }
+      if (failing) {
+        printf("Resumed indexing the message log\n");
+        failing = false;
+      }
+      PublishSegment(segment);
+    }
+    nanosleep(&interval, NULL);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Starts indexing the message log in the background.
+ *
+ * @return Returns 0 on success, or -1 if the thread could not be created.
+ */
+int StartIndexer(void) {
+  pthread_t tid;
+
+  if (pthread_create(&tid, NULL, &RunIndexer, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(tid);
+  search_index.running = true;
+  return 0;
+}
+
+/**
+ * @brief Looks a term up in a segment's dictionary.
+ */
+static const index_term_t *FindTerm(const index_segment_t *segment,
+                                    const char *term) {
+  size_t lo = 0;
+  size_t hi = segment->nterms;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int order = strcmp(segment->terms + segment->dir[mid].term, term);
+    if (order == 0) {
+      return &segment->dir[mid];
+    }
+    if (order < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Decodes a posting list.
+ *
+ * @return Returns the number of records decoded into docs.
+ */
+static size_t DecodePostings(const index_segment_t *segment,
+                             const index_term_t *entry, uint64_t *docs) {
+  const uint8_t *p = segment->postings + entry->postings;
+  size_t left = entry->len;
+  uint64_t doc = 0;
+  size_t count = 0;
+
+  while (count < entry->count && left > 0) {
+    uint64_t gap;
+    ssize_t consumed = DecodeVarint(p, left, &gap);
+    if (consumed <= 0) {
+      break;
+    }
+    doc = count > 0 ? doc + gap : gap;
+    docs[count++] = doc;
+    p += consumed;
+    left -= (size_t)consumed;
+  }
+  return count;
+}
+
+/**
+ * @brief Finds the newest messages containing every term of a query.
+ *
+ * @param query      Words to look for.
+ * @param hits       Where the log offsets of matching messages are stored,
+ *                   newest first.
+ * @param cap        Most hits to return.
+ * @param truncated  Set if the search stopped at kSearchBudget before
+ *                   looking at every message.
+ *
+ * @return Returns the number of hits, or -1 with errno set to ENOTSUP if
+ *         there is no index, EINVAL if the query has no terms, or ENOMEM.
+ */
+ssize_t SearchMessages(const char *query, uint64_t *hits, size_t cap,
+                       bool *truncated) {
+  char terms[kSearchTerms][kTermLimit + 1];
+  size_t nterms = 0;
+  const char *text = query;
+  const char *end = query + strlen(query);
+
+  *truncated = false;
+  if (!search_index.running) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  while (nterms < kSearchTerms && NextTerm(&text, end, terms[nterms]) > 0) {
+    nterms++;
+  }
+  if (nterms == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  size_t nhits = 0;
+  size_t budget = kSearchBudget;
+  uint64_t *lists[kSearchTerms] = {NULL};
+  int status = 0;
+
+  pthread_rwlock_rdlock(&search_index.lock);
+  for (size_t s = search_index.nsegments; s-- > 0 && nhits < cap;) {
+    const index_segment_t *segment = search_index.segments[s];
+    const index_term_t *entries[kSearchTerms];
+    size_t counts[kSearchTerms];
+    size_t postings = 0;
+
+    bool all = true;
+    for (size_t t = 0; t < nterms && all; t++) {
+      entries[t] = FindTerm(segment, terms[t]);
+      all = entries[t] != NULL;
+      postings += all ? entries[t]->count : 0;
+    }
+    if (!all) {
+      continue;
+    }
+    if (postings > budget) {
+      *truncated = true;
+      break;
+    }
+    budget -= postings;
+
+    for (size_t t = 0; t < nterms; t++) {
+      lists[t] = malloc(entries[t]->count * sizeof(uint64_t));
+      if (!lists[t]) {
+        status = -1;
+        goto free_lists;
+      }
+      counts[t] = DecodePostings(segment, entries[t], lists[t]);
+    }
+
+    // Walk the first list newest first, checking the others from their
+    // ends, which only ever move back
+    size_t pos[kSearchTerms];
+    for (size_t t = 0; t < nterms; t++) {
+      pos[t] = counts[t];
+    }
+    while (pos[0] > 0 && nhits < cap) {
+      uint64_t doc = lists[0][--pos[0]];
+      bool match = true;
+      for (size_t t = 1; t < nterms && match; t++) {
+        while (pos[t] > 0 && lists[t][pos[t] - 1] > doc) {
+          pos[t]--;
+        }
+        match = pos[t] > 0 && lists[t][pos[t] - 1] == doc;
+      }
+      if (match) {
+        hits[nhits++] = doc;
+      }
+    }
+
+  free_lists:
+    for (size_t t = 0; t < nterms; t++) {
+      free(lists[t]);
+      lists[t] = NULL;
+    }
+    if (status < 0) {
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&search_index.lock);
+
+  if (status < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return (ssize_t)nhits;
+}
@@ -0,0 +1,37 @@
+#ifndef SEARCH_H_
+#define SEARCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Full-text search over the message log (see msglog.h). A background thread
+// tails the log every kIndexIntervalMs and indexes what was appended into a
+// new immutable segment: a sorted dictionary of terms, each with a posting
+// list of the offsets of the records containing it, delta- and
+// varint-encoded. Once a segment holds at least half as many messages as the
+// one before it, the two are merged, so there are only logarithmically many
+// segments. Clients never index anything themselves.
+//
+// Terms are runs of ASCII letters and digits, lowercased, and of non-ASCII
+// bytes, so words in other scripts are found too. Queries match messages
+// containing all of their terms, newest first. They search the published
+// segments without waiting for the indexer and stop after kSearchResults
+// hits or kSearchBudget decoded postings, so their latency is bounded
+// however large the log grows. The index lives in memory and is rebuilt from
+// the log on startup.
+
+#define kIndexIntervalMs 200
+#define kSegmentDocs 4096  // Most messages indexed into one new segment
+#define kMaxSegments 64
+#define kTermLimit 32  // Longer terms are cut
+#define kSearchTerms 8
+#define kSearchResults 10
+#define kSearchBudget (1 << 20)  // Postings one query may decode
+
+int StartIndexer(void);
+ssize_t SearchMessages(const char *query, uint64_t *hits, size_t cap,
+                       bool *truncated);
+
+#endif  // SEARCH_H_
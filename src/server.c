@@ -9,10 +9,40 @@
 
 #include "chatroom.h"
 
-client_pool_t pool = {.clients = {NULL},
-                      .len = 0, 
+client_pool_t pool = {.slots = {{NULL, 0}},
+                      .members = NULL,
+                      .len = 0,
                       .mutex = PTHREAD_MUTEX_INITIALIZER};
 
+history_t history = {.nblocks = 0,
+                     .nopen = 0,
+                     .seq = 0,
+                     .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// Held while a message is numbered and broadcast, so that every client
+// receives sequence numbers in increasing order, and while a joining client
+// captures the history, so that each message reaches it exactly once.
+static pthread_mutex_t room_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Joins and leaves in large rooms that have not been sent in a digest yet
+static struct {
+  size_t room_size;  // Rooms with more local clients than this get digests
+  size_t joined;
+  size_t left;
+  pthread_mutex_t mutex;
+} digest = {.joined = 0, .left = 0, .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// Largest stream a client may send, in bytes, and the id of the next one
+static size_t stream_limit;
+static atomic_uint_fast64_t next_stream = 1;
+
+// Clients an event is delivered to
+typedef enum {
+  kAudienceAll,
+  kAudiencePresence,  // Only clients subscribed to presence
+  kAudienceDigest,    // Only clients that get presence digests
+} audience_t;
+
 /**
  * @brief Entry point for the server program.
  *
@@ -20,33 +50,155 @@ client_pool_t pool = {.clients = {NULL},
  * connections, and spawns threads for handling client communications. The
  * server listens indefinitely until terminated manually. It handles incoming
  * connections and manages a client pool, including thread creation for
- * each client.
+ * each client. When a WebSocket port is given, browser clients are accepted
+ * on it as well and join the same chat. Servers linked with -l and -L relay
+ * the chat to each other's clients. Joins and leaves in rooms larger than
+ * the -d size are digested, and messages streamed in chunks may grow up to
+ * the -m size. With -f, files are uploaded to and downloaded from the
+ * attachment store on a port of their own. With -p, messages are kept in a
+ * log on disk and indexed for searching.
  *
  * @param argc Number of command line arguments.
  * @param argv Array of command line argument strings. Can optionally include
- *             the port number as the first argument.
+ *             the port number as the first operand and options described in
+ *             PrintUsage().
  *
  * @return Returns EXIT_SUCCESS on orderly shutdown, or EXIT_FAILURE on error
  *         or invalid input parameters.
  */
 int main(int argc, char *argv[]) {
   int sockfd;
+  int wsfd = -1;
+  int linkfd = -1;
+  int filefd = -1;
   in_port_t port;
+  in_port_t ws_port = 0;
+  in_port_t link_port = 0;
+  in_port_t file_port = 0;
   struct sockaddr_in servaddr;
+  struct sockaddr_in wsaddr;
+  struct sockaddr_in linkaddr;
+  struct sockaddr_in fileaddr;
+  const char *peers[kMaxLinks];
+  size_t npeers = 0;
+  const char *plugin_paths[kMaxPlugins];
+  size_t nplugins = 0;
+  const char *broker_path = NULL;
+  const char *backplane_path = NULL;
+  const char *ring_path = NULL;
+  const char *attachment_dir = kDefaultAttachmentDir;
+  const char *log_path = NULL;
+  const char *banned_path = NULL;
+  size_t filter_rate = kDefaultFilterRate;
+  int ringfd = -1;
   pthread_t tid;
+  int opt;
+
+  size_t stream_limit_mb = kDefaultStreamLimitMb;
+  digest.room_size = kDigestRoomSize;
+  while ((opt = getopt(argc, argv, "w:l:L:b:B:s:d:m:f:a:p:F:R:M:P:")) != -1) {
+    switch (opt) {
+      case 'w':
+        if (ParsePort(optarg, &ws_port) < 0) {
+          PrintError("Invalid port number: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'l':
+        if (ParsePort(optarg, &link_port) < 0) {
+          PrintError("Invalid port number: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'L':
+        if (npeers == kMaxLinks) {
+          PrintError("Too many peers (at most %d)\n", kMaxLinks);
+          return EXIT_FAILURE;
+        }
+        peers[npeers++] = optarg;
+        break;
+      case 'b':
+        backplane_path = optarg;
+        break;
+      case 'B':
+        broker_path = optarg;
+        break;
+      case 's':
+        ring_path = optarg;
+        break;
+      case 'd':
+        // A room never holds more than kMaxClients, so no larger size
+        // would ever be reached
+        if (ParseCount(optarg, &digest.room_size) < 0 ||
+            digest.room_size >= kMaxClients) {
+          PrintError("Invalid room size (below %d): %s\n", kMaxClients,
+                     optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'm':
+        if (ParseCount(optarg, &stream_limit_mb) < 0 || stream_limit_mb == 0 ||
+            stream_limit_mb > SIZE_MAX >> 20) {
+          PrintError("Invalid message size limit: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'f':
+        if (ParsePort(optarg, &file_port) < 0) {
+          PrintError("Invalid port number: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'a':
+        attachment_dir = optarg;
+        break;
+      case 'p':
+        log_path = optarg;
+        break;
+      case 'F':
+        banned_path = optarg;
+        break;
+      case 'R':
+        if (ParseCount(optarg, &filter_rate) < 0 || filter_rate > 1000000) {
+          PrintError("Invalid message rate: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'M':
+        if (LoadModeratorPassword(optarg) < 0) {
+          PrintError("Failed to read moderator password from %s: %s\n",
+                     optarg, strerror(errno));
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'P':
+        if (nplugins == kMaxPlugins) {
+          PrintError("Too many plugins (at most %d)\n", kMaxPlugins);
+          return EXIT_FAILURE;
+        }
+        plugin_paths[nplugins++] = optarg;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
 
-  if (argc > 2) {
+  if (argc - optind > 1) {
     PrintUsage();
     return EXIT_FAILURE;
   }
+  stream_limit = stream_limit_mb << 20;
+
+  if (broker_path) {
+    RunBroker(broker_path);
+    return EXIT_FAILURE;
+  }
 
   port = kDefaultPort;
-  if (argc == 3) {
-    port = (in_port_t)strtol(argv[1], NULL, 10);
-    if (port <= 0 || port > kMaxPort) {
-      PrintError("Invalid port number: %s\n", argv[1]);
-      return EXIT_FAILURE;
-    }
+  if (argc - optind == 1 && ParsePort(argv[optind], &port) < 0) {
+    PrintError("Invalid port number: %s\n", argv[optind]);
+    return EXIT_FAILURE;
   }
 
   sockfd = SetupServerSocket(port, &servaddr);
@@ -55,20 +207,189 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  if (ws_port) {
+    wsfd = SetupServerSocket(ws_port, &wsaddr);
+    if (wsfd < 0) {
+      PrintError("Failed to setup WebSocket socket: %s\n", strerror(errno));
+      close(sockfd);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (link_port) {
+    linkfd = SetupServerSocket(link_port, &linkaddr);
+    if (linkfd < 0) {
+      PrintError("Failed to setup link socket: %s\n", strerror(errno));
+      close(sockfd);
+      if (wsfd >= 0) {
+        close(wsfd);
+      }
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (ring_path) {
+    if (CreateRing() < 0 || (ringfd = SetupRingSocket(ring_path)) < 0) {
+      PrintError("Failed to setup ring on %s: %s\n", ring_path,
+                 strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (file_port) {
+    if (OpenAttachmentStore(attachment_dir) < 0 ||
+        (filefd = SetupServerSocket(file_port, &fileaddr)) < 0) {
+      PrintError("Failed to setup attachments in %s: %s\n", attachment_dir,
+                 strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (log_path) {
+    if (OpenMessageLog(log_path) < 0) {
+      PrintError("Failed to open message log %s: %s\n", log_path,
+                 strerror(errno));
+      return EXIT_FAILURE;
+    }
+    if (StartIndexer() < 0) {
+      PrintError("Failed to start search indexer\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  InitFederation();
+  printf("Node id: %016" PRIx64 "\n", LocalNodeId());
+  for (size_t i = 0; i < npeers; i++) {
+    if (ConnectPeer(peers[i]) < 0) {
+      PrintError("Invalid peer address: %s\n", peers[i]);
+    }
+  }
+  if (backplane_path && ConnectBackplane(backplane_path) < 0) {
+    PrintError("Invalid broker socket path: %s\n", backplane_path);
+  }
+  if (pthread_create(&tid, NULL, &DigestPresence, NULL) != 0) {
+    PrintError("Failed to start presence digests\n");
+    return EXIT_FAILURE;
+  }
+  pthread_detach(tid);
+  if (StartHeartbeats() < 0) {
+    PrintError("Failed to start heartbeats\n");
+    return EXIT_FAILURE;
+  }
+  if (StartMentions() < 0) {
+    PrintError("Failed to start mention matching\n");
+    return EXIT_FAILURE;
+  }
+  if (StartFilters(banned_path, filter_rate) < 0) {
+    PrintError("Failed to start message filters%s%s: %s\n",
+               banned_path ? " with " : "", banned_path ? banned_path : "",
+               strerror(errno));
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < nplugins; i++) {
+    if (LoadPlugin(plugin_paths[i]) < 0) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // poll() skips the listeners that are not enabled, whose fd is -1
+  struct pollfd listeners[] = {{.fd = sockfd, .events = POLLIN},
+                               {.fd = wsfd, .events = POLLIN},
+                               {.fd = linkfd, .events = POLLIN},
+                               {.fd = ringfd, .events = POLLIN},
+                               {.fd = filefd, .events = POLLIN}};
+  nfds_t nlisteners = sizeof(listeners) / sizeof(listeners[0]);
+
   while (1) {
-    client_t *client = AcceptConnection(sockfd);
-    if (!client) {
+    if (poll(listeners, nlisteners, -1) < 0) {
       continue;
     }
 
-    // TOOD: Add error checking
-    pthread_create(&tid, NULL, &HandleClient, (void *)client);
+    for (nfds_t i = 0; i < nlisteners; i++) {
+      if (!(listeners[i].revents & POLLIN)) {
+        continue;
+      }
+      if (listeners[i].fd == linkfd) {
+        AcceptLink(linkfd);
+        continue;
+      }
+      if (listeners[i].fd == ringfd) {
+        ShareRing(ringfd);
+        continue;
+      }
+      if (listeners[i].fd == filefd) {
+        AcceptTransfer(filefd);
+        continue;
+      }
+
+      client_t *client = AcceptConnection(listeners[i].fd);
+      EpochTryReclaim();
+      if (!client) {
+        continue;
+      }
+      client->transport = i == 1 ? kTransportWebSocket : kTransportTcp;
+
+      // TOOD: Add error checking
+      pthread_create(&tid, NULL, &HandleClient, (void *)client);
+    }
   }
 
   close(sockfd);
+  if (wsfd >= 0) {
+    close(wsfd);
+  }
+  if (linkfd >= 0) {
+    close(linkfd);
+  }
+  if (ringfd >= 0) {
+    close(ringfd);
+  }
+  if (filefd >= 0) {
+    close(filefd);
+  }
   return EXIT_SUCCESS;
 }
 
+/**
+ * @brief Parses a port number given on the command line.
+ *
+ * @param str   String to parse.
+ * @param port  Where the parsed port is stored.
+ *
+ * @return Returns 0 on success, or -1 if str is not a valid port number.
+ */
+int ParsePort(const char *str, in_port_t *port) {
+  char *end;
+  long value = strtol(str, &end, 10);
+
+  if (*str == '\0' || *end != '\0' || value <= 0 || value > kMaxPort) {
+    return -1;
+  }
+  *port = (in_port_t)value;
+  return 0;
+}
+
+/**
+ * @brief Parses a non-negative count given on the command line.
+ *
+ * @param str    String to parse.
+ * @param count  Where the parsed count is stored.
+ *
+ * @return Returns 0 on success, or -1 if str is not a valid count.
+ */
+int ParseCount(const char *str, size_t *count) {
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+
+  if (*str == '\0' || *str == '-' || *end != '\0' || errno == ERANGE ||
+      value > SIZE_MAX) {
+    return -1;
+  }
+  *count = (size_t)value;
+  return 0;
+}
+
 /**
  * @brief Sets up a server socket bound to the specified port.
  *
@@ -89,6 +410,12 @@ int SetupServerSocket(in_port_t port, struct sockaddr_in *servaddr) {
     return -1;
   }
 
+  int reuse = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+    close(sockfd);
+    return -1;
+  }
+
   servaddr->sin_family = AF_INET;
   servaddr->sin_port = htons(port);
   servaddr->sin_addr.s_addr = htonl(INADDR_ANY);
@@ -110,8 +437,8 @@ int SetupServerSocket(in_port_t port, struct sockaddr_in *servaddr) {
  * @brief Attempts to accept a new client connection using the given socket.
  *
  * This function repeatedly tries to accept a new connection up to a maximum
- * number of attempts. On success, it allocates a new client, assigns a unique
- * ID, and attempts to add the client to the pool. If the pool is full or if
+ * number of attempts. On success, it allocates a new client and attempts to add
+ * it to the pool, which assigns its handle. If the pool is full or if
  * any other error occurs during setup, it handles cleanup and reports the
  * error appropriately.
  *
@@ -123,10 +450,12 @@ int SetupServerSocket(in_port_t port, struct sockaddr_in *servaddr) {
 client_t *AcceptConnection(int sockfd) {
   size_t attempts;
   int connfd;
-  static int uid = 0;
+  struct sockaddr_in addr;
+  socklen_t addrlen;
 
   for (attempts = 0; attempts < kMaxConnectionAttempts; attempts++) {
-    connfd = accept(sockfd, NULL, NULL);
+    addrlen = sizeof(addr);
+    connfd = accept(sockfd, (struct sockaddr *)&addr, &addrlen);
     if (connfd >= 0) {
       break;
     } else {
@@ -156,6 +485,13 @@ client_t *AcceptConnection(int sockfd) {
     return NULL;
   }
 
+  if (IsBannedAddress(addr.sin_addr)) {
+    printf("Rejected connection from banned address %s\n",
+           inet_ntoa(addr.sin_addr));
+    close(connfd);
+    return NULL;
+  }
+
   client_t *client = malloc(sizeof(client_t));
   if (!client) {
     PrintError("Failed to allocate memory for client\n");
@@ -163,9 +499,30 @@ client_t *AcceptConnection(int sockfd) {
     return NULL;
   }
   client->connfd = connfd;
-  client->uid = uid++;
+  client->transport = kTransportTcp;
+  client->addr = addr.sin_addr;
+  atomic_init(&client->handle, kInvalidHandle);
+  atomic_init(&client->protocol, kProtocolPending);
+  client->features = 0;
+  client->resume_seq = 0;
+  atomic_init(&client->acked, 0);
+  client->session = 0;
+  client->resumed = false;
+  client->leaving = false;
+  atomic_init(&client->kicked, false);
+  client->moderator = false;
+  client->op_failures = 0;
+  client->name[0] = '\0';
+  pthread_mutex_init(&client->send_mutex, NULL);
+  InitOutbox(&client->outbox, connfd);
+  client->heartbeat = (heartbeat_t){.client = client, .armed = false};
+  client->stream = 0;
+  client->stream_len = 0;
+  client->carry_len = 0;
 
   if (AddClient(client) < 0) {
+    DestroyOutbox(&client->outbox);
+    pthread_mutex_destroy(&client->send_mutex);
     free(client);
     close(connfd);
     PrintError("Chatroom capacity reached. Connection rejected\n");
@@ -175,181 +532,2209 @@ client_t *AcceptConnection(int sockfd) {
   return client;
 }
 
+/**
+ * @brief Builds a new membership snapshot from the current one.
+ *
+ * Copies the members of old, leaving out removed and appending added. Either
+ * client may be NULL.
+ *
+ * @param old      Current snapshot, or NULL if the chat is empty.
+ * @param added    Client to append to the snapshot.
+ * @param removed  Client to leave out of the snapshot.
+ *
+ * @return Returns the new snapshot, or NULL if allocation failed.
+ */
+static membership_t *BuildMembership(const membership_t *old, client_t *added,
+                                     const client_t *removed) {
+  size_t capacity = (old ? old->len : 0) + (added ? 1 : 0);
+  membership_t *snapshot =
+      malloc(sizeof(membership_t) + capacity * sizeof(client_t *));
+  if (!snapshot) {
+    return NULL;
+  }
+
+  snapshot->len = 0;
+  for (size_t i = 0; old && i < old->len; i++) {
+    if (old->members[i] != removed) {
+      snapshot->members[snapshot->len++] = old->members[i];
+    }
+  }
+  if (added) {
+    snapshot->members[snapshot->len++] = added;
+  }
+
+  return snapshot;
+}
+
+/**
+ * @brief Publishes a new membership snapshot and retires the previous one.
+ *
+ * Must be called with the pool mutex held.
+ *
+ * @param snapshot  Snapshot to publish.
+ */
+static void PublishMembership(membership_t *snapshot) {
+  membership_t *old = atomic_exchange(&pool.members, snapshot);
+  if (old) {
+    EpochRetire(&old->retire, old, &free);
+  }
+}
+
 /**
  * @brief Adds a new client to the client pool.
  *
- * Locks the pool mutex, checks for capacity, and adds the client to the pool
- * if space is available. If the pool is full, it returns an error without
- * adding the client.
+ * Claims the first free slot with a compare-and-swap, so concurrent accepting
+ * threads never hand out the same slot. The slot generation is then bumped and
+ * combined with the slot index to form the client's handle, which makes any
+ * handle issued for a previous occupant of the slot stale. Finally a new
+ * membership snapshot including the client is published.
  *
  * @param cli  Pointer to the client to be added to the pool.
  *
- * @return Returns 0 on successful addition, or -1 if the pool is full.
+ * @return Returns 0 on successful addition, or -1 if the pool is full or the
+ *         snapshot could not be allocated.
  */
 int AddClient(client_t *cli) {
-  pthread_mutex_lock(&(pool.mutex));
+  for (uint32_t i = 0; i < kMaxClients; i++) {
+    client_slot_t *slot = &pool.slots[i];
+    client_t *expected = NULL;
 
-  if (pool.len + 1 >= kMaxClients) {
+    if (!atomic_compare_exchange_strong(&slot->client, &expected, cli)) {
+      continue;
+    }
+
+    pthread_mutex_lock(&(pool.mutex));
+    membership_t *snapshot =
+        BuildMembership(atomic_load(&pool.members), cli, NULL);
+    if (!snapshot) {
+      pthread_mutex_unlock(&(pool.mutex));
+      atomic_store(&slot->client, NULL);
+      return -1;
+    }
+
+    uint32_t generation = atomic_fetch_add(&slot->generation, 1) + 1;
+    if (generation == 0) {
+      // Skip generation 0 on wrap-around so kInvalidHandle stays invalid
+      generation = atomic_fetch_add(&slot->generation, 1) + 1;
+    }
+    atomic_store(&cli->handle, MakeHandle(generation, i));
+    atomic_fetch_add(&pool.len, 1);
+
+    PublishMembership(snapshot);
     pthread_mutex_unlock(&(pool.mutex));
-    return -1;
+    return 0;
   }
-  pool.clients[pool.len] = cli;
-  pool.len++;
 
-  pthread_mutex_unlock(&(pool.mutex));
-
-  return 0;
+  return -1;
 }
 
 /**
- * @brief Handles client communications in a dedicated thread.
+ * @brief Resolves a client handle to the client currently holding it.
  *
- * Receives a client's name, broadcasts their joining message, then enters a
- * loop to handle all incoming messages from this client. It broadcasts messages
- * to all other clients and handles commands like "/exit". Cleans up and removes
- * the client on disconnection.
+ * The slot index is taken straight from the handle, so the lookup is a single
+ * array access. The handle is stale if the slot has since been freed or reused,
+ * in which case the stored client's handle no longer matches. The caller must
+ * be inside an epoch critical section for as long as it uses the result.
  *
- * @param arg Pointer to a client_context_t struct containing the client and
- *            pool data.
+ * @param handle  Handle of the client to look up.
  *
- * @return Returns NULL after handling client disconnection and cleaning up.
+ * @return Returns the client owning the handle, or NULL if the handle is stale
+ *         or invalid.
  */
-void *HandleClient(void *arg) {
-  char name[kNameCharLimit];
-  char msg[kMessageCharLimit];
-  char buf[strlen(kPromptString) + kNameCharLimit + kMessageCharLimit];
-  memset(buf, 0, sizeof(buf));
-
-  client_t *cli = (client_t *)arg;
-
-  // Set name
-  ssize_t name_len = recv(cli->connfd, name, kNameCharLimit - 1, 0); 
-  if (name_len <= 0) {
-    PrintError("Failed to receive client name: %s\n", strerror(errno));
-    goto close_connection;
+client_t *LookupClient(client_handle_t handle) {
+  uint32_t index = HandleIndex(handle);
+  if (handle == kInvalidHandle || index >= kMaxClients) {
+    return NULL;
   }
-  memset(cli->name, 0, kNameCharLimit);
-  strncpy(cli->name, name, name_len);
-  cli->name[name_len - 1] = '\0';
-  
-  // Handle \r\n sent by telnet connections
-  if (cli->name[name_len - 2] == '\r') {
-    cli->name[name_len - 2] = '\0';
+
+  client_t *client = atomic_load(&pool.slots[index].client);
+  if (!client || atomic_load(&client->handle) != handle) {
+    return NULL;
   }
+  return client;
+}
 
-  // Broadcast welcome message
-  printf("Client joined the chat: %s\n", cli->name);
-  snprintf(buf, sizeof(buf), "\n=== %s has joined the chat ===\n", cli->name);
-  if (BroadcastMessage(buf, cli->uid) < 0) {
-    PrintError("Failed to broadcast message: %s\n", strerror(errno));
-    goto close_connection;
+/**
+ * @brief Receives more bytes from a client into its input buffer.
+ *
+ * @param cli  Client to receive from.
+ * @param in   Input buffer.
+ * @param len  Number of bytes already buffered, updated on success.
+ * @param cap  Size of the input buffer.
+ *
+ * @return Returns the number of bytes received, 0 if the peer closed the
+ *         connection, or -1 on error.
+ */
+static ssize_t ReceiveInput(client_t *cli, uint8_t *in, size_t *len,
+                             size_t cap) {
+  ssize_t received = recv(cli->connfd, in + *len, cap - *len, 0);
+  if (received < 0) {
+    PrintError("Failed to receive message: %s\n", strerror(errno));
+    return -1;
   }
+  *len += (size_t)received;
+  return received;
+}
 
-  while (1) {
-    ssize_t msg_len;
+/**
+ * @brief Receives the next line from a text client.
+ *
+ * Lines end at '\n'; a preceding '\r' is dropped. A line longer than the
+ * line buffer is split at its capacity, and a partial line left when the
+ * client disconnects is returned as the last line. Lines that hold control
+ * characters or invalid UTF-8 are sanitized; clean lines are copied as is.
+ * When more is given, the parts of a split line and the rest of a line the
+ * client is streaming are copied raw instead, for PostChunk() to sanitize,
+ * so a character cut at a split is carried over rather than replaced.
+ *
+ * @param cli       Client to receive from.
+ * @param in        Input buffer. Bytes after the line are kept at its start.
+ * @param len       Number of bytes buffered in in, updated on return.
+ * @param cap       Size of the input buffer.
+ * @param line      Where the NUL-terminated line is stored.
+ * @param line_cap  Size of line.
+ * @param more      Where to store whether the line was split and goes on, or
+ *                  NULL.
+ *
+ * @return Returns the line length, or -1 if the client disconnected or the
+ *         connection failed.
+ */
+static ssize_t ReceiveLine(client_t *cli, uint8_t *in, size_t *len, size_t cap,
+                           char *line, size_t line_cap, bool *more) {
+  size_t limit = line_cap - 1;
+  scan_result_t scan;
+  size_t consumed;
+  bool split = false;
 
-    msg_len = recv(cli->connfd, msg, kMessageCharLimit, 0);
-    if (msg_len < 0) {
-      PrintError("Failed to receive message: %s\n", strerror(errno));
+  while (1) {
+    ScanLine(in, *len < limit ? *len : limit, &scan);
+    if (scan.found) {
+      consumed = scan.len + 1;
       break;
     }
-    if (msg_len == 0 || strncmp(msg, kExitCommand, strlen(kExitCommand)) == 0) {
-      printf("Client left the chat: %s\n", cli->name);
-      snprintf(buf, sizeof(buf), "\n=== %s has left the chat ===\n", cli->name);
-      if (BroadcastMessage(buf, cli->uid) < 0) {
-        PrintError("Failed to broadcast message: %s\n", strerror(errno));
-      }
+    if (*len >= limit) {
+      consumed = scan.len;
+      split = true;
       break;
     }
-    
-    msg[msg_len - 1] = '\0';
-    printf("%s sent a message: %s\n", cli->name, msg);
-    memset(buf, 0, sizeof(buf));
-    snprintf(buf, sizeof(buf), "%s%s%s\n", cli->name, kPromptString, msg);
-    if (BroadcastMessage(buf, cli->uid) < 0) {
-      PrintError("Failed to broadcast error: %s\n", strerror(errno));
+
+    ssize_t received = ReceiveInput(cli, in, len, cap);
+    if (received < 0) {
+      return -1;
+    }
+    if (received == 0) {
+      if (*len == 0) {
+        return -1;
+      }
+      ScanLine(in, *len, &scan);
+      consumed = scan.len;
       break;
     }
   }
 
-close_connection:
-  RemoveClient(cli->uid);
-  pthread_detach(pthread_self());
+  size_t line_len = scan.len;
+  if (!split && line_len > 0 && in[line_len - 1] == '\r') {
+    line_len--;
+  }
+  if (scan.invalid_at >= line_len || (more && (split || cli->stream))) {
+    memcpy(line, in, line_len);
+    line[line_len] = '\0';
+  } else {
+    line_len = SanitizeText(in, line_len, line, line_cap);
+  }
 
-  return NULL;
+  memmove(in, in + consumed, *len - consumed);
+  *len -= consumed;
+  if (more) {
+    *more = split;
+  }
+
+  return (ssize_t)line_len;
 }
 
 /**
- * @brief Broadcasts a message to all clients in the pool except the sender.
+ * @brief Receives the name a telnet client sends as its first line.
  *
- * Locks the pool mutex and iterates over all clients in the pool, sending
- * the message to each client except the one identified by uid.
+ * @param cli  Client whose name is being set.
+ * @param in   Input buffer.
+ * @param len  Number of bytes buffered in in, updated on return.
+ * @param cap  Size of the input buffer.
+ *
+ * @return Returns 0 on success, or -1 if the connection failed or closed or
+ *         the name is empty.
+ */
+static int ReceiveTextName(client_t *cli, uint8_t *in, size_t *len,
+                           size_t cap) {
+  ssize_t name_len =
+      ReceiveLine(cli, in, len, cap, cli->name, kNameCharLimit, NULL);
+
+  if (name_len < 0) {
+    PrintError("Failed to receive client name: %s\n", strerror(errno));
+    return -1;
+  }
+  if (name_len == 0) {
+    SendNotice(cli, "Invalid name");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Attaches a client that asked for a resumable session to one.
  *
- * @param msg  The message to broadcast.
- * @param uid  User ID of the sender.
+ * A client presenting the token of a known session takes it over and gets
+ * its name back, and resumes from the last message the previous owner acked
+ * if that is newer than what it asked for. The previous owner's socket is
+ * shut down in case it has not noticed its connection drop yet; its own
+ * thread then removes it. Any other client gets a new session.
  *
- * @return Returns 0 if the message was successfully sent to all other clients,
- *         or -1 if an error occurred during sending.
+ * @param cli    Client being negotiated.
+ * @param token  Token the client presented, or 0.
  */
-int BroadcastMessage(char *msg, int uid) {
-  pthread_mutex_lock(&(pool.mutex));
+static void AttachSession(client_t *cli, uint64_t token) {
+  client_handle_t previous;
 
-  for (size_t i = 0; i < pool.len; i++) {
-    client_t *client = pool.clients[i];
+  if (ClaimSession(token, cli->handle, cli->name, kNameCharLimit,
+                   &previous) == 0) {
+    cli->session = token;
+    cli->resumed = true;
 
-    if (client && client->uid != uid) {
-      if (send(client->connfd, msg, kMessageCharLimit, 0) < 0) {
-        pthread_mutex_unlock(&(pool.mutex));
-        return -1;
+    EpochEnter();
+    client_t *owner = LookupClient(previous);
+    if (owner) {
+      // Messages the owner acked arrived, so they are not replayed even if
+      // the client lost track of them
+      uint64_t acked = atomic_load(&owner->acked);
+      if (acked > cli->resume_seq) {
+        cli->resume_seq = acked;
       }
+      atomic_store(&cli->acked, acked);
+      shutdown(owner->connfd, SHUT_RDWR);
     }
+    EpochExit();
+    return;
   }
 
-  pthread_mutex_unlock(&(pool.mutex));
+  cli->session = OpenSession(cli->handle, cli->name);
+}
+
+/**
+ * @brief Performs the binary protocol handshake.
+ *
+ * Expects kProtocolMagic followed by a HELLO frame carrying the client's
+ * protocol version, requested features and name, and answers with the version
+ * both sides speak, the features enabled and, for resumable sessions, the
+ * session token.
+ * Bytes received past the HELLO frame are left at the start of in.
+ *
+ * @param cli  Client being negotiated.
+ * @param in   Input buffer.
+ * @param len  Number of bytes buffered in in, updated on return.
+ * @param cap  Size of the input buffer.
+ *
+ * @return Returns 0 on success, or -1 if the handshake failed.
+ */
+static int ReceiveHello(client_t *cli, uint8_t *in, size_t *len, size_t cap) {
+  frame_t frame;
+  ssize_t frame_len = 0;
+
+  while (*len < kProtocolMagicLen ||
+         (frame_len = ParseFrame(in + kProtocolMagicLen,
+                                 *len - kProtocolMagicLen,
+                                 4 * kMaxVarintLen + kNameCharLimit,
+                                 &frame)) == 0) {
+    if (ReceiveInput(cli, in, len, cap) <= 0) {
+      return -1;
+    }
+  }
+
+  if (memcmp(in, kProtocolMagic, kProtocolMagicLen) != 0 || frame_len < 0 ||
+      frame.type != kFrameHello) {
+    PrintError("Malformed protocol handshake\n");
+    return -1;
+  }
+
+  uint64_t version;
+  uint64_t features = 0;
+  uint64_t token = 0;
+  ssize_t off = DecodeVarint(frame.payload, frame.len, &version);
+  if (off > 0 && version >= 2) {
+    ssize_t features_len = DecodeVarint(frame.payload + off,
+                                        frame.len - (size_t)off, &features);
+    off = features_len > 0 ? off + features_len : -1;
+  }
+  if (off > 0 && version >= 2 && (features & kFeatureSequence)) {
+    ssize_t resume_len = DecodeVarint(frame.payload + off,
+                                      frame.len - (size_t)off,
+                                      &cli->resume_seq);
+    off = resume_len > 0 ? off + resume_len : -1;
+  }
+  if (off > 0 && version >= 2 && (features & kFeatureResume)) {
+    ssize_t token_len = DecodeVarint(frame.payload + off,
+                                     frame.len - (size_t)off, &token);
+    off = token_len > 0 ? off + token_len : -1;
+  }
+  if (off <= 0 || version == 0 ||
+      SanitizeText(frame.payload + off, frame.len - (size_t)off, cli->name,
+                   kNameCharLimit) == 0) {
+    PrintError("Malformed protocol handshake\n");
+    return -1;
+  }
+
+  if (version > kProtocolVersion) {
+    version = kProtocolVersion;
+  }
+  cli->features = features & kSupportedFeatures;
+  // A client resuming goes by its session's name. One banned by that name
+  // must not take the session over, so it gets none, and HandleClient turns
+  // it away once the handshake is done.
+  if (cli->features & kFeatureResume) {
+    GetSessionName(token, cli->name, kNameCharLimit);
+    if (!IsBannedName(cli->name)) {
+      AttachSession(cli, token);
+    }
+  }
+
+  uint8_t reply[kFrameHeaderLen + 3 * kMaxVarintLen];
+  uint8_t payload[3 * kMaxVarintLen];
+  size_t payload_len = EncodeVarint(version, payload);
+  if (version >= 2) {
+    payload_len += EncodeVarint(cli->features, payload + payload_len);
+  }
+  if (cli->features & kFeatureResume) {
+    payload_len += EncodeVarint(cli->session, payload + payload_len);
+  }
+  size_t reply_len = EncodeFrame(kFrameHello, NULL, payload, payload_len,
+                                 reply, sizeof(reply));
+  if (SendToClient(cli, kLaneControl, reply, reply_len) < 0) {
+    return -1;
+  }
+
+  size_t consumed = kProtocolMagicLen + (size_t)frame_len;
+  memmove(in, in + consumed, *len - consumed);
+  *len -= consumed;
 
   return 0;
 }
 
 /**
- * @brief Removes a client from the client pool based on their unique ID.
+ * @brief Sends a server notice to a single client.
+ *
+ * @param cli     Recipient.
+ * @param notice  Notice text.
+ */
+void SendNotice(client_t *cli, const char *notice) {
+  chat_event_t event = {.type = kEventNotice,
+                        .name = NULL,
+                        .body = notice,
+                        .body_len = strlen(notice)};
+  SendEvent(cli, &event);
+}
+
+/**
+ * @brief Delivers a direct message to the client with the given name.
  *
- * Locks the pool mutex, searches for the client by uid, and removes them.
- * Compacts the client array to fill the gap left by the removed client.
+ * Tells the sender when no such client is connected.
  *
- * @param uid  User ID of the client to be removed.
+ * @param cli       Sender.
+ * @param target    Name of the recipient.
+ * @param body      Message body.
+ * @param body_len  Length of the message body.
  */
-void RemoveClient(int uid) {
-  pthread_mutex_lock(&(pool.mutex));
+static void DeliverDirect(client_t *cli, const char *target, const char *body,
+                          size_t body_len) {
+  chat_event_t event = {.type = kEventDirect,
+                        .name = cli->name,
+                        .body = body,
+                        .body_len = body_len};
+  int delivered = 0;
 
-  for (size_t i = 0; i < pool.len; i++) {
-    client_t *client = pool.clients[i];
+  if (IsSlotMuted(HandleIndex(cli->handle))) {
+    SendNotice(cli, "Message not sent: you are muted");
+    return;
+  }
 
-    if (client && client->uid == uid) {
-      close(client->connfd);
-      free(client);
+  EpochEnter();
+  client_t *recipient = FindClientByName(target);
+  if (recipient) {
+    delivered = SendEvent(recipient, &event) == 0;
+  }
+  EpochExit();
 
-      // Eliminate gaps in client array
-      for (size_t j = i; j < pool.len - 1; j++) {
-        pool.clients[j] = pool.clients[j + 1];
-      }
+  if (!delivered) {
+    char notice[kNameCharLimit + 32];
+    snprintf(notice, sizeof(notice), "No such user: %s", target);
+    SendNotice(cli, notice);
+  }
+}
 
-      pool.clients[pool.len - 1] = NULL;
-      pool.len--;
-      break;
+/**
+ * @brief Tells the room about an attachment in the store.
+ *
+ * Tells the sender when there is no such attachment.
+ *
+ * @param cli  Sender.
+ * @param id   Attachment id.
+ *
+ * @return Returns 0 on success, or -1 if the message could not be broadcast.
+ */
+static int ShareAttachment(client_t *cli, const char *id) {
+  char body[kAttachmentIdLen + 64];
+  off_t size;
+
+  if (FindAttachment(id, &size) < 0) {
+    char notice[kMessageCharLimit];
+    snprintf(notice, sizeof(notice), "No such attachment: %s", id);
+    SendNotice(cli, notice);
+    return 0;
+  }
+
+  int len = snprintf(body, sizeof(body), "shared attachment %s (%jd bytes)",
+                     id, (intmax_t)size);
+  printf("%s %s\n", cli->name, body);
+  return PostMessage(cli, body, (size_t)len);
+}
+
+/**
+ * @brief Searches the message log and sends the sender what was found.
+ *
+ * Results are sent as notices, newest first.
+ *
+ * @param cli    Client searching.
+ * @param query  Words to look for.
+ */
+static void SendSearchResults(client_t *cli, const char *query) {
+  uint64_t hits[kSearchResults];
+  char notice[kMessageCharLimit];
+  char buf[256 + kMessageCharLimit];
+  bool truncated;
+
+  ssize_t nhits = SearchMessages(query, hits, kSearchResults, &truncated);
+  if (nhits < 0) {
+    SendNotice(cli, errno == ENOTSUP  ? "Search is not enabled"
+                    : errno == EINVAL ? "Usage: /search WORDS"
+                                      : "Search failed");
+    return;
+  }
+
+  snprintf(notice, sizeof(notice), "%zd message%s found for: %s%s", nhits,
+           nhits == 1 ? "" : "s", query,
+           truncated ? " (search cut short, try more words)" : "");
+  SendNotice(cli, notice);
+
+  for (ssize_t i = 0; i < nhits; i++) {
+    log_record_t record;
+    if (ReadMessageLog(hits[i], &record, buf, sizeof(buf)) < 0) {
+      continue;
     }
+
+    char when[32];
+    time_t seconds = (time_t)(record.time_ms / 1000);
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M",
+             localtime_r(&seconds, &tm));
+    snprintf(notice, sizeof(notice), "[%s] %s: %.*s", when, record.name,
+             (int)record.body_len, record.body);
+    SendNotice(cli, notice);
   }
+}
 
-  pthread_mutex_unlock(&(pool.mutex));
+/**
+ * @brief Sends a client the logged messages of a time range.
+ *
+ * The messages are read from the log sequentially from the nearest mark of
+ * its time index and queued as HISTORY events as the client takes them, so
+ * neither the log nor the client's outbox ever holds more than a bounded
+ * part of the range. A notice tells the client when the range is over.
+ *
+ * @param cli       Client asking.
+ * @param since_ms  Start of the range, in milliseconds since the epoch.
+ * @param until_ms  End of the range, excluded.
+ *
+ * @return Returns 0 on success, or -1 if the client could not be sent to.
+ */
+static int SendLogRange(client_t *cli, uint64_t since_ms, uint64_t until_ms) {
+  char buf[256 + kMessageCharLimit];
+  char notice[128];
+  log_record_t record;
+  size_t sent = 0;
+
+  if (!HasMessageLog()) {
+    SendNotice(cli, "History by time is not enabled");
+    return 0;
+  }
+
+  uint64_t offset = SeekMessageLog(since_ms);
+  while (ReadMessageLog(offset, &record, buf, sizeof(buf)) == 0 &&
+         record.time_ms < until_ms) {
+    offset = record.next;
+    if (record.time_ms < since_ms) {
+      continue;
+    }
+    if (sent == kRangeLimit) {
+      break;
+    }
+
+    // Wait for the client to take what it has been sent so far
+    for (int waited = 0; OutboxBacklog(&cli->outbox) > kOutboxBytes / 2 &&
+                         waited < kStreamPaceLimitMs;
+         waited += kStreamPaceMs) {
+      usleep(kStreamPaceMs * 1000);
+    }
+    chat_event_t event = {.type = kEventHistory,
+                          .name = record.name,
+                          .body = record.body,
+                          .body_len = record.body_len,
+                          .seq = 0};
+    if (SendEvent(cli, &event) < 0) {
+      return -1;
+    }
+    sent++;
+  }
+
+  if (sent == kRangeLimit) {
+    snprintf(notice, sizeof(notice),
+             "Sent the first %zu messages; ask again from the last one",
+             sent);
+  } else {
+    snprintf(notice, sizeof(notice), "%zu logged message%s in range", sent,
+             sent == 1 ? "" : "s");
+  }
+  SendNotice(cli, notice);
+  return 0;
+}
+
+/**
+ * @brief Parses the time a /since command asks for.
+ *
+ * @param str      "30s", "15m", "2h" or "3d" ago, or a local time as
+ *                 "HH:MM" today, "YYYY-MM-DD" or "YYYY-MM-DD HH:MM".
+ * @param time_ms  Where the time is stored, in milliseconds since the
+ *                 epoch.
+ *
+ * @return Returns 0 on success, or -1 if str is not a valid time.
+ */
+static int ParseSince(const char *str, uint64_t *time_ms) {
+  time_t now = time(NULL);
+  struct tm tm;
+  unsigned long amount;
+  char unit;
+  int year, month, day;
+  int hour = 0;
+  int minute = 0;
+  int end = -1;
+
+  while (isspace((unsigned char)*str)) {
+    str++;
+  }
+  // %lu alone would take "-5m" as a huge amount
+  if (isdigit((unsigned char)str[0]) &&
+      sscanf(str, "%lu%c%n", &amount, &unit, &end) == 2 &&
+      str[end] == '\0' && strchr("smhd", unit)) {
+    unsigned long unit_seconds = unit == 's'   ? 1
+                                 : unit == 'm' ? 60
+                                 : unit == 'h' ? 3600
+                                               : 86400;
+    if (amount > ULONG_MAX / unit_seconds) {
+      return -1;
+    }
+    unsigned long seconds = amount * unit_seconds;
+    *time_ms = seconds < (unsigned long)now
+                   ? ((uint64_t)now - seconds) * 1000
+                   : 0;
+    return 0;
+  }
+
+  localtime_r(&now, &tm);
+  end = -1;
+  int fields = sscanf(str, "%d-%d-%d%n %d:%d%n", &year, &month, &day, &end,
+                      &hour, &minute, &end);
+  if (fields == 3 || fields == 5) {
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = day;
+  } else if (sscanf(str, "%d:%d%n", &hour, &minute, &end) != 2) {
+    return -1;
+  }
+  if (end < 0 || str[end] != '\0') {
+    return -1;
+  }
+  tm.tm_hour = hour;
+  tm.tm_min = minute;
+  tm.tm_sec = 0;
+  tm.tm_isdst = -1;
+
+  time_t when = mktime(&tm);
+  if (when < 0) {
+    return -1;
+  }
+  *time_ms = (uint64_t)when * 1000;
+  return 0;
+}
+
+/**
+ * @brief Adds a keyword to the ones a client watches, or removes it.
+ *
+ * Tells the client how it went.
+ *
+ * @param cli      Client watching.
+ * @param keyword  Keyword.
+ * @param watch    Whether to watch the keyword or stop.
+ */
+static void ChangeWatch(client_t *cli, const char *keyword, bool watch) {
+  char notice[kKeywordLimit + 64];
+
+  if (watch && WatchKeyword(cli->handle, keyword) < 0) {
+    snprintf(notice, sizeof(notice), "%s",
+             errno == EINVAL   ? "Keywords are one word of at most 32 bytes"
+             : errno == ENOSPC ? "Too many keywords watched"
+                               : "Failed to watch keyword");
+  } else if (!watch && UnwatchKeyword(cli->handle, keyword) < 0) {
+    snprintf(notice, sizeof(notice), "Not watching: %.*s", kKeywordLimit,
+             keyword);
+  } else {
+    snprintf(notice, sizeof(notice), "%s: %s",
+             watch ? "Watching" : "No longer watching", keyword);
+  }
+  SendNotice(cli, notice);
+}
+
+/**
+ * @brief Sends a client the keywords it watches.
+ *
+ * @param cli  Client asking.
+ */
+static void SendWatches(client_t *cli) {
+  char keywords[kMaxKeywords * (kKeywordLimit + 1)];
+  char notice[sizeof(keywords) + 32];
+
+  if (ListKeywords(cli->handle, keywords, sizeof(keywords)) == 0) {
+    SendNotice(cli, "Not watching any keywords");
+    return;
+  }
+  snprintf(notice, sizeof(notice), "Watching: %s", keywords);
+  SendNotice(cli, notice);
+}
+
+/**
+ * @brief Sends a client the counters of the filter stages.
+ *
+ * @param cli  Client asking.
+ */
+static void SendFilterStats(client_t *cli) {
+  filter_stats_t stats[kFilterStages];
+  char notice[128];
+
+  size_t nstages = GetFilterStats(stats, kFilterStages);
+  for (size_t i = 0; i < nstages; i++) {
+    if (!stats[i].enabled) {
+      snprintf(notice, sizeof(notice), "%s: off", stats[i].name);
+    } else {
+      uint64_t avg_ns = stats[i].runs ? stats[i].total_ns / stats[i].runs : 0;
+      snprintf(notice, sizeof(notice),
+               "%s: %" PRIu64 " messages, %" PRIu64 " hit, avg %" PRIu64
+               ".%03" PRIu64 " us, max %" PRIu64 " us",
+               stats[i].name, stats[i].runs, stats[i].hits, avg_ns / 1000,
+               avg_ns % 1000, stats[i].max_ns / 1000);
+    }
+    SendNotice(cli, notice);
+  }
+}
+
+/**
+ * @brief Makes a client a moderator if it gives the moderator password.
+ *
+ * A wrong password is answered after kOpFailureDelayMs, which only holds up
+ * the client's own thread, and the kOpFailureLimit-th one disconnects it.
+ *
+ * @param cli      Client asking.
+ * @param attempt  Password it gave.
+ *
+ * @return Returns 0 to keep serving the client, or -1 to disconnect it.
+ */
+static int BecomeModerator(client_t *cli, const char *attempt) {
+  if (!IsModerationEnabled()) {
+    SendNotice(cli, "Moderation is not enabled");
+  } else if (!CheckModeratorPassword(attempt)) {
+    printf("%s gave a wrong moderator password\n", cli->name);
+    usleep(kOpFailureDelayMs * 1000);
+    if (++cli->op_failures >= kOpFailureLimit) {
+      printf("Disconnecting %s after %u wrong moderator passwords\n",
+             cli->name, cli->op_failures);
+      SendNotice(cli, "Too many wrong passwords");
+      cli->leaving = true;
+      return -1;
+    }
+    SendNotice(cli, "Wrong password");
+  } else {
+    cli->moderator = true;
+    printf("%s is now a moderator\n", cli->name);
+    SendNotice(cli, "You are now a moderator");
+  }
+  return 0;
+}
+
+/**
+ * @brief Checks that a client may moderate, telling it if not.
+ *
+ * @param cli  Client asking.
+ *
+ * @return Returns true if the client is a moderator.
+ */
+static bool CheckModerator(client_t *cli) {
+  if (!cli->moderator) {
+    SendNotice(cli, "Only moderators can do that");
+  }
+  return cli->moderator;
+}
+
+typedef enum { kModerateKick, kModerateMute, kModerateUnmute } moderate_t;
+
+/**
+ * @brief Kicks, mutes or unmutes the connected clients with a name or
+ *        connected from an address.
+ *
+ * Names are compared ignoring ASCII case, like in the ban and mute lists.
+ * A kicked client's connection is shut down for reading, so its own thread
+ * sees it end, tells the room it left and removes it; the notice telling it
+ * why is still flushed. Its session is closed, so a client already holding
+ * it after a drop leaves at once and cannot resume it. The moderator itself
+ * is never affected.
+ *
+ * @param cli     Moderator.
+ * @param name    Name to match, or NULL to match addr.
+ * @param addr    Address to match if name is NULL.
+ * @param action  What to do to the matching clients.
+ *
+ * @return Returns the number of clients affected.
+ */
+static size_t ModerateClients(client_t *cli, const char *name,
+                              const struct in_addr *addr, moderate_t action) {
+  char notice[kNameCharLimit + 32];
+  size_t count = 0;
+
+  snprintf(notice, sizeof(notice), "You were %s by %s",
+           action == kModerateKick   ? "removed"
+           : action == kModerateMute ? "muted"
+                                     : "unmuted",
+           cli->name);
+
+  EpochEnter();
+  membership_t *snapshot = atomic_load(&pool.members);
+  for (size_t i = 0; snapshot && i < snapshot->len; i++) {
+    client_t *client = snapshot->members[i];
+    if (client == cli ||
+        (name ? strncasecmp(client->name, name, kNameCharLimit) != 0
+              : client->addr.s_addr != addr->s_addr)) {
+      continue;
+    }
+
+    if (action == kModerateKick) {
+      if (atomic_exchange(&client->kicked, true)) {
+        continue;
+      }
+      if (atomic_load(&client->protocol) != kProtocolPending) {
+        SendNotice(client, notice);
+      }
+      // Wakes it if it holds its session after a drop
+      DropSessions(atomic_load(&client->handle));
+      shutdown(client->connfd, SHUT_RD);
+    } else {
+      // A client still joining recomputes its bit once it has joined
+      SetSlotMuted(HandleIndex(atomic_load(&client->handle)),
+                   action == kModerateMute);
+      if (atomic_load(&client->protocol) != kProtocolPending) {
+        SendNotice(client, notice);
+      }
+    }
+    count++;
+  }
+  EpochExit();
+
+  return count;
+}
+
+/**
+ * @brief Kicks the clients with a name out of the chat.
+ *
+ * @param cli   Moderator.
+ * @param name  Name of the clients to kick.
+ */
+static void KickClients(client_t *cli, const char *name) {
+  char notice[kNameCharLimit + 32];
+
+  if (!CheckModerator(cli)) {
+    return;
+  }
+  size_t count = ModerateClients(cli, name, NULL, kModerateKick);
+  snprintf(notice, sizeof(notice), "%s: %.*s",
+           count ? "Kicked" : "No such user", kNameCharLimit, name);
+  if (count) {
+    printf("%s kicked %s\n", cli->name, name);
+  }
+  SendNotice(cli, notice);
+}
+
+/**
+ * @brief Mutes a name, or unmutes it, including its connected clients.
+ *
+ * @param cli   Moderator.
+ * @param name  Name to mute or unmute.
+ * @param mute  Whether to mute the name or unmute it.
+ */
+static void ChangeMute(client_t *cli, const char *name, bool mute) {
+  char notice[kNameCharLimit + 32];
+
+  if (!CheckModerator(cli)) {
+    return;
+  }
+  if (mute && MuteName(name) < 0) {
+    snprintf(notice, sizeof(notice), "Failed to mute %.*s", kNameCharLimit,
+             name);
+  } else if (!mute && !UnmuteName(name)) {
+    snprintf(notice, sizeof(notice), "Not muted: %.*s", kNameCharLimit, name);
+  } else {
+    ModerateClients(cli, name, NULL, mute ? kModerateMute : kModerateUnmute);
+    printf("%s %s %s\n", cli->name, mute ? "muted" : "unmuted", name);
+    snprintf(notice, sizeof(notice), "%s: %.*s", mute ? "Muted" : "Unmuted",
+             kNameCharLimit, name);
+  }
+  SendNotice(cli, notice);
+}
+
+/**
+ * @brief Bans a name or an IPv4 address, or lifts the ban.
+ *
+ * Banning kicks the clients already connected with the name or from the
+ * address.
+ *
+ * @param cli     Moderator.
+ * @param target  Name, or address in dotted decimal.
+ * @param ban     Whether to ban the target or lift its ban.
+ */
+static void ChangeBan(client_t *cli, const char *target, bool ban) {
+  char notice[kNameCharLimit + 64];
+  struct in_addr addr;
+
+  if (!CheckModerator(cli)) {
+    return;
+  }
+  bool is_addr = inet_pton(AF_INET, target, &addr) == 1;
+  if (ban && (is_addr ? BanAddress(addr) : BanName(target)) < 0) {
+    snprintf(notice, sizeof(notice), "Failed to ban %.*s", kNameCharLimit,
+             target);
+  } else if (ban) {
+    size_t count = ModerateClients(cli, is_addr ? NULL : target, &addr,
+                                   kModerateKick);
+    printf("%s banned %s\n", cli->name, target);
+    snprintf(notice, sizeof(notice), "Banned: %.*s (%zu kicked)",
+             kNameCharLimit, target, count);
+  } else if (!(is_addr ? UnbanAddress(addr) : UnbanName(target))) {
+    snprintf(notice, sizeof(notice), "Not banned: %.*s", kNameCharLimit,
+             target);
+  } else {
+    printf("%s unbanned %s\n", cli->name, target);
+    snprintf(notice, sizeof(notice), "Unbanned: %.*s", kNameCharLimit,
+             target);
+  }
+  SendNotice(cli, notice);
+}
+
+/**
+ * @brief Handles one line of text received from a text or WebSocket client.
+ *
+ * "/exit" leaves the chat, "/msg NAME TEXT" sends TEXT to NAME only,
+ * "/attach ID" shares an uploaded attachment, "/search WORDS" looks WORDS up
+ * in the message log, "/since WHEN" replays the messages logged since WHEN,
+ * "/watch WORD" and "/unwatch WORD" start and stop highlighting messages
+ * containing WORD, "/watch" lists the watched words, "/filters" shows
+ * what the message filters did and "/op PASSWORD" makes the client a
+ * moderator, who may "/kick NAME", "/mute NAME", "/unmute NAME",
+ * "/ban NAME|ADDRESS" and "/unban NAME|ADDRESS"; any other line is broadcast
+ * as a chat message.
+ *
+ * @param cli  Sender.
+ * @param msg  NUL-terminated line, without its line terminator. It may be
+ *             modified.
+ *
+ * @return Returns 0 to keep serving the client, or -1 if it left or the
+ *         message could not be broadcast.
+ */
+int HandleTextLine(client_t *cli, char *msg) {
+  size_t direct_len = strlen(kDirectCommand);
+
+  if (strncmp(msg, kExitCommand, strlen(kExitCommand)) == 0) {
+    return -1;
+  }
+
+  if (strncmp(msg, kDirectCommand, direct_len) == 0 &&
+      msg[direct_len] == ' ') {
+    char *target = msg + direct_len + 1;
+    char *body = strchr(target, ' ');
+    if (!body) {
+      SendNotice(cli, "Usage: /msg NAME TEXT");
+      return 0;
+    }
+    *body++ = '\0';
+    DeliverDirect(cli, target, body, strlen(body));
+    return 0;
+  }
+
+  if (strncmp(msg, kAttachCommand, strlen(kAttachCommand)) == 0 &&
+      msg[strlen(kAttachCommand)] == ' ') {
+    return ShareAttachment(cli, msg + strlen(kAttachCommand) + 1);
+  }
+
+  if (strncmp(msg, kSearchCommand, strlen(kSearchCommand)) == 0 &&
+      msg[strlen(kSearchCommand)] == ' ') {
+    SendSearchResults(cli, msg + strlen(kSearchCommand) + 1);
+    return 0;
+  }
+
+  if (strncmp(msg, kSinceCommand, strlen(kSinceCommand)) == 0 &&
+      msg[strlen(kSinceCommand)] == ' ') {
+    uint64_t since_ms;
+    if (ParseSince(msg + strlen(kSinceCommand) + 1, &since_ms) < 0) {
+      SendNotice(cli, "Usage: /since 15m|2h|3d|HH:MM|YYYY-MM-DD [HH:MM]");
+      return 0;
+    }
+    return SendLogRange(cli, since_ms, UINT64_MAX);
+  }
+
+  if (strcmp(msg, kWatchCommand) == 0) {
+    SendWatches(cli);
+    return 0;
+  }
+
+  if (strncmp(msg, kWatchCommand, strlen(kWatchCommand)) == 0 &&
+      msg[strlen(kWatchCommand)] == ' ') {
+    ChangeWatch(cli, msg + strlen(kWatchCommand) + 1, true);
+    return 0;
+  }
+
+  if (strncmp(msg, kUnwatchCommand, strlen(kUnwatchCommand)) == 0 &&
+      msg[strlen(kUnwatchCommand)] == ' ') {
+    ChangeWatch(cli, msg + strlen(kUnwatchCommand) + 1, false);
+    return 0;
+  }
+
+  if (strcmp(msg, kFiltersCommand) == 0) {
+    SendFilterStats(cli);
+    return 0;
+  }
+
+  if (strncmp(msg, kOpCommand, strlen(kOpCommand)) == 0 &&
+      msg[strlen(kOpCommand)] == ' ') {
+    return BecomeModerator(cli, msg + strlen(kOpCommand) + 1);
+  }
+
+  if (strncmp(msg, kKickCommand, strlen(kKickCommand)) == 0 &&
+      msg[strlen(kKickCommand)] == ' ') {
+    KickClients(cli, msg + strlen(kKickCommand) + 1);
+    return 0;
+  }
+
+  if (strncmp(msg, kMuteCommand, strlen(kMuteCommand)) == 0 &&
+      msg[strlen(kMuteCommand)] == ' ') {
+    ChangeMute(cli, msg + strlen(kMuteCommand) + 1, true);
+    return 0;
+  }
+
+  if (strncmp(msg, kUnmuteCommand, strlen(kUnmuteCommand)) == 0 &&
+      msg[strlen(kUnmuteCommand)] == ' ') {
+    ChangeMute(cli, msg + strlen(kUnmuteCommand) + 1, false);
+    return 0;
+  }
+
+  if (strncmp(msg, kBanCommand, strlen(kBanCommand)) == 0 &&
+      msg[strlen(kBanCommand)] == ' ') {
+    ChangeBan(cli, msg + strlen(kBanCommand) + 1, true);
+    return 0;
+  }
+
+  if (strncmp(msg, kUnbanCommand, strlen(kUnbanCommand)) == 0 &&
+      msg[strlen(kUnbanCommand)] == ' ') {
+    ChangeBan(cli, msg + strlen(kUnbanCommand) + 1, false);
+    return 0;
+  }
+
+  printf("%s sent a message: %s\n", cli->name, msg);
+  return PostMessage(cli, msg, strlen(msg));
+}
+
+/**
+ * @brief Tells the clients a message mentions about it.
+ *
+ * @param event  Message, already numbered.
+ * @param hits   Clients to tell and the patterns found.
+ * @param nhits  Number of hits.
+ */
+static void NotifyMentions(const chat_event_t *event,
+                           const mention_hit_t *hits, size_t nhits) {
+  chat_event_t mention = *event;
+  mention.type = kEventMention;
+
+  EpochEnter();
+  for (size_t i = 0; i < nhits; i++) {
+    client_t *client = LookupClient(hits[i].watcher);
+    if (!client || atomic_load(&client->protocol) == kProtocolPending) {
+      continue;
+    }
+    mention.pattern = hits[i].pattern;
+    SendEvent(client, &mention);
+  }
+  EpochExit();
+}
+
+/**
+ * @brief Numbers a message, records it in the history and the message log,
+ *        and broadcasts it.
+ *
+ * The message is matched against the watched names and keywords once,
+ * before the room is locked, and the clients it mentions are told after it
+ * was broadcast. Plugins are told while the room is still locked, so they
+ * see messages in sequence order.
+ *
+ * @param event   Message to broadcast. Its sequence number is filled in.
+ * @param sender  Handle of the sending client.
+ *
+ * @return Returns 0 on success, or -1 if the message could not be broadcast.
+ */
+static int BroadcastMessage(chat_event_t *event, client_handle_t sender) {
+  mention_hit_t hits[kMaxClients];
+  size_t nhits = MatchMentions(event->body, event->body_len, sender, hits,
+                               kMaxClients);
+
+  pthread_mutex_lock(&room_mutex);
+  event->seq = AppendHistory(&history, event->name, event->body,
+                             event->body_len);
+  AppendMessageLog(event->name, event->body, event->body_len);
+  int status = BroadcastEvent(event, sender);
+  // Never waits, and queued in sequence order under the room mutex
+  NotifyPlugins(event);
+  pthread_mutex_unlock(&room_mutex);
+
+  NotifyMentions(event, hits, nhits);
+  return status;
+}
+
+/**
+ * @brief Hands a chat message to the filters, which broadcast it unless
+ *        they drop it.
+ *
+ * @param cli       Sender.
+ * @param body      Sanitized message body.
+ * @param body_len  Length of the message body.
+ *
+ * @return Returns 0 on success, or -1 if the message could not be queued.
+ */
+int PostMessage(client_t *cli, const char *body, size_t body_len) {
+  return FilterMessage(cli->handle, cli->name, body, body_len);
+}
+
+/**
+ * @brief Records a chat message that passed the filters in the history and
+ *        broadcasts it, also to linked servers.
+ *
+ * Called by the filter workers.
+ *
+ * @param sender    Handle of the sending client.
+ * @param name      Its name.
+ * @param body      Filtered message body.
+ * @param body_len  Length of the message body.
+ *
+ * @return Returns 0 on success, or -1 if the message could not be broadcast.
+ */
+int PublishMessage(client_handle_t sender, const char *name, const char *body,
+                   size_t body_len) {
+  chat_event_t event = {.type = kEventMessage,
+                        .name = name,
+                        .body = body,
+                        .body_len = body_len};
+
+  // Checked last, so a client muted while its message was queued is too
+  if (IsSlotMuted(HandleIndex(sender))) {
+    RejectMessage(sender, "you are muted");
+    return 0;
+  }
+
+  RelayEvent(&event);
+  if (BroadcastMessage(&event, sender) < 0) {
+    PrintError("Failed to broadcast error: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Tells a client the filters dropped its message.
+ *
+ * Called by the filter workers.
+ *
+ * @param sender  Handle of the sending client.
+ * @param reason  Why the message was dropped.
+ */
+void RejectMessage(client_handle_t sender, const char *reason) {
+  char notice[128];
+  snprintf(notice, sizeof(notice), "Message not sent: %s", reason);
+
+  EpochEnter();
+  client_t *client = LookupClient(sender);
+  if (client) {
+    SendNotice(client, notice);
+  }
+  EpochExit();
+}
+
+/**
+ * @brief Broadcasts a chat message posted by a plugin, also to linked
+ *        servers.
+ *
+ * Called on plugin threads through plugin_host_t. The message skips the
+ * filters, but is sanitized like a client's.
+ *
+ * @param name      Name to send it under.
+ * @param body      Message body.
+ * @param body_len  Length of the message body.
+ *
+ * @return Returns 0 on success, or -1 if the message is empty or could not
+ *         be broadcast.
+ */
+int PostPluginMessage(const char *name, const char *body, size_t body_len) {
+  char clean_name[kNameCharLimit];
+  char clean_body[kMessageCharLimit];
+  chat_event_t event = {.type = kEventMessage,
+                        .name = clean_name,
+                        .body = clean_body};
+
+  if (!name || !body ||
+      SanitizeText((const uint8_t *)name, strlen(name), clean_name,
+                   kNameCharLimit) == 0) {
+    return -1;
+  }
+  event.body_len = SanitizeText((const uint8_t *)body, body_len, clean_body,
+                                kMessageCharLimit);
+  if (event.body_len == 0) {
+    return -1;
+  }
+
+  RelayEvent(&event);
+  if (BroadcastMessage(&event, kInvalidHandle) < 0) {
+    PrintError("Failed to broadcast message: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Delivers an event relayed from a linked server to local clients.
+ *
+ * @param event  Sanitized event. Messages are numbered and recorded in the
+ *               history too.
+ */
+void DeliverRemoteEvent(const chat_event_t *event) {
+  chat_event_t local = *event;
+  int status = local.type == kEventMessage
+                   ? BroadcastMessage(&local, kInvalidHandle)
+                   : AnnouncePresence(&local, kInvalidHandle);
+  if (status < 0) {
+    PrintError("Failed to broadcast message: %s\n", strerror(errno));
+  }
+}
+
+/**
+ * @brief Tells how much of a buffer holds only whole UTF-8 characters.
+ *
+ * @param buf  Bytes to look at.
+ * @param len  Number of bytes in buf.
+ *
+ * @return Returns len, less the bytes of a character cut off at the end.
+ */
+static size_t CompleteUtf8Prefix(const uint8_t *buf, size_t len) {
+  size_t start = len;
+
+  while (start > 0 && len - start < 3 && (buf[start - 1] & 0xC0) == 0x80) {
+    start--;
+  }
+  if (start == 0) {
+    return len;
+  }
+
+  uint8_t lead = buf[start - 1];
+  size_t need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+  return len - (start - 1) < need ? start - 1 : len;
+}
+
+/**
+ * @brief Holds a stream's sender back while a recipient is far behind.
+ *
+ * Waits, for at most kStreamPaceLimitMs, until every recipient's outbox is
+ * less than half full, so a large message flows at the pace of its slowest
+ * reader instead of piling up in outboxes until they overflow.
+ *
+ * @param sender  Handle of the client streaming.
+ */
+static void PaceStream(client_handle_t sender) {
+  for (int waited = 0; waited < kStreamPaceLimitMs; waited += kStreamPaceMs) {
+    bool behind = false;
+
+    EpochEnter();
+    membership_t *snapshot = atomic_load(&pool.members);
+    for (size_t i = 0; snapshot && i < snapshot->len && !behind; i++) {
+      client_t *client = snapshot->members[i];
+      behind = atomic_load(&client->protocol) != kProtocolPending &&
+               atomic_load(&client->handle) != sender &&
+               OutboxBacklog(&client->outbox) > kOutboxBytes / 2;
+    }
+    EpochExit();
+
+    if (!behind) {
+      return;
+    }
+    usleep(kStreamPaceMs * 1000);
+  }
+}
+
+/**
+ * @brief Tells everyone that a client's stream was cut short.
+ *
+ * @param cli  Client whose stream is aborted.
+ *
+ * @return Returns 0 on success, or -1 if the event could not be broadcast.
+ */
+static int AbortStream(client_t *cli) {
+  chat_event_t event = {.type = kEventChunk,
+                        .name = cli->name,
+                        .body = "",
+                        .body_len = 0,
+                        .stream = cli->stream,
+                        .chunk_flags = kChunkFinal | kChunkAbort};
+  return BroadcastEvent(&event, cli->handle);
+}
+
+/**
+ * @brief Relays one chunk of a large message as soon as it arrives.
+ *
+ * The first chunk from a client opens a stream. Chunks are sanitized
+ * keeping line breaks; a character cut off at the end of a chunk is held
+ * back and sent with the next one. Only the chunk at hand is ever held, so
+ * memory use does not depend on the size of the message. A stream growing
+ * past the -m limit is aborted, and its remaining chunks are ignored.
+ * Streamed messages are not numbered, recorded in the history or relayed to
+ * linked servers.
+ *
+ * @param cli    Sender.
+ * @param data   Chunk data, at most kChunkLimit bytes.
+ * @param len    Length of the chunk data.
+ * @param final  Whether this chunk ends the stream.
+ *
+ * @return Returns 0 on success, or -1 if the chunk could not be broadcast.
+ */
+int PostChunk(client_t *cli, const uint8_t *data, size_t len, bool final) {
+  uint8_t raw[sizeof(cli->carry) + kChunkLimit];
+  char body[kChunkLimit + 1];
+  int status = 0;
+
+  if (cli->stream == 0) {
+    cli->stream = atomic_fetch_add(&next_stream, 1);
+    cli->stream_len = 0;
+    cli->carry_len = 0;
+    printf("%s is streaming a large message\n", cli->name);
+    if (IsSlotMuted(HandleIndex(cli->handle))) {
+      // Ignore the rest of the stream as if it were too large
+      SendNotice(cli, "Message not sent: you are muted");
+      cli->stream_len = stream_limit + 1;
+    }
+  }
+
+  bool dropped = cli->stream_len > stream_limit;
+  cli->stream_len += len;
+  if (!dropped && cli->stream_len > stream_limit) {
+    char notice[64];
+    snprintf(notice, sizeof(notice), "Message too large (limit %zu MB)",
+             stream_limit >> 20);
+    SendNotice(cli, notice);
+    status = AbortStream(cli);
+  } else if (!dropped) {
+    size_t total = cli->carry_len + len;
+    memcpy(raw, cli->carry, cli->carry_len);
+    memcpy(raw + cli->carry_len, data, len);
+    size_t complete = final ? total : CompleteUtf8Prefix(raw, total);
+    cli->carry_len = total - complete;
+    memcpy(cli->carry, raw + complete, cli->carry_len);
+
+    chat_event_t event = {.type = kEventChunk,
+                          .name = cli->name,
+                          .body = body,
+                          .body_len = SanitizeBlock(raw, complete, body,
+                                                    sizeof(body)),
+                          .stream = cli->stream,
+                          .chunk_flags = final ? kChunkFinal : 0};
+    if (event.body_len > 0 || final) {
+      const char *reason = FilterChunk(cli->handle, cli->name, cli->stream,
+                                       body, event.body_len);
+      if (reason) {
+        RejectMessage(cli->handle, reason);
+        // Ignore the rest of the stream as if it were too large
+        cli->stream_len = stream_limit + 1;
+        status = AbortStream(cli);
+      } else {
+        PaceStream(cli->handle);
+        status = BroadcastEvent(&event, cli->handle);
+      }
+    }
+  }
+
+  if (final) {
+    cli->stream = 0;
+  }
+  if (status < 0) {
+    PrintError("Failed to broadcast message: %s\n", strerror(errno));
+  }
+  return status;
+}
+
+/**
+ * @brief Serves a telnet client until it leaves.
+ *
+ * A line too long for one message is streamed in chunks, unless it is a
+ * command, which is refused and the rest of it discarded.
+ *
+ * @param cli  Client to serve.
+ * @param in   Input buffer, possibly holding bytes left from the name.
+ * @param len  Number of bytes buffered in in.
+ * @param cap  Size of the input buffer.
+ */
+static void ServeTextClient(client_t *cli, uint8_t *in, size_t len,
+                            size_t cap) {
+  char msg[kMessageCharLimit];
+  ssize_t msg_len;
+  bool more;
+  bool skipping = false;
+
+  while ((msg_len = ReceiveLine(cli, in, &len, cap, msg, kMessageCharLimit,
+                                &more)) >= 0) {
+    int status = 0;
+    if (skipping || (more && !cli->stream && msg[0] == '/')) {
+      // Never stream a command, or a long /msg would reach the whole room
+      if (!skipping) {
+        SendNotice(cli, kLongCommandNotice);
+      }
+      skipping = more;
+    } else if (more || cli->stream) {
+      status = PostChunk(cli, (const uint8_t *)msg, (size_t)msg_len, !more);
+    } else {
+      status = HandleTextLine(cli, msg);
+    }
+    if (status < 0) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Handles one frame received from a binary client.
+ *
+ * @param cli    Sender.
+ * @param frame  Received frame.
+ *
+ * @return Returns 0 to keep serving the client, or -1 to disconnect it.
+ */
+static int HandleFrame(client_t *cli, const frame_t *frame) {
+  switch (frame->type) {
+    case kFrameMessage: {
+      char body[kMessageCharLimit];
+      size_t body_len = SanitizeText(frame->payload, frame->len, body,
+                                     kMessageCharLimit);
+      printf("%s sent a message: %s\n", cli->name, body);
+      return PostMessage(cli, body, body_len);
+    }
+    case kFrameDirect: {
+      const uint8_t *target;
+      size_t target_len;
+      ssize_t consumed = ParseString(frame->payload, frame->len, &target,
+                                     &target_len);
+      if (consumed < 0 || target_len >= kNameCharLimit) {
+        SendNotice(cli, "Malformed direct message");
+        return 0;
+      }
+      char name[kNameCharLimit];
+      char body[kMessageCharLimit];
+      SanitizeText(target, target_len, name, kNameCharLimit);
+      size_t body_len = SanitizeText(frame->payload + consumed,
+                                     frame->len - (size_t)consumed, body,
+                                     kMessageCharLimit);
+      DeliverDirect(cli, name, body, body_len);
+      return 0;
+    }
+    case kFrameHistory: {
+      uint64_t since_ms;
+      uint64_t until_ms = UINT64_MAX;
+      ssize_t consumed = DecodeVarint(frame->payload, frame->len, &since_ms);
+      if (consumed <= 0 ||
+          ((size_t)consumed < frame->len &&
+           DecodeVarint(frame->payload + consumed,
+                        frame->len - (size_t)consumed, &until_ms) <= 0)) {
+        SendNotice(cli, "Malformed history request");
+        return 0;
+      }
+      return SendLogRange(cli, since_ms, until_ms);
+    }
+    case kFrameAck: {
+      uint64_t seq;
+      if (DecodeVarint(frame->payload, frame->len, &seq) <= 0) {
+        return 0;
+      }
+      uint64_t acked = atomic_load(&cli->acked);
+      while (seq > acked &&
+             !atomic_compare_exchange_weak(&cli->acked, &acked, seq)) {
+      }
+      return 0;
+    }
+    case kFrameLeave:
+      cli->leaving = true;
+      return -1;
+    case kFramePong:
+      ReceivePong(cli, frame->payload, frame->len);
+      return 0;
+    case kFrameMention: {
+      char keyword[kKeywordLimit + 1];
+      if (frame->len < 2 || frame->len - 1 > kKeywordLimit) {
+        SendNotice(cli, "Malformed keyword watch");
+        return 0;
+      }
+      SanitizeText(frame->payload + 1, frame->len - 1, keyword,
+                   sizeof(keyword));
+      ChangeWatch(cli, keyword, frame->payload[0] != 0);
+      return 0;
+    }
+    case kFrameChunk:
+      if (frame->len == 0 || frame->len - 1 > kChunkLimit) {
+        SendNotice(cli, "Malformed chunk");
+        return 0;
+      }
+      return PostChunk(cli, frame->payload + 1, frame->len - 1,
+                       frame->payload[0] & kChunkFinal);
+    case kFramePing: {
+      uint8_t pong[kFrameHeaderLen + frame->len];
+      size_t pong_len = EncodeFrame(kFramePong, NULL, frame->payload,
+                                    frame->len, pong, sizeof(pong));
+      return SendToClient(cli, kLaneControl, pong, pong_len) < 0 ? -1 : 0;
+    }
+    default:
+      // Unknown and not yet used frames are ignored for forward compatibility
+      return 0;
+  }
+}
+
+/**
+ * @brief Serves a binary protocol client until it disconnects.
+ *
+ * @param cli  Client to serve.
+ * @param in   Input buffer, possibly holding frames left from the handshake.
+ * @param len  Number of bytes buffered in in.
+ * @param cap  Size of the input buffer.
+ */
+static void ServeBinaryClient(client_t *cli, uint8_t *in, size_t len,
+                              size_t cap) {
+  size_t max_payload = kMaxVarintLen + kNameCharLimit + kMessageCharLimit;
+
+  while (1) {
+    size_t off = 0;
+    frame_t frame;
+    ssize_t frame_len;
+
+    while ((frame_len = ParseFrame(in + off, len - off, max_payload,
+                                   &frame)) > 0) {
+      if (HandleFrame(cli, &frame) < 0) {
+        return;
+      }
+      off += (size_t)frame_len;
+    }
+    if (frame_len < 0) {
+      SendNotice(cli, "Malformed frame");
+      return;
+    }
+
+    memmove(in, in + off, len - off);
+    len -= off;
+
+    if (ReceiveInput(cli, in, &len, cap) <= 0) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Queues bytes on a client's outbox as one item.
+ *
+ * The caller must hold the client's send mutex. A client whose outbox is
+ * full has fallen too far behind to catch up; rather than hold up its
+ * senders, its socket is shut down and its own thread removes it.
+ *
+ * @param cli     Recipient.
+ * @param lane    Lane to queue on.
+ * @param iov     Buffers to send back to back.
+ * @param iovcnt  Number of buffers.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int QueueToClient(client_t *cli, outbox_lane_t lane,
+                         const struct iovec *iov, int iovcnt) {
+  if (PostOutbox(&cli->outbox, lane, iov, iovcnt) == 0) {
+    return 0;
+  }
+  if (errno == ENOBUFS) {
+    PrintError("Client fell too far behind: %s\n", cli->name);
+    shutdown(cli->connfd, SHUT_RDWR);
+    errno = EPIPE;
+  }
+  return -1;
+}
+
+/**
+ * @brief Sends the most recent messages to a client that just joined.
+ *
+ * Sealed history blocks are sent exactly as they were encoded when sealed;
+ * binary clients that negotiated compression get the block's COMPRESSED
+ * frame. Clients tracking sequence numbers only get the messages after the
+ * one they resume from, and a notice when that point is from an earlier run
+ * of the server or messages after it have aged out. The history is captured
+ * and the client stops being pending under the room mutex and its send
+ * mutex, so every message is either replayed or broadcast to it, and live
+ * broadcasts queue up behind the replay. The replay goes on the data lane,
+ * so control frames overtake it.
+ *
+ * @param cli       Client that joined.
+ * @param protocol  Protocol the client speaks.
+ *
+ * @return Returns 0 on success, or -1 if sending failed.
+ */
+static int ReplayHistory(client_t *cli, protocol_t protocol) {
+  history_replay_t replay;
+  history_encoding_t encoding = kHistoryText;
+  bool compressed = false;
+  int status = 0;
+
+  if (protocol == kProtocolBinary) {
+    encoding = cli->features & kFeatureSequence ? kHistorySequenced
+                                                : kHistoryFrames;
+    compressed = cli->features & kFeatureCompression;
+  }
+
+  pthread_mutex_lock(&room_mutex);
+  pthread_mutex_lock(&cli->send_mutex);
+
+  int captured = CaptureHistory(&history, encoding, cli->resume_seq, &replay);
+  atomic_store(&cli->protocol, protocol);
+  pthread_mutex_unlock(&room_mutex);
+  if (captured < 0) {
+    pthread_mutex_unlock(&cli->send_mutex);
+    return 0;
+  }
+
+  for (size_t i = 0; i <= replay.nblocks && status == 0; i++) {
+    const history_block_t *block = replay.blocks[i];
+    const uint8_t *buf;
+    size_t len;
+
+    if (i == replay.nblocks) {
+      buf = replay.tail;
+      len = replay.tail_len;
+    } else if (i == 0 && replay.skip > 0) {
+      // Resuming partway through a block; send the part the client lacks
+      buf = block->encoded[encoding] + replay.skip;
+      len = block->encoded_len[encoding] - replay.skip;
+    } else if (compressed && block->compressed[encoding]) {
+      buf = block->compressed[encoding];
+      len = block->compressed_len[encoding];
+    } else {
+      buf = block->encoded[encoding];
+      len = block->encoded_len[encoding];
+    }
+
+    if (len == 0) {
+      continue;
+    }
+    uint8_t header[kWebSocketMaxHeaderLen];
+    struct iovec iov[2];
+    int iovcnt = 0;
+    if (protocol == kProtocolWebSocket) {
+      iov[iovcnt++] = (struct iovec){
+          .iov_base = header,
+          .iov_len = EncodeWebSocketHeader(kWebSocketText, len, header)};
+    }
+    iov[iovcnt++] = (struct iovec){.iov_base = (void *)buf, .iov_len = len};
+    status = QueueToClient(cli, kLaneData, iov, iovcnt);
+  }
+
+  pthread_mutex_unlock(&cli->send_mutex);
+  if (replay.stale) {
+    SendNotice(cli, "The server restarted since you were last here");
+  } else if (replay.missed > 0) {
+    char notice[128];
+    snprintf(notice, sizeof(notice),
+             "%" PRIu64 " messages you missed are no longer in the history",
+             replay.missed);
+    SendNotice(cli, notice);
+  }
+  ReleaseHistory(&replay);
+
+  return status;
+}
+
+/**
+ * @brief Handles client communications in a dedicated thread.
+ *
+ * Detects the client's protocol from its listener and first byte, receives
+ * its name, replays recent history and broadcasts their joining message, then
+ * serves the client until it leaves. Broadcasts the leaving message, then
+ * cleans up and removes the client.
+ *
+ * A client with a resumable session whose connection drops keeps its slot
+ * while the session is held. If it reconnects in time, neither its leaving
+ * nor its joining again is broadcast. Since the previous connection then goes
+ * quietly, a client that took a session over always leaves through the
+ * leaving path, even if its handshake or replay fails.
+ *
+ * @param arg Pointer to the client to serve.
+ *
+ * @return Returns NULL after handling client disconnection and cleaning up.
+ */
+void *HandleClient(void *arg) {
+  client_t *cli = (client_t *)arg;
+  size_t in_cap = 2 * (kFrameHeaderLen + kMaxVarintLen + kNameCharLimit +
+                       kMessageCharLimit);
+  uint8_t in[in_cap];
+  size_t in_len = 0;
+  uint8_t first;
+  protocol_t protocol;
+  chat_event_t event = {.type = kEventJoin, .name = cli->name};
+
+  if (StartOutbox(&cli->outbox) < 0) {
+    PrintError("Failed to start client writer\n");
+    goto close_connection;
+  }
+
+  if (recv(cli->connfd, &first, 1, MSG_PEEK) <= 0) {
+    PrintError("Failed to receive client name: %s\n", strerror(errno));
+    goto close_connection;
+  }
+
+  if (cli->transport == kTransportWebSocket) {
+    protocol = kProtocolWebSocket;
+  } else {
+    protocol = first == '\0' ? kProtocolBinary : kProtocolText;
+  }
+
+  if (protocol == kProtocolWebSocket) {
+    if (AcceptWebSocket(cli, in, &in_len, in_cap) < 0) {
+      goto close_connection;
+    }
+  } else if (protocol == kProtocolBinary) {
+    if (ReceiveHello(cli, in, &in_len, in_cap) < 0) {
+      // Its previous connection went quietly, so the leave is up to us
+      if (cli->resumed) {
+        goto leave_chat;
+      }
+      goto close_connection;
+    }
+  } else if (ReceiveTextName(cli, in, &in_len, in_cap) < 0) {
+    goto close_connection;
+  }
+  if (IsBannedName(cli->name)) {
+    printf("Rejected banned client: %s\n", cli->name);
+    // Tell it in its own protocol, though it joins no further
+    atomic_store(&cli->protocol, protocol);
+    SendNotice(cli, "You are banned from this chat");
+    if (cli->resumed) {
+      // Banned just after taking its session over; close it as for a kick
+      atomic_store(&cli->kicked, true);
+      goto leave_chat;
+    }
+    goto close_connection;
+  }
+  if (ReplayHistory(cli, protocol) < 0) {
+    if (cli->resumed) {
+      goto leave_chat;
+    }
+    goto close_connection;
+  }
+
+  if (cli->resumed) {
+    printf("Client resumed its session: %s\n", cli->name);
+    goto serve_client;
+  }
+
+  // Broadcast welcome message
+  printf("Client joined the chat: %s\n", cli->name);
+  AddRoomMember(kDefaultRoom);
+  RelayEvent(&event);
+  if (AnnouncePresence(&event, cli->handle) < 0) {
+    PrintError("Failed to broadcast message: %s\n", strerror(errno));
+    goto leave_chat;
+  }
+
+serve_client:
+  SetSlotMuted(HandleIndex(cli->handle), IsMutedName(cli->name));
+  if (WatchName(cli->handle, cli->name) < 0) {
+    PrintError("Failed to watch mentions of %s\n", cli->name);
+  }
+  if (protocol != kProtocolText) {
+    // Telnet users cannot answer pings
+    WatchClient(cli);
+  }
+  if (protocol == kProtocolWebSocket) {
+    ServeWebSocketClient(cli, in, in_len, in_cap);
+  } else if (protocol == kProtocolBinary) {
+    ServeBinaryClient(cli, in, in_len, in_cap);
+  } else {
+    ServeTextClient(cli, in, in_len, in_cap);
+  }
+
+leave_chat:
+  UnwatchClient(cli);
+  if (cli->stream && cli->stream_len <= stream_limit && AbortStream(cli) < 0) {
+    PrintError("Failed to broadcast message: %s\n", strerror(errno));
+  }
+  cli->stream = 0;
+  if (cli->session) {
+    // Hold the session without sending to the dropped connection
+    atomic_store(&cli->protocol, kProtocolPending);
+    bool resumed = ReleaseSession(cli->session, cli->handle,
+                                  cli->leaving || atomic_load(&cli->kicked)
+                                      ? 0
+                                      : kSessionGraceMs);
+    cli->session = 0;
+    if (resumed) {
+      goto close_connection;
+    }
+  }
+
+  printf("Client left the chat: %s\n", cli->name);
+  event.type = kEventLeave;
+  RelayEvent(&event);
+  RemoveRoomMember(kDefaultRoom);
+  if (AnnouncePresence(&event, cli->handle) < 0) {
+    PrintError("Failed to broadcast message: %s\n", strerror(errno));
+  }
+
+close_connection:
+  ForgetWatcher(cli->handle);
+  if (cli->session) {
+    ReleaseSession(cli->session, cli->handle, 0);
+  }
+  StopOutbox(&cli->outbox);
+  RemoveClient(cli->handle);
+  pthread_detach(pthread_self());
+
+  return NULL;
+}
+
+/**
+ * @brief Queues raw bytes for a client's writer thread.
+ *
+ * Senders never wait for the client's socket. Control traffic such as
+ * notices and pongs goes on the control lane and overtakes queued chat and
+ * history on the data lane.
+ *
+ * @param cli   Recipient.
+ * @param lane  Lane to queue on.
+ * @param buf   Bytes to send.
+ * @param len   Number of bytes to send.
+ *
+ * @return Returns 0 if the bytes were queued, or -1 on error.
+ */
+int SendToClient(client_t *cli, outbox_lane_t lane, const void *buf,
+                 size_t len) {
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+
+  pthread_mutex_lock(&cli->send_mutex);
+  int status = QueueToClient(cli, lane, &iov, 1);
+  pthread_mutex_unlock(&cli->send_mutex);
+
+  return status;
+}
+
+/**
+ * @brief Picks the outbox lane an event is sent on.
+ */
+static outbox_lane_t EventLane(const chat_event_t *event) {
+  return event->type == kEventNotice ? kLaneControl : kLaneData;
+}
+
+/**
+ * @brief Encodes an event in a client's protocol and sends it.
+ *
+ * @param cli    Recipient.
+ * @param event  Event to send.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+int SendEvent(client_t *cli, const chat_event_t *event) {
+  size_t cap = kEventBufferSize;
+  uint8_t buf[cap];
+  size_t len;
+
+  switch (atomic_load(&cli->protocol)) {
+    case kProtocolBinary:
+      len = EncodeBinaryEvent(event, cli->features, buf, cap);
+      break;
+    case kProtocolWebSocket:
+      len = EncodeWebSocketEvent(event, buf, cap);
+      break;
+    default:
+      len = EncodeTextEvent(event, (char *)buf, cap);
+      break;
+  }
+  // Some events have nothing to show in some encodings
+  if (len == 0) {
+    return 0;
+  }
+  return SendToClient(cli, EventLane(event), buf, len);
+}
+
+/**
+ * @brief Finds a connected client by name.
+ *
+ * The caller must be inside an epoch critical section for as long as it uses
+ * the result.
+ *
+ * @param name  Name to look for.
+ *
+ * @return Returns the first client with that name, or NULL if none is
+ *         connected.
+ */
+client_t *FindClientByName(const char *name) {
+  membership_t *snapshot = atomic_load(&pool.members);
+
+  for (size_t i = 0; snapshot && i < snapshot->len; i++) {
+    client_t *client = snapshot->members[i];
+
+    if (atomic_load(&client->protocol) != kProtocolPending &&
+        strncmp(client->name, name, kNameCharLimit) == 0) {
+      return client;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Delivers an event to some of the clients in the pool.
+ *
+ * Iterates the current membership snapshot without taking any lock. The epoch
+ * critical section guarantees that the snapshot and every client in it stay
+ * allocated until it ends, even if membership changes concurrently. The event
+ * is encoded at most once per protocol, the first time a recipient speaking
+ * that protocol is found, and the encoded bytes are shared by all recipients
+ * speaking it. Binary clients get the event with or without the one feature
+ * that changes its encoding, if any. Unless it is a digest, the encoding
+ * with every feature is also published to the shared-memory ring for local
+ * bots.
+ *
+ * @param event     The event to deliver.
+ * @param sender    Handle of the sending client, which is left out.
+ * @param audience  Clients to deliver to.
+ *
+ * @return Returns 0 if the event was successfully sent to all recipients, or
+ *         -1 if an error occurred during sending.
+ */
+static int DeliverEvent(const chat_event_t *event, client_handle_t sender,
+                        audience_t audience) {
+  size_t cap = kEventBufferSize;
+  char text[cap];
+  uint8_t binary[cap];
+  uint8_t featured[cap];
+  uint8_t websocket[cap];
+  size_t text_len = 0;
+  size_t binary_len = 0;
+  size_t websocket_len = 0;
+  int status = 0;
+
+  // Bots on this host read every broadcast from the ring, binary-encoded
+  uint64_t feature = EventFeature(event);
+  size_t featured_len =
+      EncodeBinaryEvent(event, kSupportedFeatures, featured, cap);
+  if (audience != kAudienceDigest && featured_len > 0) {
+    PublishRing(featured, featured_len);
+  }
+
+  EpochEnter();
+
+  membership_t *snapshot = atomic_load(&pool.members);
+  for (size_t i = 0; snapshot && i < snapshot->len; i++) {
+    client_t *client = snapshot->members[i];
+    protocol_t protocol = atomic_load(&client->protocol);
+    const void *buf;
+    size_t len;
+
+    if (protocol == kProtocolPending ||
+        atomic_load(&client->handle) == sender) {
+      continue;
+    }
+    if (audience != kAudienceAll) {
+      bool presence = protocol == kProtocolBinary &&
+                      (client->features & kFeaturePresence);
+      if (presence != (audience == kAudiencePresence)) {
+        continue;
+      }
+    }
+
+    if (protocol == kProtocolBinary &&
+        (client->features & feature) == feature) {
+      buf = featured;
+      len = featured_len;
+    } else if (protocol == kProtocolBinary) {
+      if (!binary_len) {
+        binary_len = EncodeBinaryEvent(event, 0, binary, cap);
+      }
+      buf = binary;
+      len = binary_len;
+    } else if (protocol == kProtocolWebSocket) {
+      if (!websocket_len) {
+        websocket_len = EncodeWebSocketEvent(event, websocket, cap);
+      }
+      buf = websocket;
+      len = websocket_len;
+    } else {
+      if (!text_len) {
+        text_len = EncodeTextEvent(event, text, cap);
+      }
+      buf = text;
+      len = text_len;
+    }
+
+    // Some events have nothing to show in some encodings
+    if (len == 0) {
+      continue;
+    }
+    // A recipient that is going away is its own thread's concern
+    if (SendToClient(client, EventLane(event), buf, len) < 0 &&
+        errno != EPIPE && errno != ECONNRESET) {
+      status = -1;
+      break;
+    }
+  }
+
+  EpochExit();
+
+  return status;
+}
+
+/**
+ * @brief Broadcasts an event to all clients in the pool except the sender.
+ *
+ * @param event   The event to broadcast.
+ * @param sender  Handle of the sending client.
+ *
+ * @return Returns 0 if the event was successfully sent to all other clients,
+ *         or -1 if an error occurred during sending.
+ */
+int BroadcastEvent(const chat_event_t *event, client_handle_t sender) {
+  return DeliverEvent(event, sender, kAudienceAll);
+}
+
+/**
+ * @brief Broadcasts a join or leave, or counts it towards the next digest.
+ *
+ * In rooms up to the digest size every client is told. In larger rooms only
+ * clients subscribed to presence are, and the rest get a periodic digest
+ * instead, so a burst of reconnects costs one send per client per interval
+ * rather than one per reconnect. Plugins are told of every join and leave.
+ *
+ * @param event   Join or leave event.
+ * @param sender  Handle of the client joining or leaving.
+ *
+ * @return Returns 0 on success, or -1 if an error occurred during sending.
+ */
+int AnnouncePresence(const chat_event_t *event, client_handle_t sender) {
+  int status;
+
+  if (atomic_load(&pool.len) <= digest.room_size) {
+    status = DeliverEvent(event, sender, kAudienceAll);
+  } else {
+    pthread_mutex_lock(&digest.mutex);
+    if (event->type == kEventJoin) {
+      digest.joined++;
+    } else {
+      digest.left++;
+    }
+    pthread_mutex_unlock(&digest.mutex);
+
+    status = DeliverEvent(event, sender, kAudiencePresence);
+  }
+
+  // Ordered with the messages plugins are told of
+  pthread_mutex_lock(&room_mutex);
+  NotifyPlugins(event);
+  pthread_mutex_unlock(&room_mutex);
+  return status;
+}
+
+/**
+ * @brief Sends the joins and leaves counted in large rooms as digests.
+ *
+ * Runs in its own thread. Every kDigestIntervalMs, clients not subscribed to
+ * presence get one notice such as "37 users joined, 2 users left" covering
+ * the joins and leaves counted since the previous digest.
+ *
+ * @param arg  Unused.
+ *
+ * @return Never returns.
+ */
+void *DigestPresence(void *arg) {
+  (void)arg;
+
+  while (1) {
+    usleep(kDigestIntervalMs * 1000);
+
+    pthread_mutex_lock(&digest.mutex);
+    size_t joined = digest.joined;
+    size_t left = digest.left;
+    digest.joined = 0;
+    digest.left = 0;
+    pthread_mutex_unlock(&digest.mutex);
+
+    if (joined == 0 && left == 0) {
+      continue;
+    }
+
+    char body[96];
+    int len = 0;
+    if (joined > 0) {
+      len = snprintf(body, sizeof(body), "%zu %s joined", joined,
+                     joined == 1 ? "user" : "users");
+    }
+    if (left > 0) {
+      len += snprintf(body + len, sizeof(body) - (size_t)len, "%s%zu %s left",
+                      joined > 0 ? ", " : "", left,
+                      left == 1 ? "user" : "users");
+    }
+
+    chat_event_t event = {.type = kEventNotice,
+                          .name = NULL,
+                          .body = body,
+                          .body_len = (size_t)len};
+    if (DeliverEvent(&event, kInvalidHandle, kAudienceDigest) < 0) {
+      PrintError("Failed to broadcast digest: %s\n", strerror(errno));
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Releases a retired client once no broadcast can reference it.
+ *
+ * @param arg  Pointer to the client to destroy.
+ */
+static void DestroyClient(void *arg) {
+  client_t *client = (client_t *)arg;
+
+  close(client->connfd);
+  DestroyOutbox(&client->outbox);
+  pthread_mutex_destroy(&client->send_mutex);
+  free(client);
+}
+
+/**
+ * @brief Removes a client from the client pool based on their handle.
+ *
+ * The slot is found directly from the handle and cleared with a
+ * compare-and-swap, so stale handles and repeated removals are ignored. A
+ * membership snapshot without the client is then published. The socket is
+ * shut down immediately, but the client itself is only retired; the epoch
+ * reclaimer closes and frees it once concurrent broadcasts are done.
+ *
+ * Only the thread serving a client removes it, so HandleClient may keep using
+ * its own client pointer without an epoch guard until this call.
+ *
+ * @param handle  Handle of the client to be removed.
+ */
+void RemoveClient(client_handle_t handle) {
+  EpochEnter();
+
+  client_t *client = LookupClient(handle);
+  if (client) {
+    client_slot_t *slot = &pool.slots[HandleIndex(handle)];
+    client_t *expected = client;
+
+    if (atomic_compare_exchange_strong(&slot->client, &expected, NULL)) {
+      atomic_fetch_sub(&pool.len, 1);
+      shutdown(client->connfd, SHUT_RDWR);
+    } else {
+      client = NULL;
+    }
+  }
+
+  EpochExit();
+
+  if (!client) {
+    return;
+  }
+
+  pthread_mutex_lock(&(pool.mutex));
+  membership_t *snapshot;
+  while (!(snapshot = BuildMembership(atomic_load(&pool.members), NULL,
+                                      client))) {
+    // The client cannot be retired while a snapshot still references it
+    PrintError("Failed to allocate membership snapshot. Retrying...\n");
+    usleep(1000);
+  }
+  PublishMembership(snapshot);
+  pthread_mutex_unlock(&(pool.mutex));
+
+  EpochRetire(&client->retire, client, &DestroyClient);
 }
 
 /**
  * @brief Displays usage information for the client-side program.
  */
 void PrintUsage(void) {
-  fprintf(stderr, "Usage: server [PORT]\n\n");
+  fprintf(stderr,
+          "Usage: server [-w WS_PORT] [-l LINK_PORT] [-L HOST:PORT]... "
+          "[-b PATH] [-s PATH] [-d SIZE] [-m MB]\n"
+          "              [-f FILE_PORT] [-a DIR] [-p PATH] [-F PATH] [-R RATE] "
+          "[-M PATH]\n"
+          "              [-P PATH]... [PORT]\n"
+          "       server -B PATH\n\n");
   fprintf(stderr, "Arguments:\n");
   fprintf(stderr, "  %-12s%s\n", "PORT",
           "Port number that the server will be listening to");
+  fprintf(stderr, "\nOptions:\n");
+  fprintf(stderr, "  %-12s%s\n", "-w WS_PORT",
+          "Also accept WebSocket clients on WS_PORT");
+  fprintf(stderr, "  %-12s%s\n", "-l LINK_PORT",
+          "Accept links from other servers on LINK_PORT");
+  fprintf(stderr, "  %-12s%s\n", "-L HOST:PORT",
+          "Link to the server at HOST:PORT (repeatable)");
+  fprintf(stderr, "  %-12s%s\n", "-b PATH",
+          "Publish to and subscribe from the broker at PATH");
+  fprintf(stderr, "  %-12s%s\n", "-B PATH",
+          "Run as a pub/sub broker listening on the Unix socket PATH");
+  fprintf(stderr, "  %-12s%s\n", "-s PATH",
+          "Share broadcasts with local bots through a ring at PATH");
+  fprintf(stderr, "  %-12s%s\n", "-d SIZE",
+          "Digest joins and leaves in rooms of more than SIZE clients "
+          "(default 5, below 10)");
+  fprintf(stderr, "  %-12s%s\n", "-m MB",
+          "Accept streamed messages of up to MB megabytes (default 1)");
+  fprintf(stderr, "  %-12s%s\n", "-f FILE_PORT",
+          "Accept attachment uploads and downloads on FILE_PORT");
+  fprintf(stderr, "  %-12s%s\n", "-a DIR",
+          "Keep attachments in DIR (default attachments)");
+  fprintf(stderr, "  %-12s%s\n", "-p PATH",
+          "Log messages to PATH and index them for /search");
+  fprintf(stderr, "  %-12s%s\n", "-F PATH",
+          "Mask the words listed in PATH, one per line");
+  fprintf(stderr, "  %-12s%s\n", "-R RATE",
+          "Accept up to RATE messages per second per client (default 10, "
+          "0 for no limit)");
+  fprintf(stderr, "  %-12s%s\n", "-M PATH",
+          "Let clients become moderators with the password in PATH");
+  fprintf(stderr, "  %-12s%s\n", "-P PATH",
+          "Load the plugin at PATH (repeatable)");
 }
 
 /**
@@ -0,0 +1,203 @@
+/**
+ * @file session.c
+ *
+ * @brief Resumable client sessions held for a grace period after a drop.
+ */
+
+#include "session.h"
+
+#include <sys/random.h>
+#include <time.h>
+
+#include "chatroom.h"
+
+// A parked client keeps its pool slot, so there are never more sessions than
+// clients; a session being taken over is shared by its old and new owner.
+#define kMaxSessions kMaxClients
+
+static struct {
+  uint64_t token;  // 0 if the entry is free
+  uint64_t owner;
+  char name[kNameCharLimit];
+} sessions[kMaxSessions];
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_cond;  // Signaled when a session changes owner
+static pthread_once_t sessions_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Initializes the condition variable on the monotonic clock.
+ */
+static void InitSessionCond(void) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sessions_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/**
+ * @brief Finds the session with the given token.
+ *
+ * Must be called with the sessions mutex held.
+ *
+ * @return Returns the index of the session, or -1 if there is none.
+ */
+static int FindSession(uint64_t token) {
+  for (int i = 0; token != 0 && i < kMaxSessions; i++) {
+    if (sessions[i].token == token) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Opens a session for a client that just joined.
+ *
+ * @param owner  Handle of the client.
+ * @param name   Name of the client, kept for whoever resumes the session.
+ *
+ * @return Returns the session token, or 0 if no session could be opened.
+ */
+uint64_t OpenSession(uint64_t owner, const char *name) {
+  uint64_t token;
+
+  if (getrandom(&token, sizeof(token), 0) != sizeof(token) || token == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&sessions_mutex);
+  int index = -1;
+  for (int i = 0; i < kMaxSessions && index < 0; i++) {
+    if (sessions[i].token == 0) {
+      index = i;
+    }
+  }
+  if (index >= 0) {
+    sessions[index].token = token;
+    sessions[index].owner = owner;
+    snprintf(sessions[index].name, kNameCharLimit, "%s", name);
+  }
+  pthread_mutex_unlock(&sessions_mutex);
+
+  return index >= 0 ? token : 0;
+}
+
+/**
+ * @brief Looks up the name of a session without taking it over.
+ *
+ * @param token     Token the client presented.
+ * @param name      Where the session's name is stored. Left alone if there
+ *                  is no such session.
+ * @param name_cap  Size of name.
+ *
+ * @return Returns 0 on success, or -1 if there is no such session.
+ */
+int GetSessionName(uint64_t token, char *name, size_t name_cap) {
+  pthread_mutex_lock(&sessions_mutex);
+  int index = FindSession(token);
+  if (index >= 0) {
+    snprintf(name, name_cap, "%s", sessions[index].name);
+  }
+  pthread_mutex_unlock(&sessions_mutex);
+
+  return index >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief Takes a session over for a reconnecting client.
+ *
+ * Wakes the previous owner if it is holding the session. If the previous
+ * owner has not noticed its connection drop yet, the caller should shut its
+ * socket down so it releases the session promptly.
+ *
+ * @param token     Token the client presented.
+ * @param owner     Handle of the reconnecting client.
+ * @param name      Where the session's name is stored.
+ * @param name_cap  Size of name.
+ * @param previous  Where the handle of the previous owner is stored.
+ *
+ * @return Returns 0 on success, or -1 if there is no such session.
+ */
+int ClaimSession(uint64_t token, uint64_t owner, char *name, size_t name_cap,
+                 uint64_t *previous) {
+  pthread_once(&sessions_once, &InitSessionCond);
+
+  pthread_mutex_lock(&sessions_mutex);
+  int index = FindSession(token);
+  if (index >= 0) {
+    *previous = sessions[index].owner;
+    sessions[index].owner = owner;
+    snprintf(name, name_cap, "%s", sessions[index].name);
+    pthread_cond_broadcast(&sessions_cond);
+  }
+  pthread_mutex_unlock(&sessions_mutex);
+
+  return index >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief Releases a session when its client's connection ends.
+ *
+ * Unless the session has been taken over already, waits up to grace_ms for a
+ * reconnecting client to take it over, and closes it if none does.
+ *
+ * @param token     Token of the session.
+ * @param owner     Handle of the client whose connection ended.
+ * @param grace_ms  How long to hold the session, or 0 to close it now.
+ *
+ * @return Returns true if another client took the session over, in which
+ *         case the caller must not announce that it left.
+ */
+bool ReleaseSession(uint64_t token, uint64_t owner, int grace_ms) {
+  struct timespec deadline;
+  bool resumed;
+
+  pthread_once(&sessions_once, &InitSessionCond);
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += grace_ms / 1000;
+  deadline.tv_nsec += (grace_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&sessions_mutex);
+  int index = FindSession(token);
+  // The session may be dropped while held, and its entry reused
+  while (index >= 0 && sessions[index].token == token &&
+         sessions[index].owner == owner && grace_ms > 0 &&
+         pthread_cond_timedwait(&sessions_cond, &sessions_mutex, &deadline) !=
+             ETIMEDOUT) {
+  }
+  if (index >= 0 && sessions[index].token != token) {
+    index = -1;
+  }
+  resumed = index >= 0 && sessions[index].owner != owner;
+  if (index >= 0 && !resumed) {
+    sessions[index].token = 0;
+  }
+  pthread_mutex_unlock(&sessions_mutex);
+
+  return resumed;
+}
+
+/**
+ * @brief Closes the sessions a client owns, so nobody can resume them.
+ *
+ * A client holding its session after a drop stops waiting and leaves.
+ *
+ * @param owner  Handle of the client, for instance one being kicked.
+ */
+void DropSessions(uint64_t owner) {
+  pthread_once(&sessions_once, &InitSessionCond);
+
+  pthread_mutex_lock(&sessions_mutex);
+  for (int i = 0; i < kMaxSessions; i++) {
+    if (sessions[i].token != 0 && sessions[i].owner == owner) {
+      sessions[i].token = 0;
+    }
+  }
+  pthread_cond_broadcast(&sessions_cond);
+  pthread_mutex_unlock(&sessions_mutex);
+}
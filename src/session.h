@@ -0,0 +1,29 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Resumable sessions of binary clients that negotiated kFeatureResume. The
+// server hands such a client a random token in its HELLO answer. When the
+// client's connection drops, its thread keeps the client's pool slot and
+// holds the session for kSessionGraceMs instead of announcing that it left.
+// A client reconnecting with the token within that time takes the session
+// over: it keeps its name, is replayed the messages it missed, and the room
+// sees neither a leave nor a join.
+//
+// A session is owned by the handle of the client currently attached to it.
+// Taking a session over changes its owner, which is how the previous owner
+// learns that it must go quietly.
+
+#define kSessionGraceMs 30000
+
+uint64_t OpenSession(uint64_t owner, const char *name);
+int GetSessionName(uint64_t token, char *name, size_t name_cap);
+int ClaimSession(uint64_t token, uint64_t owner, char *name, size_t name_cap,
+                 uint64_t *previous);
+bool ReleaseSession(uint64_t token, uint64_t owner, int grace_ms);
+void DropSessions(uint64_t owner);
+
+#endif  // SESSION_H_
@@ -0,0 +1,378 @@
+/**
+ * @file shm.c
+ *
+ * @brief Shared-memory broadcast ring for co-located consumers.
+ */
+
+#define _GNU_SOURCE
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kShmRingMask ((uint64_t)kShmRingBytes - 1)
+
+static shm_ring_t *ring;  // NULL unless CreateRing() succeeded
+static int ring_fd = -1;
+// The writer's position. Kept outside the ring so that a consumer scribbling
+// on its mapping cannot steer the server's writes.
+static uint64_t ring_head;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t AlignRecord(size_t len) {
+  return (len + kShmRecordAlign - 1) & ~(size_t)(kShmRecordAlign - 1);
+}
+
+static long Futex(_Atomic uint32_t *word, int op, uint32_t value,
+                  const struct timespec *timeout) {
+  return syscall(SYS_futex, (uint32_t *)word, op, value, timeout, NULL, 0);
+}
+
+/**
+ * @brief Creates the ring that broadcasts are published to.
+ *
+ * The memfd is sealed against resizing, so consumers cannot truncate it
+ * under the server.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+int CreateRing(void) {
+  size_t size = sizeof(shm_ring_t) + kShmRingBytes;
+
+  int fd = memfd_create("chatroom-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, (off_t)size) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  shm_ring_t *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd, 0);
+  if (mapped == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  mapped->magic = kShmRingMagic;
+  mapped->version = kShmRingVersion;
+  mapped->capacity = kShmRingBytes;
+  ring_fd = fd;
+  ring = mapped;
+
+  return 0;
+}
+
+/**
+ * @brief Listens for consumers on a Unix socket.
+ *
+ * @param path  Socket path. An existing socket file is replaced.
+ *
+ * @return Returns the listening socket, or -1 on error.
+ */
+int SetupRingSocket(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sockfd, SOMAXCONN) < 0) {
+    close(sockfd);
+    return -1;
+  }
+
+  return sockfd;
+}
+
+/**
+ * @brief Accepts a consumer and hands it the ring's memfd.
+ *
+ * @param sockfd  Socket returned by SetupRingSocket().
+ */
+void ShareRing(int sockfd) {
+  int fd = accept(sockfd, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+
+  char byte = 0;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control = {0};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &ring_fd, sizeof(int));
+
+  sendmsg(fd, &msg, MSG_NOSIGNAL);
+  close(fd);
+}
+
+/**
+ * @brief Publishes a frame to the ring.
+ *
+ * The claimed range is announced in reserve before any byte is written, so
+ * a consumer that copied a record can tell afterwards whether the writer
+ * got to it in the meantime. Consumers are only woken if one is waiting.
+ *
+ * @param frame  Encoded binary frame.
+ * @param len    Frame size.
+ */
+void PublishRing(const uint8_t *frame, size_t len) {
+  size_t need = AlignRecord(sizeof(shm_record_t) + len);
+
+  if (!ring || need > kShmRingBytes / 2) {
+    return;
+  }
+
+  pthread_mutex_lock(&ring_mutex);
+  size_t off = (size_t)(ring_head & kShmRingMask);
+  size_t pad = kShmRingBytes - off < need ? kShmRingBytes - off : 0;
+  uint64_t next = ring_head + pad + need;
+
+  atomic_store_explicit(&ring->reserve, next, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  if (pad) {
+    shm_record_t padding = {.len = 0};
+    memcpy(ring->data + off, &padding, sizeof(padding));
+    off = 0;
+  }
+  shm_record_t record = {.len = (uint32_t)len};
+  memcpy(ring->data + off, &record, sizeof(record));
+  memcpy(ring->data + off + sizeof(record), frame, len);
+
+  ring_head = next;
+  atomic_store_explicit(&ring->head, next, memory_order_release);
+  atomic_fetch_add(&ring->futex, 1);
+  bool wake = atomic_load(&ring->waiters) > 0;
+  pthread_mutex_unlock(&ring_mutex);
+
+  if (wake) {
+    Futex(&ring->futex, FUTEX_WAKE, INT_MAX, NULL);
+  }
+}
+
+/**
+ * @brief Maps the ring of a server.
+ *
+ * Reading starts at the newest record.
+ *
+ * @param path    Path of the server's ring socket.
+ * @param reader  Reader to initialize.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+int AttachRing(const char *path, shm_reader_t *reader) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int fd = -1;
+  int status = -1;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) {
+    return -1;
+  }
+  if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    goto close_socket;
+  }
+
+  char byte;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+    goto close_socket;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    errno = EPROTO;
+    goto close_socket;
+  }
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    goto close_fd;
+  }
+  if ((size_t)st.st_size < sizeof(shm_ring_t)) {
+    errno = EPROTO;
+    goto close_fd;
+  }
+
+  // Mapped writable so that consumers can register as futex waiters
+  shm_ring_t *mapped = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    goto close_fd;
+  }
+  if (mapped->magic != kShmRingMagic || mapped->version != kShmRingVersion ||
+      mapped->capacity != (size_t)st.st_size - sizeof(shm_ring_t) ||
+      (mapped->capacity & (mapped->capacity - 1)) != 0) {
+    munmap(mapped, (size_t)st.st_size);
+    errno = EPROTO;
+    goto close_fd;
+  }
+
+  reader->ring = mapped;
+  reader->size = (size_t)st.st_size;
+  reader->cursor = atomic_load_explicit(&mapped->head, memory_order_acquire);
+  reader->lost = 0;
+  status = 0;
+
+close_fd:
+  close(fd);
+close_socket:
+  close(sockfd);
+  return status;
+}
+
+/**
+ * @brief Sleeps until the ring moves past the reader's cursor.
+ *
+ * @return Returns 0 if the ring may have moved, or -1 on timeout.
+ */
+static int WaitRing(shm_reader_t *reader, int timeout_ms) {
+  shm_ring_t *shared = reader->ring;
+  struct timespec timeout = {.tv_sec = timeout_ms / 1000,
+                             .tv_nsec = timeout_ms % 1000 * 1000000L};
+  int status = 0;
+
+  // Registering before reading the futex word pairs with the writer bumping
+  // the word before checking for waiters, so a wake-up cannot be missed.
+  atomic_fetch_add(&shared->waiters, 1);
+  uint32_t seq = atomic_load(&shared->futex);
+  if (atomic_load(&shared->head) == reader->cursor &&
+      Futex(&shared->futex, FUTEX_WAIT, seq,
+            timeout_ms < 0 ? NULL : &timeout) < 0 &&
+      errno == ETIMEDOUT) {
+    status = -1;
+  }
+  atomic_fetch_sub(&shared->waiters, 1);
+
+  return status;
+}
+
+/**
+ * @brief Reads the next frame from the ring.
+ *
+ * A reader that fell behind by more than the ring's capacity skips to the
+ * newest record and adds the skipped bytes to lost.
+ *
+ * @param reader      Attached reader.
+ * @param out         Destination buffer.
+ * @param cap         Size of out.
+ * @param timeout_ms  How long to wait for a frame: 0 to poll, or negative to
+ *                    wait indefinitely.
+ *
+ * @return Returns the frame size, 0 if none arrived in time, or -1 on error.
+ *         A frame larger than cap is skipped and fails with EMSGSIZE.
+ */
+ssize_t ReadRing(shm_reader_t *reader, uint8_t *out, size_t cap,
+                 int timeout_ms) {
+  shm_ring_t *shared = reader->ring;
+  uint64_t capacity = shared->capacity;
+
+  while (1) {
+    uint64_t head = atomic_load_explicit(&shared->head, memory_order_acquire);
+    if (head == reader->cursor) {
+      if (timeout_ms == 0 || WaitRing(reader, timeout_ms) < 0) {
+        return 0;
+      }
+      continue;
+    }
+    if (head - reader->cursor > capacity) {
+      reader->lost += head - reader->cursor;
+      reader->cursor = head;
+      continue;
+    }
+
+    size_t off = (size_t)(reader->cursor & (capacity - 1));
+    shm_record_t record;
+    memcpy(&record, shared->data + off, sizeof(record));
+
+    size_t need = record.len == 0
+                      ? capacity - off
+                      : AlignRecord(sizeof(record) + record.len);
+    bool fits = need <= capacity - off && record.len <= cap;
+    if (fits && record.len > 0) {
+      memcpy(out, shared->data + off + sizeof(record), record.len);
+    }
+
+    // Anything copied is only valid if the writer has not claimed it since
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t reserve =
+        atomic_load_explicit(&shared->reserve, memory_order_relaxed);
+    if (reserve - reader->cursor > capacity) {
+      head = atomic_load_explicit(&shared->head, memory_order_acquire);
+      reader->lost += head - reader->cursor;
+      reader->cursor = head;
+      continue;
+    }
+
+    if (need > capacity - off) {
+      errno = EPROTO;
+      return -1;
+    }
+    reader->cursor += need;
+    if (record.len == 0) {
+      continue;
+    }
+    if (!fits) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    return (ssize_t)record.len;
+  }
+}
+
+/**
+ * @brief Unmaps a ring mapped with AttachRing().
+ */
+void DetachRing(shm_reader_t *reader) {
+  munmap(reader->ring, reader->size);
+  reader->ring = NULL;
+}
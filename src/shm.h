@@ -0,0 +1,68 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Shared-memory broadcast ring for bots running on the server's host. The
+// server writes every broadcast into a memfd once, as a binary protocol
+// frame encoded for kFeatureSequence; any number of consumers map the memfd
+// and read at their own pace without socket I/O. Consumers obtain the memfd
+// by connecting to a Unix socket, which passes it with SCM_RIGHTS and
+// closes.
+//
+// The ring never waits for consumers. A consumer that falls more than the
+// ring's capacity behind loses the overwritten records and resumes at the
+// newest one. Sleeping consumers wait on the futex word, which the server
+// only wakes while someone is waiting.
+//
+// Each record is an 8-byte header followed by one frame, padded to 8 bytes.
+// A header with length 0 pads the rest of the ring; the next record starts
+// at offset 0.
+
+#define kShmRingMagic 0x52535243u  // "CRSR"
+#define kShmRingVersion 1
+#define kShmRingBytes (4 * 1024 * 1024)  // Data area, a power of two
+#define kShmRecordAlign 8
+
+typedef struct {
+  uint32_t len;  // Frame length, or 0 for padding
+  uint32_t reserved;
+} shm_record_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  // Bytes the writer has claimed; records behind reserve - capacity may be
+  // being overwritten.
+  alignas(64) _Atomic uint64_t reserve;
+  _Atomic uint64_t head;     // Bytes published
+  _Atomic uint32_t futex;    // Bumped after every publish
+  _Atomic uint32_t waiters;  // Consumers blocked on futex
+  alignas(64) uint8_t data[];
+} shm_ring_t;
+
+typedef struct {
+  shm_ring_t *ring;
+  size_t size;      // Size of the mapping
+  uint64_t cursor;  // Position of the next record to read
+  uint64_t lost;    // Bytes skipped because the reader fell behind
+} shm_reader_t;
+
+// Server side
+int CreateRing(void);
+int SetupRingSocket(const char *path);
+void ShareRing(int sockfd);
+void PublishRing(const uint8_t *frame, size_t len);
+
+// Consumer side
+int AttachRing(const char *path, shm_reader_t *reader);
+ssize_t ReadRing(shm_reader_t *reader, uint8_t *out, size_t cap,
+                 int timeout_ms);
+void DetachRing(shm_reader_t *reader);
+
+#endif  // SHM_H_
@@ -0,0 +1,699 @@
+/**
+ * @file websocket.c
+ *
+ * @brief WebSocket handshake and framing for browser clients.
+ */
+
+#include "websocket.h"
+
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "chatroom.h"
+
+#define kSha1DigestLen 20
+#define kWebSocketKeyLimit 64
+#define kWebSocketControlLimit 125  // Largest control frame payload
+
+static const char *const kWebSocketGuid =
+    "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char *const kBase64Alphabet =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static uint32_t RotateLeft(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static void Sha1Block(uint32_t state[5], const uint8_t block[64]) {
+  uint32_t w[80];
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+           (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = RotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t temp = RotateLeft(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = RotateLeft(b, 30);
+    b = a;
+    a = temp;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+/**
+ * @brief Computes the SHA-1 digest required by the WebSocket handshake.
+ *
+ * @param data    Bytes to hash.
+ * @param len     Number of bytes in data.
+ * @param digest  Where the 20 byte digest is stored.
+ */
+static void Sha1(const uint8_t *data, size_t len,
+                 uint8_t digest[kSha1DigestLen]) {
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                       0xC3D2E1F0};
+  uint8_t block[64];
+  size_t off;
+
+  for (off = 0; off + 64 <= len; off += 64) {
+    Sha1Block(state, data + off);
+  }
+
+  size_t rest = len - off;
+  memset(block, 0, sizeof(block));
+  memcpy(block, data + off, rest);
+  block[rest] = 0x80;
+  if (rest >= 56) {
+    Sha1Block(state, block);
+    memset(block, 0, sizeof(block));
+  }
+  uint64_t bits = (uint64_t)len * 8;
+  for (int i = 0; i < 8; i++) {
+    block[63 - i] = (uint8_t)(bits >> (8 * i));
+  }
+  Sha1Block(state, block);
+
+  for (int i = 0; i < 5; i++) {
+    digest[4 * i] = (uint8_t)(state[i] >> 24);
+    digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+    digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+    digest[4 * i + 3] = (uint8_t)state[i];
+  }
+}
+
+/**
+ * @brief Encodes bytes as NUL-terminated base64.
+ *
+ * @param data  Bytes to encode.
+ * @param len   Number of bytes in data.
+ * @param out   Destination of at least 4 * ((len + 2) / 3) + 1 bytes.
+ */
+static void Base64Encode(const uint8_t *data, size_t len, char *out) {
+  size_t i;
+
+  for (i = 0; i + 3 <= len; i += 3) {
+    uint32_t v = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 |
+                 data[i + 2];
+    *out++ = kBase64Alphabet[(v >> 18) & 0x3F];
+    *out++ = kBase64Alphabet[(v >> 12) & 0x3F];
+    *out++ = kBase64Alphabet[(v >> 6) & 0x3F];
+    *out++ = kBase64Alphabet[v & 0x3F];
+  }
+  if (i < len) {
+    uint32_t v = (uint32_t)data[i] << 16;
+    if (i + 1 < len) {
+      v |= (uint32_t)data[i + 1] << 8;
+    }
+    *out++ = kBase64Alphabet[(v >> 18) & 0x3F];
+    *out++ = kBase64Alphabet[(v >> 12) & 0x3F];
+    *out++ = i + 1 < len ? kBase64Alphabet[(v >> 6) & 0x3F] : '=';
+    *out++ = '=';
+  }
+  *out = '\0';
+}
+
+/**
+ * @brief Unmasks a client-to-server payload in place.
+ *
+ * The 4 byte mask is repeated across a full vector register so that 16 bytes
+ * are unmasked per instruction; the tail falls back to 8 byte words and then
+ * single bytes. Every vector step is a multiple of 4 bytes, so the mask phase
+ * never shifts.
+ *
+ * @param data  Payload to unmask.
+ * @param len   Number of bytes in data.
+ * @param mask  Masking key from the frame header.
+ */
+void WebSocketUnmask(uint8_t *data, size_t len, const uint8_t mask[4]) {
+  size_t i = 0;
+  uint32_t mask32;
+
+  memcpy(&mask32, mask, sizeof(mask32));
+
+#ifdef __SSE2__
+  __m128i mask128 = _mm_set1_epi32((int)mask32);
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+    _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(chunk, mask128));
+  }
+#endif
+
+  uint64_t mask64 = (uint64_t)mask32 << 32 | mask32;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t chunk;
+    memcpy(&chunk, data + i, sizeof(chunk));
+    chunk ^= mask64;
+    memcpy(data + i, &chunk, sizeof(chunk));
+  }
+
+  for (; i < len; i++) {
+    data[i] ^= mask[i & 3];
+  }
+}
+
+/**
+ * @brief Parses the header of a client frame at the start of a buffer.
+ *
+ * @param buf    Received bytes.
+ * @param len    Number of bytes in buf.
+ * @param frame  Where the frame is described. Its payload points past the
+ *               header and is still masked; buf may not hold all of it yet.
+ *
+ * @return Returns the header length, masking key included, 0 if buf does
+ *         not yet hold the whole header, or -1 if the frame is unmasked or
+ *         a control frame is too large.
+ */
+ssize_t ParseWebSocketHeader(uint8_t *buf, size_t len,
+                             websocket_frame_t *frame) {
+  if (len < 2) {
+    return 0;
+  }
+
+  // Clients must mask every frame they send
+  if (!(buf[1] & 0x80)) {
+    return -1;
+  }
+
+  uint64_t payload_len = buf[1] & 0x7F;
+  size_t header_len = 2;
+  if (payload_len == 126) {
+    header_len += 2;
+    if (len < header_len) {
+      return 0;
+    }
+    payload_len = (uint64_t)buf[2] << 8 | buf[3];
+  } else if (payload_len == 127) {
+    header_len += 8;
+    if (len < header_len) {
+      return 0;
+    }
+    payload_len = 0;
+    for (int i = 0; i < 8; i++) {
+      payload_len = payload_len << 8 | buf[2 + i];
+    }
+  }
+
+  frame->fin = (buf[0] & 0x80) != 0;
+  frame->opcode = buf[0] & 0x0F;
+  if (frame->opcode >= kWebSocketClose &&
+      payload_len > kWebSocketControlLimit) {
+    return -1;
+  }
+
+  header_len += 4;
+  if (len < header_len) {
+    return 0;
+  }
+  frame->payload = buf + header_len;
+  frame->len = (size_t)payload_len;
+
+  return (ssize_t)header_len;
+}
+
+/**
+ * @brief Cuts the first bytes off a data frame's payload, unmasked.
+ *
+ * The rest of the payload stays a frame of its own: a continuation frame,
+ * final if the original was, whose header and rotated masking key are
+ * rewritten in place right before it.
+ *
+ * @param buf         Buffer starting with the frame.
+ * @param header_len  Length of the frame's header.
+ * @param frame       The frame, as parsed by ParseWebSocketHeader().
+ * @param take        Number of payload bytes to cut off, fewer than
+ *                    frame->len and all in buf.
+ * @param out         Where the unmasked bytes cut off are stored.
+ *
+ * @return Returns where the rest of the frame now starts in buf.
+ */
+static size_t SplitWebSocketFrame(uint8_t *buf, size_t header_len,
+                                  const websocket_frame_t *frame,
+                                  size_t take, uint8_t *out) {
+  uint8_t header[kWebSocketMaxHeaderLen];
+  const uint8_t *mask = buf + header_len - 4;
+
+  size_t len = EncodeWebSocketHeader(kWebSocketContinuation,
+                                     frame->len - take, header);
+  if (!frame->fin) {
+    header[0] &= 0x7F;
+  }
+  header[1] |= 0x80;
+  for (size_t i = 0; i < 4; i++) {
+    header[len + i] = mask[(take + i) & 3];
+  }
+  len += 4;
+
+  WebSocketUnmask(frame->payload, take, mask);
+  memcpy(out, frame->payload, take);
+  // A shorter payload never needs a longer header, so the rewritten header
+  // ends up where the cut-off part was
+  size_t start = header_len + take - len;
+  memcpy(buf + start, header, len);
+  return start;
+}
+
+/**
+ * @brief Writes an unmasked server frame header.
+ *
+ * @param opcode  Frame opcode.
+ * @param len     Payload length.
+ * @param out     Destination of at least kWebSocketMaxHeaderLen bytes.
+ *
+ * @return Returns the header length.
+ */
+size_t EncodeWebSocketHeader(uint8_t opcode, size_t len, uint8_t *out) {
+  out[0] = 0x80 | opcode;
+
+  if (len < 126) {
+    out[1] = (uint8_t)len;
+    return 2;
+  }
+  if (len <= 0xFFFF) {
+    out[1] = 126;
+    out[2] = (uint8_t)(len >> 8);
+    out[3] = (uint8_t)len;
+    return 4;
+  }
+  out[1] = 127;
+  for (int i = 0; i < 8; i++) {
+    out[2 + i] = (uint8_t)((uint64_t)len >> (8 * (7 - i)));
+  }
+  return 10;
+}
+
+/**
+ * @brief Encodes a complete server frame.
+ *
+ * @param opcode   Frame opcode.
+ * @param payload  Frame payload.
+ * @param len      Number of bytes in payload.
+ * @param out      Destination buffer.
+ * @param cap      Size of out.
+ *
+ * @return Returns the frame size, or 0 if it does not fit in out.
+ */
+size_t EncodeWebSocketFrame(uint8_t opcode, const void *payload, size_t len,
+                            uint8_t *out, size_t cap) {
+  uint8_t header[kWebSocketMaxHeaderLen];
+  size_t header_len = EncodeWebSocketHeader(opcode, len, header);
+
+  if (header_len + len > cap) {
+    return 0;
+  }
+  memcpy(out, header, header_len);
+  memcpy(out + header_len, payload, len);
+
+  return header_len + len;
+}
+
+/**
+ * @brief Encodes an event as a WebSocket text frame.
+ *
+ * The text rendering is written after room for the longest header and then
+ * moved down once its length, and thus the header size, is known.
+ *
+ * @param event  Event to encode.
+ * @param out    Destination buffer.
+ * @param cap    Size of out.
+ *
+ * @return Returns the frame size, or 0 if it does not fit in out.
+ */
+size_t EncodeWebSocketEvent(const chat_event_t *event, uint8_t *out,
+                            size_t cap) {
+  if (cap <= kWebSocketMaxHeaderLen) {
+    return 0;
+  }
+
+  char *text = (char *)out + kWebSocketMaxHeaderLen;
+  size_t len = EncodeTextEvent(event, text, cap - kWebSocketMaxHeaderLen);
+  if (len == 0) {
+    return 0;
+  }
+
+  uint8_t header[kWebSocketMaxHeaderLen];
+  size_t header_len = EncodeWebSocketHeader(kWebSocketText, len, header);
+  memmove(out + header_len, text, len);
+  memcpy(out, header, header_len);
+
+  return header_len + len;
+}
+
+/**
+ * @brief Finds a header value in an HTTP request.
+ *
+ * @param request  NUL-terminated request head.
+ * @param name     Header name, matched case-insensitively.
+ * @param value    Where the trimmed value is copied.
+ * @param cap      Size of value.
+ *
+ * @return Returns 0 if the header was found, or -1 otherwise.
+ */
+int FindHttpHeader(const char *request, const char *name, char *value,
+                   size_t cap) {
+  size_t name_len = strlen(name);
+
+  for (const char *line = strstr(request, "\r\n"); line;
+       line = strstr(line, "\r\n")) {
+    line += 2;
+    if (strncasecmp(line, name, name_len) != 0 || line[name_len] != ':') {
+      continue;
+    }
+
+    const char *start = line + name_len + 1;
+    while (*start == ' ' || *start == '\t') {
+      start++;
+    }
+    const char *end = strstr(start, "\r\n");
+    if (!end) {
+      return -1;
+    }
+    while (end > start && isspace((unsigned char)end[-1])) {
+      end--;
+    }
+    if ((size_t)(end - start) >= cap) {
+      return -1;
+    }
+    memcpy(value, start, end - start);
+    value[end - start] = '\0';
+    return 0;
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Completes the HTTP upgrade handshake.
+ *
+ * @param cli  Client connecting through the WebSocket listener.
+ * @param in   Input buffer. Bytes received after the request head are left at
+ *             its start.
+ * @param len  Number of bytes buffered in in, updated on return.
+ * @param cap  Size of the input buffer.
+ *
+ * @return Returns 0 on success, or -1 if the request is not a valid upgrade.
+ */
+static int UpgradeConnection(client_t *cli, uint8_t *in, size_t *len,
+                             size_t cap) {
+  char request[kWebSocketHandshakeLimit + 1];
+  char *head_end;
+
+  if (cap > kWebSocketHandshakeLimit) {
+    cap = kWebSocketHandshakeLimit;
+  }
+  while (1) {
+    memcpy(request, in, *len);
+    request[*len] = '\0';
+    if ((head_end = strstr(request, "\r\n\r\n"))) {
+      break;
+    }
+    if (*len >= cap) {
+      PrintError("WebSocket handshake too large\n");
+      return -1;
+    }
+    ssize_t received = recv(cli->connfd, in + *len, cap - *len, 0);
+    if (received <= 0) {
+      return -1;
+    }
+    *len += (size_t)received;
+  }
+  head_end[2] = '\0';
+
+  char key[kWebSocketKeyLimit];
+  if (strncmp(request, "GET ", 4) != 0 ||
+      FindHttpHeader(request, "Sec-WebSocket-Key", key, sizeof(key)) < 0) {
+    const char *reply = "HTTP/1.1 400 Bad Request\r\n\r\n";
+    SendToClient(cli, kLaneControl, reply, strlen(reply));
+    PrintError("Invalid WebSocket handshake\n");
+    return -1;
+  }
+
+  char accept_src[kWebSocketKeyLimit + 64];
+  uint8_t digest[kSha1DigestLen];
+  char accept[4 * ((kSha1DigestLen + 2) / 3) + 1];
+  snprintf(accept_src, sizeof(accept_src), "%s%s", key, kWebSocketGuid);
+  Sha1((const uint8_t *)accept_src, strlen(accept_src), digest);
+  Base64Encode(digest, sizeof(digest), accept);
+
+  char reply[256];
+  int reply_len = snprintf(reply, sizeof(reply),
+                           "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: %s\r\n\r\n",
+                           accept);
+  if (SendToClient(cli, kLaneControl, reply, (size_t)reply_len) < 0) {
+    return -1;
+  }
+
+  size_t consumed = (size_t)(head_end + 4 - request);
+  memmove(in, in + consumed, *len - consumed);
+  *len -= consumed;
+
+  return 0;
+}
+
+/**
+ * @brief Receives the next data message, or part of one, from a WebSocket
+ *        client.
+ *
+ * Reassembles fragmented messages and answers control frames along the way.
+ * Payload is taken as soon as it arrives, so a message longer than msg, or
+ * sent in frames larger than the input buffer, comes in several parts.
+ *
+ * @param cli      Client to receive from.
+ * @param in       Input buffer.
+ * @param len      Number of bytes buffered in in, updated on return.
+ * @param cap      Size of the input buffer.
+ * @param msg      Where the NUL-terminated message is stored.
+ * @param msg_cap  Size of msg.
+ * @param more     Where to store whether the message goes on in the next
+ *                 part.
+ *
+ * @return Returns the length of the message or part, or -1 if the client
+ *         closed the connection or sent an invalid frame.
+ */
+static ssize_t ReceiveWebSocketMessage(client_t *cli, uint8_t *in, size_t *len,
+                                       size_t cap, char *msg, size_t msg_cap,
+                                       bool *more) {
+  size_t msg_len = 0;
+
+  while (1) {
+    websocket_frame_t frame;
+    ssize_t header_len = ParseWebSocketHeader(in, *len, &frame);
+
+    if (header_len < 0) {
+      PrintError("Invalid WebSocket frame\n");
+      return -1;
+    }
+
+    size_t frame_len = 0;
+    size_t buffered = header_len > 0 ? *len - (size_t)header_len : 0;
+    int done = 0;
+    if (header_len > 0 && frame.opcode < kWebSocketClose) {
+      size_t take = frame.len;
+      if (take > buffered) {
+        take = buffered;
+      }
+      if (take > msg_cap - 1 - msg_len) {
+        take = msg_cap - 1 - msg_len;
+      }
+
+      if (take == frame.len) {
+        WebSocketUnmask(frame.payload, take, frame.payload - 4);
+        memcpy(msg + msg_len, frame.payload, take);
+        frame_len = (size_t)header_len + take;
+        done = frame.fin;
+      } else if (take > 0) {
+        frame_len = SplitWebSocketFrame(in, (size_t)header_len, &frame, take,
+                                        (uint8_t *)msg + msg_len);
+      } else if (msg_len == msg_cap - 1) {
+        msg[msg_len] = '\0';
+        *more = true;
+        return (ssize_t)msg_len;
+      }
+      msg_len += take;
+    } else if (header_len > 0 && buffered >= frame.len) {
+      WebSocketUnmask(frame.payload, frame.len, frame.payload - 4);
+      frame_len = (size_t)header_len + frame.len;
+    }
+
+    if (frame_len == 0) {
+      ssize_t received = recv(cli->connfd, in + *len, cap - *len, 0);
+      if (received <= 0) {
+        return -1;
+      }
+      *len += (size_t)received;
+      continue;
+    }
+
+    switch (frame.opcode) {
+      case kWebSocketPing: {
+        uint8_t pong[kWebSocketMaxHeaderLen + frame.len];
+        size_t pong_len = EncodeWebSocketFrame(kWebSocketPong, frame.payload,
+                                               frame.len, pong, sizeof(pong));
+        SendToClient(cli, kLaneControl, pong, pong_len);
+        break;
+      }
+      case kWebSocketPong:
+        ReceivePong(cli, frame.payload, frame.len);
+        break;
+      case kWebSocketClose: {
+        uint8_t close_frame[kWebSocketMaxHeaderLen];
+        size_t close_len = EncodeWebSocketFrame(kWebSocketClose, NULL, 0,
+                                                close_frame,
+                                                sizeof(close_frame));
+        SendToClient(cli, kLaneControl, close_frame, close_len);
+        return -1;
+      }
+      default:
+        break;
+    }
+
+    memmove(in, in + frame_len, *len - frame_len);
+    *len -= frame_len;
+
+    if (done) {
+      msg[msg_len] = '\0';
+      *more = false;
+      return (ssize_t)msg_len;
+    }
+  }
+}
+
+/**
+ * @brief Drops a trailing line terminator from a message.
+ *
+ * @return Returns the remaining length.
+ */
+static size_t TrimLineEnd(const char *msg, size_t len) {
+  while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r')) {
+    len--;
+  }
+  return len;
+}
+
+/**
+ * @brief Receives the next message and sanitizes it for fan-out.
+ *
+ * A trailing line terminator is dropped before sanitizing. What does not fit
+ * in line is received and discarded.
+ *
+ * @return Returns the sanitized length, or -1 if the client disconnected.
+ */
+static ssize_t ReceiveWebSocketLine(client_t *cli, uint8_t *in, size_t *len,
+                                    size_t cap, char *line, size_t line_cap) {
+  char raw[kMessageCharLimit];
+  char rest[kMessageCharLimit];
+  bool more;
+  ssize_t raw_len = ReceiveWebSocketMessage(cli, in, len, cap, raw,
+                                            kMessageCharLimit, &more);
+  while (raw_len >= 0 && more) {
+    if (ReceiveWebSocketMessage(cli, in, len, cap, rest, kMessageCharLimit,
+                                &more) < 0) {
+      return -1;
+    }
+  }
+  if (raw_len < 0) {
+    return -1;
+  }
+
+  return (ssize_t)SanitizeText((const uint8_t *)raw,
+                               TrimLineEnd(raw, (size_t)raw_len), line,
+                               line_cap);
+}
+
+/**
+ * @brief Performs the upgrade handshake and receives the client's name.
+ *
+ * The first data message after the handshake is the client's name.
+ *
+ * @param cli  Client connecting through the WebSocket listener.
+ * @param in   Input buffer.
+ * @param len  Number of bytes buffered in in, updated on return.
+ * @param cap  Size of the input buffer.
+ *
+ * @return Returns 0 on success, or -1 if the handshake failed or the client
+ *         disconnected.
+ */
+int AcceptWebSocket(client_t *cli, uint8_t *in, size_t *len, size_t cap) {
+  if (UpgradeConnection(cli, in, len, cap) < 0) {
+    return -1;
+  }
+
+  ssize_t name_len = ReceiveWebSocketLine(cli, in, len, cap, cli->name,
+                                          kNameCharLimit);
+  if (name_len <= 0) {
+    PrintError("Failed to receive client name\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Serves a WebSocket client until it leaves.
+ *
+ * A message too long for one line is streamed in chunks, unless it is a
+ * command, which is refused and the rest of it discarded.
+ *
+ * @param cli  Client to serve.
+ * @param in   Input buffer, possibly holding frames left from the handshake.
+ * @param len  Number of bytes buffered in in.
+ * @param cap  Size of the input buffer.
+ */
+void ServeWebSocketClient(client_t *cli, uint8_t *in, size_t len, size_t cap) {
+  char raw[kMessageCharLimit];
+  char msg[kMessageCharLimit];
+  ssize_t raw_len;
+  bool more;
+  bool skipping = false;
+
+  while ((raw_len = ReceiveWebSocketMessage(cli, in, &len, cap, raw,
+                                            kMessageCharLimit, &more)) >= 0) {
+    size_t trimmed = more ? (size_t)raw_len : TrimLineEnd(raw, (size_t)raw_len);
+    int status = 0;
+    if (skipping || (more && !cli->stream && raw[0] == '/')) {
+      // Never stream a command, or a long /msg would reach the whole room
+      if (!skipping) {
+        SendNotice(cli, kLongCommandNotice);
+      }
+      skipping = more;
+    } else if (more || cli->stream) {
+      status = PostChunk(cli, (const uint8_t *)raw, trimmed, !more);
+    } else {
+      SanitizeText((const uint8_t *)raw, trimmed, msg, kMessageCharLimit);
+      status = HandleTextLine(cli, msg);
+    }
+    if (status < 0) {
+      return;
+    }
+  }
+}
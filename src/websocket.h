@@ -0,0 +1,51 @@
+#ifndef WEBSOCKET_H_
+#define WEBSOCKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+// WebSocket (RFC 6455) transport for browser clients. Each text or binary
+// WebSocket message carries one line of the text protocol, so browser users
+// get the same commands and formatting as telnet users. Data frames are read
+// as they arrive rather than whole, so a message too long for one line is
+// streamed in chunks, like a long telnet line, whatever its frames' sizes.
+
+#define kWebSocketMaxHeaderLen 14
+#define kWebSocketHandshakeLimit 4096
+
+typedef enum {
+  kWebSocketContinuation = 0x0,
+  kWebSocketText = 0x1,
+  kWebSocketBinary = 0x2,
+  kWebSocketClose = 0x8,
+  kWebSocketPing = 0x9,
+  kWebSocketPong = 0xA,
+} websocket_opcode_t;
+
+typedef struct {
+  int fin;
+  uint8_t opcode;
+  uint8_t *payload;
+  size_t len;
+} websocket_frame_t;
+
+struct client;
+
+int FindHttpHeader(const char *request, const char *name, char *value,
+                   size_t cap);
+void WebSocketUnmask(uint8_t *data, size_t len, const uint8_t mask[4]);
+ssize_t ParseWebSocketHeader(uint8_t *buf, size_t len,
+                             websocket_frame_t *frame);
+size_t EncodeWebSocketHeader(uint8_t opcode, size_t len, uint8_t *out);
+size_t EncodeWebSocketFrame(uint8_t opcode, const void *payload, size_t len,
+                            uint8_t *out, size_t cap);
+size_t EncodeWebSocketEvent(const chat_event_t *event, uint8_t *out,
+                            size_t cap);
+int AcceptWebSocket(struct client *cli, uint8_t *in, size_t *len, size_t cap);
+void ServeWebSocketClient(struct client *cli, uint8_t *in, size_t len,
+                          size_t cap);
+
+#endif  // WEBSOCKET_H_
@@ -0,0 +1,87 @@
+/**
+ * @file ring_tail.c
+ *
+ * @brief Prints the broadcasts of a server by reading its shared-memory ring.
+ *
+ * A minimal consumer of the ring, and a starting point for bots that run on
+ * the server's host.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "shm.h"
+
+int main(int argc, char *argv[]) {
+  shm_reader_t reader;
+  uint8_t frame_buf[64 * 1024];
+  uint64_t lost = 0;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: ring_tail PATH\n");
+    return EXIT_FAILURE;
+  }
+  if (AttachRing(argv[1], &reader) < 0) {
+    fprintf(stderr, "ring_tail: failed to attach %s: %s\n", argv[1],
+            strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  while (1) {
+    ssize_t len = ReadRing(&reader, frame_buf, sizeof(frame_buf), -1);
+    if (len < 0) {
+      fprintf(stderr, "ring_tail: %s\n", strerror(errno));
+      if (errno == EMSGSIZE) {
+        continue;
+      }
+      break;
+    }
+    if (reader.lost != lost) {
+      printf("--- fell behind, %" PRIu64 " bytes lost ---\n",
+             reader.lost - lost);
+      lost = reader.lost;
+    }
+
+    frame_t frame;
+    if (ParseFrame(frame_buf, (size_t)len, (size_t)len, &frame) <= 0) {
+      continue;
+    }
+
+    uint64_t seq;
+    const uint8_t *name;
+    size_t name_len;
+    ssize_t seq_len;
+    ssize_t used;
+    switch (frame.type) {
+      case kFrameMessage:
+        seq_len = DecodeVarint(frame.payload, frame.len, &seq);
+        if (seq_len <= 0) {
+          break;
+        }
+        used = ParseString(frame.payload + seq_len,
+                           frame.len - (size_t)seq_len, &name, &name_len);
+        if (used >= 0) {
+          used += seq_len;
+          printf("[%" PRIu64 "] %.*s: %.*s\n", seq, (int)name_len, name,
+                 (int)(frame.len - (size_t)used), frame.payload + used);
+        }
+        break;
+      case kFrameJoin:
+        printf("* %.*s joined\n", (int)frame.len, frame.payload);
+        break;
+      case kFrameLeave:
+        printf("* %.*s left\n", (int)frame.len, frame.payload);
+        break;
+      default:
+        break;
+    }
+    fflush(stdout);
+  }
+
+  DetachRing(&reader);
+  return EXIT_FAILURE;
+}